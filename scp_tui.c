@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <ncurses.h>
 #include <string.h>
@@ -11,10 +12,24 @@
 #include <signal.h>
 #include <libgen.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #define PROJECT_NAME "scp-tui"
 #define MAX_HOSTS 128
 #define MAX_HOSTNAME_LEN 128
-#define MAX_FILES 1024
 #define MAX_FILENAME_LEN 256
 #define COLOR_PAIR_DEFAULT 1
 #define COLOR_PAIR_HIGHLIGHT 2
@@ -23,48 +38,296 @@
 #define COLOR_PAIR_DIRECTORY 5
 #define COLOR_PAIR_SELECTED 6
 #define COLOR_PAIR_PROGRESS 7
+#define LISTING_CACHE_SLOTS 64
+#define PREFETCH_MAX_DIRS 32
+#define TRANSFER_MAX_WORKERS 16
+#define TRANSFER_DELTA 0x01
+#define TRANSFER_WALK 0x02
+#define QUEUE_PANEL_ROWS 8
+#define STATUS_HELP_TEXT "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | U: Delta upload | S: Sync | T: Transfers | L: Bandwidth limit | R: Refresh | P: Show hidden files | Q: Quit"
 
 static int show_hidden_files = 0;
+static int local_scan_metadata = 1;
+
+typedef struct {
+    char host[MAX_HOSTNAME_LEN];
+    char control_dir[PATH_MAX - 32];
+    char control_path[PATH_MAX];
+    struct SupervisedChild *child;
+    int active;
+    char ssh_cmd[PATH_MAX + 64];
+    long last_op_ms;
+    long total_op_ms;
+    long op_count;
+} SshMaster;
+
+static SshMaster ssh_master = {0};
+
+// Byte counters for one transfer, or summed over the queue. rate is an
+// exponentially smoothed bytes/s over short sampling windows; average
+// covers the whole run. resumed bytes were already at the destination and
+// count towards done but not towards the rates.
+typedef struct {
+    int64_t done;
+    int64_t total;
+    int64_t resumed;
+    double rate;
+    double average;
+    long long started_ms;
+    long long sample_ms;
+    int64_t sample_done;
+} TransferStats;
+
+typedef struct StreamVerifier StreamVerifier;
+
+// Bytes/s cap as a token bucket; rate 0 means unlimited. tokens may go
+// negative: a large send is let through and the debt paid off by waiting
+// before the next one.
+typedef struct {
+    double rate;
+    double tokens;
+    long long refill_ms;
+} TokenBucket;
+
+// Shared by a recursive directory transfer and the file jobs it queues:
+// what the walk has found so far and how much of it has landed. Freed with
+// the last job that refers to it.
+typedef struct {
+    int refs;
+    int dirs;
+    int files_found;
+    int files_done;
+    int files_failed;
+    int skipped;
+    int64_t bytes_found;
+    int64_t bytes_done;
+    long journal_id;
+} TreeWalk;
 
 typedef struct {
     int is_active;
     int progress;
-    char source[PATH_MAX];
-    char dest[PATH_MAX];
+    TransferStats stats;
+    // Owned by the job and sized to fit: a walk can queue hundreds of
+    // thousands of jobs, so nothing per job is PATH_MAX inline.
+    char *source;
+    char *dest;
     char hostname[MAX_HOSTNAME_LEN];
     int direction;
     pthread_t thread;
     int cancel_requested;
-    FILE *pipe;
+    int attempts;
+    long long retry_at_ms;
+    const char *phase;
+    int options;
+    int64_t saved;
+    int streams;
+    double stream_rate;
+    char *names;
+    int files;
+    int files_done;
+    const char *current;
+    int64_t bundle_bytes;
+    TreeWalk *walk;
+    const char *codec;
+    int64_t wire_bytes;
+    TokenBucket bucket;
+    StreamVerifier *verifier;
+    int verified;
+    const char *cache_hit;
+    char error[128];
 } TransferStatus;
 
-static TransferStatus current_transfer = {0};
-
 typedef struct {
-    char name[MAX_FILENAME_LEN];
-    int is_dir;
-    int selected;
+    uint32_t name_offset;
+    uint16_t name_len;
+    uint8_t is_dir;
+    uint8_t selected;
+    uint32_t mode;
+    int64_t size;
+    int64_t mtime;
 } FileEntry;
 
+// Entries are compact fixed-size records; their names live back to back in
+// one NUL-separated arena, so a listing costs roughly its name bytes plus a
+// few dozen bytes per entry however long the directory is.
 typedef struct {
-    FileEntry files[MAX_FILES];
+    FileEntry *files;
     int count;
+    int capacity;
+    char *names;
+    size_t names_len;
+    size_t names_cap;
     int selected;
     int scroll_offset;
     char cwd[PATH_MAX];
 } FileList;
 
-int compare_file_entries(const void *a, const void *b) {
+static inline const char *file_name(const FileList *list, int index) {
+    return list->names + list->files[index].name_offset;
+}
+
+int compare_file_entries(const void *a, const void *b, void *arena) {
     const FileEntry *fa = (const FileEntry *)a;
     const FileEntry *fb = (const FileEntry *)b;
+    const char *name_a = (const char *)arena + fa->name_offset;
+    const char *name_b = (const char *)arena + fb->name_offset;
     
-    if (strcmp(fa->name, "..") == 0) return -1;
-    if (strcmp(fb->name, "..") == 0) return 1;
+    if (strcmp(name_a, "..") == 0) return -1;
+    if (strcmp(name_b, "..") == 0) return 1;
     
     if (fa->is_dir && !fb->is_dir) return -1;
     if (!fa->is_dir && fb->is_dir) return 1;
     
-    return strcasecmp(fa->name, fb->name);
+    return strcasecmp(name_a, name_b);
+}
+
+void sort_file_list(FileList *list) {
+    if (list->count > 1) {
+        qsort_r(list->files, list->count, sizeof(FileEntry), compare_file_entries, list->names);
+    }
+}
+
+long env_long(const char *name, long fallback) {
+    const char *value = getenv(name);
+    if (!value || !*value) return fallback;
+    char *end;
+    long result = strtol(value, &end, 10);
+    return (*end == '\0' && result >= 0) ? result : fallback;
+}
+
+// Returns NULL when the allocation fails, leaving buf and *cap as they
+// were so the caller can fail the operation and still free buf.
+static void *grow_buffer(void *buf, size_t *cap, size_t needed, size_t unit, size_t initial) {
+    if (needed <= *cap) return buf;
+    size_t new_cap = *cap ? *cap : initial;
+    while (new_cap < needed) new_cap *= 2;
+    if (new_cap > SIZE_MAX / unit) return NULL;
+    void *tmp = realloc(buf, new_cap * unit);
+    if (tmp == NULL) return NULL;
+    *cap = new_cap;
+    return tmp;
+}
+
+void file_list_free(FileList *list) {
+    free(list->files);
+    free(list->names);
+    list->files = NULL;
+    list->names = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    list->names_len = 0;
+    list->names_cap = 0;
+}
+
+void file_list_reset(FileList *list) {
+    list->count = 0;
+    list->names_len = 0;
+}
+
+size_t file_list_memory(const FileList *list) {
+    return (size_t)list->capacity * sizeof(FileEntry) + list->names_cap;
+}
+
+// Returns NULL, with the list unchanged, when it cannot grow.
+FileEntry *add_file_entry_n(FileList *list, const char *name, size_t name_len, int is_dir) {
+    if (name_len > UINT16_MAX) name_len = UINT16_MAX;
+    size_t capacity = list->capacity;
+    FileEntry *files = grow_buffer(list->files, &capacity, list->count + 1, sizeof(FileEntry), 64);
+    if (!files) return NULL;
+    list->files = files;
+    list->capacity = capacity;
+    char *names = grow_buffer(list->names, &list->names_cap, list->names_len + name_len + 1, 1, 4096);
+    if (!names) return NULL;
+    list->names = names;
+
+    FileEntry *e = &list->files[list->count++];
+    memset(e, 0, sizeof(*e));
+    e->name_offset = list->names_len;
+    e->name_len = name_len;
+    memcpy(list->names + list->names_len, name, name_len);
+    list->names[list->names_len + name_len] = '\0';
+    list->names_len += name_len + 1;
+    e->is_dir = is_dir;
+    e->size = -1;
+    return e;
+}
+
+FileEntry *add_file_entry(FileList *list, const char *name, int is_dir) {
+    return add_file_entry_n(list, name, strlen(name), is_dir);
+}
+
+// Appends src entries [from, src->count) to dst, re-homing their names in
+// dst's arena. ".." is skipped when dst already starts with one. Stops at
+// the first entry that does not fit; the callers only preview a listing
+// that is copied whole once it completes.
+void file_list_append(FileList *dst, const FileList *src, int from) {
+    for (int i = from; i < src->count; i++) {
+        const FileEntry *se = &src->files[i];
+        const char *name = file_name(src, i);
+        if (dst->count > 0 && strcmp(name, "..") == 0) continue;
+        FileEntry *de = add_file_entry_n(dst, name, se->name_len, se->is_dir);
+        if (!de) return;
+        uint32_t offset = de->name_offset;
+        uint16_t len = de->name_len;
+        *de = *se;
+        de->name_offset = offset;
+        de->name_len = len;
+    }
+}
+
+// Returns 0, leaving dst's entries as they were, when it cannot grow.
+int file_list_copy(FileList *dst, const FileList *src) {
+    size_t capacity = dst->capacity;
+    FileEntry *files = grow_buffer(dst->files, &capacity, src->count ? src->count : 1, sizeof(FileEntry), 64);
+    if (!files) return 0;
+    dst->files = files;
+    dst->capacity = capacity;
+    char *names = grow_buffer(dst->names, &dst->names_cap, src->names_len ? src->names_len : 1, 1, 4096);
+    if (!names) return 0;
+    dst->names = names;
+    memcpy(dst->files, src->files, src->count * sizeof(FileEntry));
+    memcpy(dst->names, src->names, src->names_len);
+    dst->count = src->count;
+    dst->names_len = src->names_len;
+    dst->selected = src->selected;
+    dst->scroll_offset = src->scroll_offset;
+    memcpy(dst->cwd, src->cwd, PATH_MAX);
+    return 1;
+}
+
+// Returns 0 when the joined path was cut short to fit in size.
+int join_path(char *out, size_t size, const char *dir, const char *name) {
+    int n;
+    if (strcmp(dir, "/") == 0) {
+        n = snprintf(out, size, "/%s", name);
+    } else {
+        n = snprintf(out, size, "%s/%s", dir, name);
+    }
+    return n >= 0 && (size_t)n < size;
+}
+
+void format_size(char *buf, size_t size, long long bytes) {
+    const char *units[] = {"B", "K", "M", "G", "T"};
+    double value = bytes;
+    int unit = 0;
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    if (unit == 0) {
+        snprintf(buf, size, "%lld", bytes);
+    } else {
+        snprintf(buf, size, "%.1f%s", value, units[unit]);
+    }
+}
+
+void format_duration(char *buf, size_t size, long long seconds) {
+    if (seconds >= 3600) {
+        snprintf(buf, size, "%lld:%02lld:%02lld", seconds / 3600, seconds / 60 % 60, seconds % 60);
+    } else {
+        snprintf(buf, size, "%lld:%02lld", seconds / 60, seconds % 60);
+    }
 }
 
 int parse_ssh_config(char hosts[][MAX_HOSTNAME_LEN], int max_hosts) {
@@ -95,312 +358,6864 @@ int parse_ssh_config(char hosts[][MAX_HOSTNAME_LEN], int max_hosts) {
     return count;
 }
 
-void read_local_dir(FileList *list, const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) return;
-    struct dirent *entry;
-    list->count = 0;
-    
-    strncpy(list->files[list->count].name, "..", MAX_FILENAME_LEN-1);
-    list->files[list->count].name[MAX_FILENAME_LEN-1] = '\0';
-    list->files[list->count].is_dir = 1;
-    list->count++;
-    
-    strncpy(list->cwd, path, PATH_MAX-1);
-    list->cwd[PATH_MAX-1] = '\0';
-    
-    while ((entry = readdir(dir)) && list->count < MAX_FILES) {
-        if (strcmp(entry->d_name, ".") == 0) continue;
-        if (strcmp(entry->d_name, "..") == 0) continue;
-        if (!show_hidden_files && entry->d_name[0] == '.') continue;
-        
-        strncpy(list->files[list->count].name, entry->d_name, MAX_FILENAME_LEN-1);
-        list->files[list->count].name[MAX_FILENAME_LEN-1] = '\0';
-        
-        char full_path[PATH_MAX];
-        snprintf(full_path, PATH_MAX, "%s/%s", path, entry->d_name);
-        DIR *check = opendir(full_path);
-        list->files[list->count].is_dir = (check != NULL);
-        if (check) closedir(check);
-        
-        list->count++;
+static long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+void record_remote_op(const struct timespec *start) {
+    ssh_master.last_op_ms = elapsed_ms(start);
+    ssh_master.total_op_ms += ssh_master.last_op_ms;
+    ssh_master.op_count++;
+}
+
+const char *ssh_command(void) {
+    return ssh_master.active ? ssh_master.ssh_cmd : "ssh";
+}
+
+// Single-quotes s for a POSIX shell, each ' becoming '\''. Returns 0, with
+// out emptied, when the quoted form does not fit in size bytes.
+static int shell_quote(char *out, size_t size, const char *s) {
+    size_t n = 0;
+    if (size < 3) goto overflow;
+    out[n++] = '\'';
+    for (; *s; s++) {
+        if (*s == '\'') {
+            if (n + 4 >= size) goto overflow;
+            memcpy(out + n, "'\\''", 4);
+            n += 4;
+        } else {
+            if (n + 1 >= size) goto overflow;
+            out[n++] = *s;
+        }
     }
-    closedir(dir);
-    
-    if (list->count > 1) {
-        qsort(&list->files[0], list->count, sizeof(FileEntry), compare_file_entries);
+    if (n + 2 > size) goto overflow;
+    out[n++] = '\'';
+    out[n] = '\0';
+    return 1;
+overflow:
+    if (size > 0) out[0] = '\0';
+    return 0;
+}
+
+// Room for any path through shell_quote.
+#define QUOTED_PATH_MAX (PATH_MAX * 4 + 3)
+
+// "ssh host 'remote'" for /bin/sh -c: remote, whose own arguments are
+// already quoted for the remote shell, is quoted once more for the local
+// one. Returns 0 when the command does not fit.
+static int ssh_remote_command(char *cmd, size_t size, const char *host, const char *remote) {
+    int n = snprintf(cmd, size, "%s %s ", ssh_command(), host);
+    return n >= 0 && (size_t)n < size && shell_quote(cmd + n, size - n, remote);
+}
+
+typedef struct SupervisedChild SupervisedChild;
+
+typedef struct {
+    SupervisedChild *child;
+    int is_exit;
+} SupervisorWatch;
+
+// One spawned process. Its output is kept up to output_limit bytes (the
+// tail, when it overflows). The supervisor thread owns every field until
+// done is set; after that the spawner reads it and releases the child.
+struct SupervisedChild {
+    pid_t pid;
+    // Signals go to the whole process group unless the child was left in ours.
+    int own_group;
+    int pidfd;
+    int out_fd;
+    int exited;
+    int status;
+    int done;
+    long long exited_ms;
+    long long kill_at_ms;
+    char *output;
+    size_t output_len;
+    size_t output_cap;
+    size_t output_limit;
+    int output_lost;
+    // Set once the head of the output has been dropped to stay in the limit.
+    int output_dropped;
+    SupervisorWatch watch_out;
+    SupervisorWatch watch_exit;
+    SupervisedChild *next;
+};
+
+// All children are watched by one thread through one epoll set: pidfds
+// report exits, pipes report output. Kernels without pidfd_open fall back
+// to polling waitpid on a short tick.
+typedef struct {
+    int epoll_fd;
+    int wake_fd;
+    pthread_t thread;
+    pthread_once_t once;
+    int ok;
+    SupervisedChild *children;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} Supervisor;
+
+static Supervisor supervisor = {
+    .epoll_fd = -1,
+    .wake_fd = -1,
+    .once = PTHREAD_ONCE_INIT,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+#define SUPERVISOR_KILL_GRACE_MS 2000
+#define SUPERVISOR_OUTPUT_LINGER_MS 1000
+
+static void supervisor_kill(SupervisedChild *c, int sig) {
+    kill(c->own_group ? -c->pid : c->pid, sig);
+}
+
+static void supervisor_close_output(SupervisedChild *c) {
+    epoll_ctl(supervisor.epoll_fd, EPOLL_CTL_DEL, c->out_fd, NULL);
+    close(c->out_fd);
+    c->out_fd = -1;
+}
+
+static void supervisor_read_output(SupervisedChild *c) {
+    char buf[65536];
+    while (c->out_fd >= 0) {
+        ssize_t n = read(c->out_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            supervisor_close_output(c);
+            return;
+        }
+        if (c->output_limit == 0) continue;
+        size_t keep = (size_t)n > c->output_limit ? c->output_limit : (size_t)n;
+        const char *data = buf + n - keep;
+        if (c->output_len + keep > c->output_limit) {
+            size_t drop = c->output_len + keep - c->output_limit;
+            memmove(c->output, c->output + drop, c->output_len - drop);
+            c->output_len -= drop;
+            c->output_dropped = 1;
+        }
+        char *grown = grow_buffer(c->output, &c->output_cap, c->output_len + keep + 1, 1, 4096);
+        if (!grown) {
+            // Output the caller would parse is gone, so the child fails.
+            c->output_lost = 1;
+            if (!c->exited) supervisor_kill(c, SIGKILL);
+            supervisor_close_output(c);
+            return;
+        }
+        c->output = grown;
+        memcpy(c->output + c->output_len, data, keep);
+        c->output_len += keep;
+        c->output[c->output_len] = '\0';
     }
-    
-    list->selected = 0;
-    list->scroll_offset = 0;
 }
 
-int read_remote_dir(FileList *list, const char *host, const char *path) {
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), 
-             "ssh %s 'cd \"%s\" 2>/dev/null && ls -la | awk \"NR>2 {printf \\\"%%s|%%s\\n\\\", \\$1, \\$NF}\"'", 
-             host, path);
-    
-    FILE *fp = popen(cmd, "r");
-    if (!fp) return 0;
-    
-    list->count = 0;
-    
-    strncpy(list->files[list->count].name, "..", MAX_FILENAME_LEN-1);
-    list->files[list->count].name[MAX_FILENAME_LEN-1] = '\0';
-    list->files[list->count].is_dir = 1;
-    list->count++;
-    
-    strncpy(list->cwd, path, PATH_MAX-1);
-    list->cwd[PATH_MAX-1] = '\0';
-    
-    char line[MAX_FILENAME_LEN * 2];
-    while (fgets(line, sizeof(line), fp) && list->count < MAX_FILES) {
-        char permissions[11];
-        
-        char *perm_end = strchr(line, '|');
-        if (!perm_end) continue;
-        
-        *perm_end = '\0';
-        strncpy(permissions, line, sizeof(permissions)-1);
-        permissions[sizeof(permissions)-1] = '\0';
-        
-        char *name_start = perm_end + 1;
-        size_t len = strlen(name_start);
-        if (len > 0 && name_start[len-1] == '\n')
-            name_start[len-1] = '\0';
-            
-        if (strcmp(name_start, ".") == 0 || strcmp(name_start, "..") == 0)
-            continue;
-        if (!show_hidden_files && name_start[0] == '.') continue;
-        
-        strncpy(list->files[list->count].name, name_start, MAX_FILENAME_LEN-1);
-        list->files[list->count].name[MAX_FILENAME_LEN-1] = '\0';
-        
-        list->files[list->count].is_dir = (permissions[0] == 'd');
-        
-        list->count++;
+static void supervisor_reap(SupervisedChild *c) {
+    int status;
+    if (c->exited || waitpid(c->pid, &status, WNOHANG) != c->pid) return;
+    c->exited = 1;
+    c->status = status;
+    c->exited_ms = monotonic_ms();
+    if (c->pidfd >= 0) {
+        epoll_ctl(supervisor.epoll_fd, EPOLL_CTL_DEL, c->pidfd, NULL);
+        close(c->pidfd);
+        c->pidfd = -1;
     }
-    pclose(fp);
-    
-    if (list->count > 1) {
-        qsort(&list->files[0], list->count, sizeof(FileEntry), compare_file_entries);
+}
+
+static void *supervisor_thread(void *arg) {
+    (void)arg;
+    struct epoll_event events[32];
+    int timeout = -1;
+    while (1) {
+        int n = epoll_wait(supervisor.epoll_fd, events, 32, timeout);
+        if (n < 0 && errno != EINTR) break;
+
+        pthread_mutex_lock(&supervisor.lock);
+        for (int i = 0; i < n; i++) {
+            SupervisorWatch *w = events[i].data.ptr;
+            if (!w) {
+                uint64_t v;
+                while (read(supervisor.wake_fd, &v, sizeof(v)) < 0 && errno == EINTR) {
+                }
+            } else if (w->is_exit) {
+                supervisor_reap(w->child);
+            } else {
+                supervisor_read_output(w->child);
+            }
+        }
+
+        long long now = monotonic_ms();
+        int changed = 0;
+        timeout = -1;
+        for (SupervisedChild *c = supervisor.children; c; c = c->next) {
+            if (c->done) continue;
+            if (c->pidfd < 0) supervisor_reap(c);
+            if (c->exited && c->out_fd >= 0 && now - c->exited_ms >= SUPERVISOR_OUTPUT_LINGER_MS) {
+                // A grandchild kept the pipe open; the output we wanted is in.
+                supervisor_close_output(c);
+            }
+            if (!c->exited && c->kill_at_ms && now >= c->kill_at_ms) {
+                supervisor_kill(c, SIGKILL);
+                c->kill_at_ms = 0;
+            }
+            if (c->exited && c->out_fd < 0) {
+                c->done = 1;
+                changed = 1;
+                continue;
+            }
+            long long due = -1;
+            if (c->pidfd < 0 && !c->exited) due = 100;
+            if (c->exited) due = c->exited_ms + SUPERVISOR_OUTPUT_LINGER_MS - now;
+            if (c->kill_at_ms) {
+                long long left = c->kill_at_ms - now;
+                if (due < 0 || left < due) due = left;
+            }
+            if (due >= 0 && (timeout < 0 || due < timeout)) timeout = due > 0 ? (int)due : 0;
+        }
+        if (changed) pthread_cond_broadcast(&supervisor.cond);
+        pthread_mutex_unlock(&supervisor.lock);
     }
-    
-    list->selected = 0;
-    list->scroll_offset = 0;
-    return 1;
+    return NULL;
 }
 
-void draw_file_list(WINDOW *win, FileList *list, int focus, int width, int height, const char *title) {
-    werase(win);
-    box(win, 0, 0);
-    mvwprintw(win, 0, (width - strlen(title)) / 2, "%s", title);
-    
-    int display_count = height - 2;
-    
-    for (int i = 0; i < display_count; ++i) {
-        int file_index = list->scroll_offset + i;
-        if (file_index >= list->count) break;
-        
-        int screen_y = i + 1;
-        
-        if (file_index == list->selected && focus) {
-            wattron(win, A_REVERSE);
+static void supervisor_init(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&supervisor.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    supervisor.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    supervisor.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (supervisor.epoll_fd < 0 || supervisor.wake_fd < 0) return;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(supervisor.epoll_fd, EPOLL_CTL_ADD, supervisor.wake_fd, &ev) < 0) return;
+    if (pthread_create(&supervisor.thread, NULL, supervisor_thread, NULL) != 0) return;
+    pthread_detach(supervisor.thread);
+    supervisor.ok = 1;
+}
+
+static void supervisor_wake(void) {
+    uint64_t one = 1;
+    if (write(supervisor.wake_fd, &one, sizeof(one)) < 0) {
+        // The counter is already non-zero, which wakes the loop just as well.
+    }
+}
+
+// Starts argv[0] from PATH, in its own process group unless own_group is
+// 0. stdin and stdout are the given fds, or /dev/null and the capture pipe
+// when negative; stderr shares the capture pipe when asked and goes to
+// /dev/null otherwise, so it cannot scribble over the curses screen.
+// Returns NULL if it cannot run.
+static SupervisedChild *supervisor_start(char *const argv[], size_t output_limit, int with_stderr,
+                                         int in_fd, int out_fd, int own_group) {
+    pthread_once(&supervisor.once, supervisor_init);
+    if (!supervisor.ok) return NULL;
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return NULL;
+    SupervisedChild *c = calloc(1, sizeof(SupervisedChild));
+    if (!c) {
+        close(fds[0]);
+        close(fds[1]);
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, out_fd >= 0 ? out_fd : fds[1], STDOUT_FILENO);
+    if (with_stderr) {
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDERR_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    }
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t mask, defaults;
+    sigemptyset(&mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGTERM);
+    sigaddset(&defaults, SIGINT);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (own_group) {
+        posix_spawnattr_setpgroup(&attr, 0);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    int err = posix_spawnp(&c->pid, argv[0], &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        free(c);
+        return NULL;
+    }
+
+    c->own_group = own_group;
+    c->out_fd = fds[0];
+    fcntl(c->out_fd, F_SETFL, fcntl(c->out_fd, F_GETFL) | O_NONBLOCK);
+    c->pidfd = (int)syscall(SYS_pidfd_open, c->pid, 0);
+    c->output_limit = output_limit;
+    c->watch_out = (SupervisorWatch){c, 0};
+    c->watch_exit = (SupervisorWatch){c, 1};
+
+    pthread_mutex_lock(&supervisor.lock);
+    c->next = supervisor.children;
+    supervisor.children = c;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &c->watch_out};
+    epoll_ctl(supervisor.epoll_fd, EPOLL_CTL_ADD, c->out_fd, &ev);
+    if (c->pidfd >= 0) {
+        ev.data.ptr = &c->watch_exit;
+        if (epoll_ctl(supervisor.epoll_fd, EPOLL_CTL_ADD, c->pidfd, &ev) < 0) {
+            close(c->pidfd);
+            c->pidfd = -1;
         }
-        
-        char prefix[3] = "  ";
-        if (list->files[file_index].selected) {
-            strcpy(prefix, "* ");
+    }
+    pthread_mutex_unlock(&supervisor.lock);
+    supervisor_wake();
+    return c;
+}
+
+SupervisedChild *supervisor_spawn(char *const argv[], size_t output_limit, int with_stderr) {
+    return supervisor_start(argv, output_limit, with_stderr, -1, -1, 1);
+}
+
+// Like supervisor_spawn, but the child reads in_fd and writes out_fd (either
+// may be -1 for the defaults); what is captured is its stderr.
+SupervisedChild *supervisor_spawn_piped(char *const argv[], size_t output_limit, int in_fd, int out_fd) {
+    return supervisor_start(argv, output_limit, 1, in_fd, out_fd, 1);
+}
+
+// Like supervisor_spawn, but the child stays in our process group, so it
+// may prompt on the terminal while curses is suspended. It still does not
+// get the terminal as stdin; stderr is captured.
+SupervisedChild *supervisor_spawn_foreground(char *const argv[], size_t output_limit) {
+    return supervisor_start(argv, output_limit, 1, -1, -1, 0);
+}
+
+// Waits up to timeout_ms (forever if negative) for the child to exit and
+// its output to drain. Returns 1 once it has.
+int supervisor_wait(SupervisedChild *c, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&supervisor.lock);
+    while (!c->done) {
+        if (timeout_ms < 0) {
+            pthread_cond_wait(&supervisor.cond, &supervisor.lock);
+        } else if (pthread_cond_timedwait(&supervisor.cond, &supervisor.lock, &deadline) == ETIMEDOUT) {
+            break;
         }
-        
-        if (list->files[file_index].is_dir) {
-            wattron(win, COLOR_PAIR(COLOR_PAIR_DIRECTORY));
-            mvwprintw(win, screen_y, 1, "%s%-*s", prefix, width-4, list->files[file_index].name);
-            wattroff(win, COLOR_PAIR(COLOR_PAIR_DIRECTORY));
-        } else {
-            if (list->files[file_index].selected) {
-                wattron(win, COLOR_PAIR(COLOR_PAIR_SELECTED));
-            }
-            mvwprintw(win, screen_y, 1, "%s%-*s", prefix, width-4, list->files[file_index].name);
-            if (list->files[file_index].selected) {
-                wattroff(win, COLOR_PAIR(COLOR_PAIR_SELECTED));
+    }
+    int done = c->done;
+    pthread_mutex_unlock(&supervisor.lock);
+    return done;
+}
+
+// SIGTERM to the child's process group now, SIGKILL if it is still there
+// after the grace period. The pid cannot have been recycled: only the
+// supervisor reaps it, under the same lock.
+void supervisor_terminate(SupervisedChild *c) {
+    pthread_mutex_lock(&supervisor.lock);
+    if (!c->exited) {
+        supervisor_kill(c, SIGTERM);
+        c->kill_at_ms = monotonic_ms() + SUPERVISOR_KILL_GRACE_MS;
+    }
+    pthread_mutex_unlock(&supervisor.lock);
+    supervisor_wake();
+}
+
+int supervisor_exit_code(const SupervisedChild *c) {
+    if (c->output_lost) return -1;
+    return WIFEXITED(c->status) ? WEXITSTATUS(c->status) : -1;
+}
+
+// Frees a child that supervisor_wait reported done.
+void supervisor_release(SupervisedChild *c) {
+    pthread_mutex_lock(&supervisor.lock);
+    for (SupervisedChild **link = &supervisor.children; *link; link = &(*link)->next) {
+        if (*link == c) {
+            *link = c->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&supervisor.lock);
+    free(c->output);
+    free(c);
+}
+
+// Runs a shell command to completion and hands back a stream over its
+// output, for the places that used popen. *output must be freed after the
+// stream is closed.
+FILE *capture_command(const char *cmd, char **output) {
+    char *argv[] = {"/bin/sh", "-c", (char *)cmd, NULL};
+    *output = NULL;
+    SupervisedChild *c = supervisor_spawn(argv, 64 << 20, 0);
+    if (!c) return NULL;
+    supervisor_wait(c, -1);
+    *output = c->output;
+    size_t len = c->output_len;
+    c->output = NULL;
+    supervisor_release(c);
+    FILE *fp = len ? fmemopen(*output, len, "r") : fopen("/dev/null", "r");
+    if (!fp) {
+        free(*output);
+        *output = NULL;
+    }
+    return fp;
+}
+
+#define UI_FRAME_MS 50
+#define UI_TICK_MS 1000
+
+// Worker threads poke this eventfd when they have something to show; the
+// key loop sleeps on it together with stdin.
+static int ui_wake_fd = -1;
+
+void ui_notify(void) {
+    if (ui_wake_fd < 0) return;
+    uint64_t one = 1;
+    if (write(ui_wake_fd, &one, sizeof(one)) < 0) {
+        // Already signalled and not yet drained; nothing is lost.
+    }
+}
+
+// Returns the next key, or ERR when the screen should be redrawn: a worker
+// posted an event (coalesced to at most one frame per UI_FRAME_MS), or
+// tick_ms passed since the last frame. With no tick and no events it sleeps
+// until a key arrives.
+int ui_wait_key(WINDOW *win, long long *last_frame_ms, int tick_ms) {
+    nodelay(win, TRUE);
+    int ch = wgetch(win);
+    int pending = 0;
+    while (ch == ERR) {
+        long long now = monotonic_ms();
+        long long due = -1;
+        if (pending) due = *last_frame_ms + UI_FRAME_MS;
+        else if (tick_ms > 0) due = *last_frame_ms + tick_ms;
+        if (due >= 0 && now >= due) break;
+
+        struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {ui_wake_fd, POLLIN, 0}};
+        // Once an event is pending only a key can cut the frame wait short.
+        int n = poll(fds, ui_wake_fd >= 0 && !pending ? 2 : 1, due >= 0 ? (int)(due - now) : -1);
+        if (n < 0 && errno != EINTR) break;
+        if (n <= 0) continue;
+        if (fds[0].revents) {
+            ch = wgetch(win);
+        }
+        if (ui_wake_fd >= 0 && (fds[1].revents & POLLIN)) {
+            uint64_t count;
+            if (read(ui_wake_fd, &count, sizeof(count)) == sizeof(count)) pending = 1;
+        }
+    }
+    nodelay(win, FALSE);
+    *last_frame_ms = monotonic_ms();
+    return ch;
+}
+
+static int run_quiet(char *const argv[]) {
+    SupervisedChild *c = supervisor_spawn(argv, 0, 0);
+    if (!c) return -1;
+    supervisor_wait(c, -1);
+    int code = supervisor_exit_code(c);
+    supervisor_release(c);
+    return code;
+}
+
+static int ssh_master_check(void) {
+    char *argv[] = {"ssh", "-S", ssh_master.control_path, "-O", "check", ssh_master.host, NULL};
+    return run_quiet(argv) == 0;
+}
+
+// Opens one ControlMaster connection that every later ssh/scp invocation
+// multiplexes over, so only the first command pays for the handshake.
+int start_ssh_master(const char *host) {
+    const char *tmp = getenv("XDG_RUNTIME_DIR");
+    if (!tmp || !*tmp) tmp = getenv("TMPDIR");
+    if (!tmp || !*tmp) tmp = "/tmp";
+
+    memset(&ssh_master, 0, sizeof(ssh_master));
+    strncpy(ssh_master.host, host, MAX_HOSTNAME_LEN-1);
+    snprintf(ssh_master.control_dir, sizeof(ssh_master.control_dir), "%s/%s-XXXXXX", tmp, PROJECT_NAME);
+    if (!mkdtemp(ssh_master.control_dir)) {
+        ssh_master.control_dir[0] = '\0';
+        return 0;
+    }
+    snprintf(ssh_master.control_path, sizeof(ssh_master.control_path), "%s/master.sock", ssh_master.control_dir);
+
+    char *argv[] = {"ssh", "-M", "-S", ssh_master.control_path,
+                    "-o", "ControlPersist=no", "-o", "ServerAliveInterval=30",
+                    "-n", "-N", ssh_master.host, NULL};
+    ssh_master.child = supervisor_spawn_foreground(argv, 4096);
+    if (!ssh_master.child) return 0;
+
+    // Authentication may prompt on the terminal, so wait until the master
+    // either answers a control check or exits.
+    for (int i = 0; i < 1200; i++) {
+        if (supervisor_wait(ssh_master.child, 0)) {
+            // Curses is down; say why ssh gave up.
+            if (ssh_master.child->output) fputs(ssh_master.child->output, stderr);
+            supervisor_release(ssh_master.child);
+            ssh_master.child = NULL;
+            return 0;
+        }
+        struct stat st;
+        if (stat(ssh_master.control_path, &st) == 0 && S_ISSOCK(st.st_mode) && ssh_master_check()) {
+            snprintf(ssh_master.ssh_cmd, sizeof(ssh_master.ssh_cmd),
+                     "ssh -o ControlMaster=no -o ControlPath='%s'", ssh_master.control_path);
+            ssh_master.active = 1;
+            return 1;
+        }
+        napms(50);
+    }
+    return 0;
+}
+
+void stop_ssh_master(void) {
+    if (ssh_master.child) {
+        if (ssh_master.active) {
+            char *argv[] = {"ssh", "-S", ssh_master.control_path, "-O", "exit", ssh_master.host, NULL};
+            run_quiet(argv);
+        }
+        if (!supervisor_wait(ssh_master.child, 2000)) {
+            supervisor_terminate(ssh_master.child);
+            supervisor_wait(ssh_master.child, -1);
+        }
+        supervisor_release(ssh_master.child);
+        ssh_master.child = NULL;
+    }
+    ssh_master.active = 0;
+    if (ssh_master.control_dir[0]) {
+        unlink(ssh_master.control_path);
+        rmdir(ssh_master.control_dir);
+        ssh_master.control_dir[0] = '\0';
+    }
+}
+
+#define SSH_FXP_INIT 1
+#define SSH_FXP_VERSION 2
+#define SSH_FXP_OPEN 3
+#define SSH_FXP_CLOSE 4
+#define SSH_FXP_READ 5
+#define SSH_FXP_WRITE 6
+#define SSH_FXP_LSTAT 7
+#define SSH_FXP_FSTAT 8
+#define SSH_FXP_SETSTAT 9
+#define SSH_FXP_FSETSTAT 10
+#define SSH_FXP_OPENDIR 11
+#define SSH_FXP_READDIR 12
+#define SSH_FXP_REMOVE 13
+#define SSH_FXP_MKDIR 14
+#define SSH_FXP_RMDIR 15
+#define SSH_FXP_REALPATH 16
+#define SSH_FXP_STAT 17
+#define SSH_FXP_RENAME 18
+#define SSH_FXP_STATUS 101
+#define SSH_FXP_HANDLE 102
+#define SSH_FXP_DATA 103
+#define SSH_FXP_NAME 104
+#define SSH_FXP_ATTRS 105
+#define SSH_FXP_EXTENDED 200
+#define SSH_FXP_EXTENDED_REPLY 201
+#define SSH_FX_OK 0
+#define SSH_FX_EOF 1
+#define SSH_FX_NO_SUCH_FILE 2
+#define SSH_FX_FAILURE 4
+#define SSH_FXF_READ 0x01
+#define SSH_FXF_WRITE 0x02
+#define SSH_FXF_APPEND 0x04
+#define SSH_FXF_CREAT 0x08
+#define SSH_FXF_TRUNC 0x10
+#define SSH_FXF_EXCL 0x20
+#define SSH_FILEXFER_ATTR_SIZE 0x01
+#define SSH_FILEXFER_ATTR_UIDGID 0x02
+#define SSH_FILEXFER_ATTR_PERMISSIONS 0x04
+#define SSH_FILEXFER_ATTR_ACMODTIME 0x08
+#define SSH_FILEXFER_ATTR_EXTENDED 0x80000000u
+#define SFTP_MAX_PACKET (256 * 1024 + 1024)
+#define SFTP_MAX_OUTSTANDING 64
+#define SFTP_CHUNK_SIZE 32768
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+    size_t pos;
+    // Set when a put could not grow the buffer; sftp_send refuses it.
+    int failed;
+} SftpBuf;
+
+typedef struct {
+    uint32_t flags;
+    uint64_t size;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t permissions;
+    uint32_t atime;
+    uint32_t mtime;
+} SftpAttrs;
+
+typedef struct {
+    unsigned char data[256];
+    uint32_t len;
+} SftpHandle;
+
+typedef struct SftpRequest {
+    uint32_t id;
+    int done;
+    unsigned char type;
+    SftpBuf reply;
+    // A READ with a sink has its data landed in sink_fd at sink_offset by
+    // the reader thread instead of kept in reply; sunk is how much landed.
+    int sink_fd;
+    uint64_t sink_offset;
+    uint32_t sink_len;
+    uint32_t sunk;
+    struct SftpRequest *next;
+} SftpRequest;
+
+typedef struct {
+    SupervisedChild *child;
+    int to_fd;
+    int from_fd;
+    int alive;
+    uint32_t version;
+    uint32_t next_id;
+    int has_posix_rename;
+    int has_fsync;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_mutex_t write_lock;
+    pthread_cond_t cond;
+    SftpRequest *pending;
+} SftpSession;
+
+static SftpSession sftp_session = {0};
+
+static int sftp_buf_reserve(SftpBuf *b, size_t extra) {
+    if (b->failed) return 0;
+    if (b->len + extra <= b->cap) return 1;
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra) cap *= 2;
+    unsigned char *tmp = realloc(b->data, cap);
+    if (tmp == NULL) {
+        b->failed = 1;
+        return 0;
+    }
+    b->data = tmp;
+    b->cap = cap;
+    return 1;
+}
+
+static void sftp_buf_free(SftpBuf *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+static void sftp_put_u8(SftpBuf *b, uint8_t v) {
+    if (!sftp_buf_reserve(b, 1)) return;
+    b->data[b->len++] = v;
+}
+
+static void sftp_put_u32(SftpBuf *b, uint32_t v) {
+    if (!sftp_buf_reserve(b, 4)) return;
+    b->data[b->len++] = v >> 24;
+    b->data[b->len++] = v >> 16;
+    b->data[b->len++] = v >> 8;
+    b->data[b->len++] = v;
+}
+
+static void sftp_put_u64(SftpBuf *b, uint64_t v) {
+    sftp_put_u32(b, (uint32_t)(v >> 32));
+    sftp_put_u32(b, (uint32_t)v);
+}
+
+static void sftp_put_string(SftpBuf *b, const void *data, uint32_t len) {
+    sftp_put_u32(b, len);
+    if (!sftp_buf_reserve(b, len)) return;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void sftp_put_cstring(SftpBuf *b, const char *s) {
+    sftp_put_string(b, s, strlen(s));
+}
+
+static void sftp_put_attrs(SftpBuf *b, const SftpAttrs *a) {
+    uint32_t flags = a ? a->flags & ~SSH_FILEXFER_ATTR_EXTENDED : 0;
+    sftp_put_u32(b, flags);
+    if (flags & SSH_FILEXFER_ATTR_SIZE) sftp_put_u64(b, a->size);
+    if (flags & SSH_FILEXFER_ATTR_UIDGID) {
+        sftp_put_u32(b, a->uid);
+        sftp_put_u32(b, a->gid);
+    }
+    if (flags & SSH_FILEXFER_ATTR_PERMISSIONS) sftp_put_u32(b, a->permissions);
+    if (flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+        sftp_put_u32(b, a->atime);
+        sftp_put_u32(b, a->mtime);
+    }
+}
+
+static int sftp_get_u8(SftpBuf *b, uint8_t *v) {
+    if (b->pos + 1 > b->len) return 0;
+    *v = b->data[b->pos++];
+    return 1;
+}
+
+static int sftp_get_u32(SftpBuf *b, uint32_t *v) {
+    if (b->pos + 4 > b->len) return 0;
+    const unsigned char *p = b->data + b->pos;
+    *v = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    b->pos += 4;
+    return 1;
+}
+
+static int sftp_get_u64(SftpBuf *b, uint64_t *v) {
+    uint32_t hi, lo;
+    if (!sftp_get_u32(b, &hi) || !sftp_get_u32(b, &lo)) return 0;
+    *v = ((uint64_t)hi << 32) | lo;
+    return 1;
+}
+
+static int sftp_get_string(SftpBuf *b, const unsigned char **data, uint32_t *len) {
+    if (!sftp_get_u32(b, len) || b->pos + *len > b->len) return 0;
+    *data = b->data + b->pos;
+    b->pos += *len;
+    return 1;
+}
+
+static int sftp_get_attrs(SftpBuf *b, SftpAttrs *a) {
+    memset(a, 0, sizeof(*a));
+    if (!sftp_get_u32(b, &a->flags)) return 0;
+    if ((a->flags & SSH_FILEXFER_ATTR_SIZE) && !sftp_get_u64(b, &a->size)) return 0;
+    if (a->flags & SSH_FILEXFER_ATTR_UIDGID) {
+        if (!sftp_get_u32(b, &a->uid) || !sftp_get_u32(b, &a->gid)) return 0;
+    }
+    if ((a->flags & SSH_FILEXFER_ATTR_PERMISSIONS) && !sftp_get_u32(b, &a->permissions)) return 0;
+    if (a->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+        if (!sftp_get_u32(b, &a->atime) || !sftp_get_u32(b, &a->mtime)) return 0;
+    }
+    if (a->flags & SSH_FILEXFER_ATTR_EXTENDED) {
+        uint32_t count;
+        if (!sftp_get_u32(b, &count)) return 0;
+        for (uint32_t i = 0; i < count * 2; i++) {
+            const unsigned char *skip;
+            uint32_t skip_len;
+            if (!sftp_get_string(b, &skip, &skip_len)) return 0;
+        }
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t offset) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int sftp_read_packet(int fd, SftpBuf *body) {
+    unsigned char hdr[4];
+    if (!read_full(fd, hdr, 4)) return 0;
+    uint32_t len = ((uint32_t)hdr[0] << 24) | ((uint32_t)hdr[1] << 16) | ((uint32_t)hdr[2] << 8) | hdr[3];
+    if (len < 1 || len > SFTP_MAX_PACKET) return 0;
+    memset(body, 0, sizeof(*body));
+    // Out of memory, the reply is lost and so is the session.
+    if (!sftp_buf_reserve(body, len) || !read_full(fd, body->data, len)) {
+        sftp_buf_free(body);
+        return 0;
+    }
+    body->len = len;
+    return 1;
+}
+
+static uint32_t sftp_peek_u32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Lands len bytes of DATA from the channel in r's file. The channel is a
+// pipe, so splice moves them without a trip through user space; a file
+// that will not take them is written the ordinary way, and bytes it fails
+// on are still read off the channel to keep it in step. Returns -1 when
+// the channel failed, 0 when the file did, 1 when all landed.
+static int sftp_sink_data(int from, const SftpRequest *r, uint32_t len) {
+    loff_t offset = r->sink_offset;
+    int copy = 0, failed = len > r->sink_len;
+    char buf[16384];
+    while (len > 0) {
+        ssize_t n = -1;
+        if (!failed && !copy) {
+            n = splice(from, NULL, r->sink_fd, &offset, len, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL) copy = 1;
+            else if (n < 0) failed = 1;
+            else if (n == 0) return -1;
+            if (n <= 0) continue;
+        } else {
+            n = len < sizeof(buf) ? len : sizeof(buf);
+            if (!read_full(from, buf, n)) return -1;
+            if (!failed && !pwrite_full(r->sink_fd, buf, n, offset)) failed = 1;
+            offset += n;
+        }
+        len -= n;
+    }
+    return !failed;
+}
+
+// Replies are matched to their request by id, so any number of threads can
+// keep requests in flight on the one channel at the same time.
+static void *sftp_reader_thread(void *arg) {
+    SftpSession *s = (SftpSession *)arg;
+    unsigned char hdr[13];
+    while (read_full(s->from_fd, hdr, 9)) {
+        uint32_t len = sftp_peek_u32(hdr), id = sftp_peek_u32(hdr + 5);
+        uint8_t type = hdr[4];
+        if (len < 5 || len > SFTP_MAX_PACKET) break;
+        pthread_mutex_lock(&s->lock);
+        SftpRequest *r = s->pending;
+        while (r && r->id != id) r = r->next;
+        pthread_mutex_unlock(&s->lock);
+
+        // Only the reader completes a pending request, so r stays put
+        // while its data is landed outside the lock.
+        SftpBuf body = {0};
+        int landed = -1;
+        uint32_t data_len = 0;
+        if (r && r->sink_fd >= 0 && type == SSH_FXP_DATA && len >= 9) {
+            if (!read_full(s->from_fd, hdr + 9, 4)) break;
+            data_len = sftp_peek_u32(hdr + 9);
+            if (data_len != len - 9 || (landed = sftp_sink_data(s->from_fd, r, data_len)) < 0) break;
+        } else {
+            // Out of memory, the reply is lost and so is the session.
+            if (!sftp_buf_reserve(&body, len)) break;
+            memcpy(body.data, hdr + 4, 5);
+            if (!read_full(s->from_fd, body.data + 5, len - 5)) {
+                sftp_buf_free(&body);
+                break;
+            }
+            body.len = len;
+            body.pos = 5;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        SftpRequest **link = &s->pending;
+        while (*link && (*link)->id != id) link = &(*link)->next;
+        if (*link) {
+            r = *link;
+            *link = r->next;
+            // Data the file would not take fails the read like an error status.
+            r->type = landed == 0 ? 0 : type;
+            r->reply = body;
+            r->sunk = landed > 0 ? data_len : 0;
+            r->done = 1;
+            pthread_cond_broadcast(&s->cond);
+        } else {
+            sftp_buf_free(&body);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    pthread_mutex_lock(&s->lock);
+    s->alive = 0;
+    for (SftpRequest *r = s->pending; r; r = r->next) r->done = 1;
+    s->pending = NULL;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Stands in for a request that could not be allocated or built. It is
+// done with no reply, just like one sent on a dead session, and is never
+// freed.
+static SftpRequest sftp_unsent_request = {.done = 1, .sink_fd = -1};
+
+// Sends len bytes of fd from offset as the rest of a packet. The channel
+// is a pipe, so splice moves them without a trip through user space. If
+// the file comes up short the packet is finished with zeros, as its length
+// is already on the wire. Returns how many bytes came from the file, or -1
+// when the channel failed.
+static int64_t sftp_send_file_data(int to, int fd, uint64_t offset, uint32_t len) {
+    loff_t from = offset;
+    uint32_t sent = 0;
+    int copy = 0;
+    char buf[16384];
+    while (sent < len) {
+        ssize_t n;
+        if (!copy) {
+            n = splice(fd, &from, to, NULL, len - sent, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL) {
+                copy = 1;
+                continue;
+            }
+        } else {
+            n = pread(fd, buf, len - sent < sizeof(buf) ? len - sent : sizeof(buf), from);
+            if (n < 0 && errno == EINTR) continue;
+            if (n > 0 && !write_full(to, buf, n)) return -1;
+            if (n > 0) from += n;
+        }
+        if (n <= 0) break;
+        sent += n;
+    }
+    int64_t from_file = sent;
+    memset(buf, 0, sizeof(buf));
+    while (sent < len) {
+        uint32_t n = len - sent < sizeof(buf) ? len - sent : sizeof(buf);
+        if (!write_full(to, buf, n)) return -1;
+        sent += n;
+    }
+    return from_file;
+}
+
+// Queues r as pending and writes its packet: body, then data_len bytes of
+// payload from data, or from data_fd at data_offset when data is NULL.
+// Fails r, with no reply, when the payload could not all be sent.
+static SftpRequest *sftp_post(SftpSession *s, SftpRequest *r, uint8_t type, const SftpBuf *body,
+                              const void *data, int data_fd, uint64_t data_offset, uint32_t data_len) {
+    pthread_mutex_lock(&s->lock);
+    if (!s->alive) {
+        r->done = 1;
+        pthread_mutex_unlock(&s->lock);
+        return r;
+    }
+    r->id = s->next_id++;
+    r->next = s->pending;
+    s->pending = r;
+    pthread_mutex_unlock(&s->lock);
+
+    uint32_t body_len = body ? body->len : 0;
+    unsigned char hdr[9];
+    uint32_t len = 1 + 4 + body_len + data_len;
+    hdr[0] = len >> 24; hdr[1] = len >> 16; hdr[2] = len >> 8; hdr[3] = len;
+    hdr[4] = type;
+    hdr[5] = r->id >> 24; hdr[6] = r->id >> 16; hdr[7] = r->id >> 8; hdr[8] = r->id;
+
+    pthread_mutex_lock(&s->write_lock);
+    int ok = write_full(s->to_fd, hdr, sizeof(hdr)) &&
+             (!body_len || write_full(s->to_fd, body->data, body_len)) &&
+             (!data_len || (data ? write_full(s->to_fd, data, data_len)
+                                 : sftp_send_file_data(s->to_fd, data_fd, data_offset, data_len) == data_len));
+    pthread_mutex_unlock(&s->write_lock);
+
+    if (!ok) {
+        // A packet padded out after a short file is whole, and the server
+        // may already have answered it; the answer does not count.
+        pthread_mutex_lock(&s->lock);
+        SftpRequest **link = &s->pending;
+        while (*link && *link != r) link = &(*link)->next;
+        if (*link) *link = r->next;
+        r->type = 0;
+        r->done = 1;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return r;
+}
+
+static SftpRequest *sftp_request_new(void) {
+    SftpRequest *r = calloc(1, sizeof(SftpRequest));
+    if (r) r->sink_fd = -1;
+    return r;
+}
+
+static SftpRequest *sftp_send(SftpSession *s, uint8_t type, const SftpBuf *body, const void *data, uint32_t data_len) {
+    if (body && body->failed) return &sftp_unsent_request;
+    SftpRequest *r = sftp_request_new();
+    if (r == NULL) return &sftp_unsent_request;
+    return sftp_post(s, r, type, body, data, -1, 0, data_len);
+}
+
+static int sftp_wait(SftpSession *s, SftpRequest *r) {
+    pthread_mutex_lock(&s->lock);
+    while (!r->done) pthread_cond_wait(&s->cond, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+    return r->type != 0;
+}
+
+static void sftp_request_free(SftpRequest *r) {
+    if (!r || r == &sftp_unsent_request) return;
+    sftp_buf_free(&r->reply);
+    free(r);
+}
+
+static uint32_t sftp_status_code(SftpRequest *r) {
+    uint32_t code;
+    if (r->type != SSH_FXP_STATUS || !sftp_get_u32(&r->reply, &code)) return SSH_FX_FAILURE;
+    return code;
+}
+
+static int sftp_simple_request(SftpSession *s, uint8_t type, const SftpBuf *body) {
+    SftpRequest *r = sftp_send(s, type, body, NULL, 0);
+    sftp_wait(s, r);
+    int ok = sftp_status_code(r) == SSH_FX_OK;
+    sftp_request_free(r);
+    return ok;
+}
+
+// A session normally rides the ControlMaster connection as one more
+// channel. A dedicated session gets its own TCP connection, and with it
+// its own congestion window and cipher thread; it never prompts, so it
+// only works where the host authenticates non-interactively.
+static int sftp_start_session(SftpSession *s, const char *host, int dedicated) {
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) < 0) return 0;
+    if (pipe2(from_child, O_CLOEXEC) < 0) {
+        close(to_child[0]);
+        close(to_child[1]);
+        return 0;
+    }
+
+    char control_opt[PATH_MAX + 16];
+    snprintf(control_opt, sizeof(control_opt), "ControlPath=%s", ssh_master.control_path);
+    char *dedicated_argv[] = {"ssh", "-o", "BatchMode=yes", "-o", "ControlMaster=no", "-o", "ControlPath=none",
+                              "-s", (char *)host, "sftp", NULL};
+    char *shared_argv[] = {"ssh", "-o", "ControlMaster=no", "-o", control_opt, "-s", (char *)host, "sftp", NULL};
+    char *plain_argv[] = {"ssh", "-o", "BatchMode=yes", "-s", (char *)host, "sftp", NULL};
+    char **argv = dedicated ? dedicated_argv : ssh_master.active ? shared_argv : plain_argv;
+
+    // stderr is captured and dropped.
+    SupervisedChild *child = supervisor_spawn_piped(argv, 0, to_child[0], from_child[1]);
+    close(to_child[0]);
+    close(from_child[1]);
+    if (!child) {
+        close(to_child[1]);
+        close(from_child[0]);
+        return 0;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->child = child;
+    s->to_fd = to_child[1];
+    s->from_fd = from_child[0];
+    s->next_id = 1;
+
+    SftpBuf init = {0};
+    sftp_put_u32(&init, 5);
+    sftp_put_u8(&init, SSH_FXP_INIT);
+    sftp_put_u32(&init, 3);
+    int ok = write_full(s->to_fd, init.data, init.len);
+    sftp_buf_free(&init);
+
+    SftpBuf version = {0};
+    uint8_t type = 0;
+    if (ok && sftp_read_packet(s->from_fd, &version) &&
+        sftp_get_u8(&version, &type) && type == SSH_FXP_VERSION &&
+        sftp_get_u32(&version, &s->version)) {
+        const unsigned char *name, *data;
+        uint32_t name_len, data_len;
+        while (sftp_get_string(&version, &name, &name_len) && sftp_get_string(&version, &data, &data_len)) {
+            if (name_len == 24 && memcmp(name, "posix-rename@openssh.com", 24) == 0) s->has_posix_rename = 1;
+            if (name_len == 17 && memcmp(name, "fsync@openssh.com", 17) == 0) s->has_fsync = 1;
+        }
+    } else {
+        ok = 0;
+    }
+    sftp_buf_free(&version);
+
+    if (ok) {
+        pthread_mutex_init(&s->lock, NULL);
+        pthread_mutex_init(&s->write_lock, NULL);
+        pthread_cond_init(&s->cond, NULL);
+        s->alive = 1;
+        if (pthread_create(&s->reader, NULL, sftp_reader_thread, s) != 0) {
+            s->alive = 0;
+            ok = 0;
+        }
+    }
+    if (!ok) {
+        close(s->to_fd);
+        close(s->from_fd);
+        supervisor_terminate(child);
+        supervisor_wait(child, -1);
+        supervisor_release(child);
+        s->child = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+int sftp_open_session(SftpSession *s, const char *host) {
+    return sftp_start_session(s, host, 0);
+}
+
+void sftp_close_session(SftpSession *s) {
+    if (!s->child) return;
+    close(s->to_fd);
+    if (!supervisor_wait(s->child, 1000)) {
+        supervisor_terminate(s->child);
+        supervisor_wait(s->child, -1);
+    }
+    supervisor_release(s->child);
+    pthread_join(s->reader, NULL);
+    close(s->from_fd);
+    pthread_mutex_destroy(&s->lock);
+    pthread_mutex_destroy(&s->write_lock);
+    pthread_cond_destroy(&s->cond);
+    s->child = NULL;
+    s->alive = 0;
+}
+
+void close_sftp_session(void) {
+    sftp_close_session(&sftp_session);
+}
+
+int sftp_stat(SftpSession *s, const char *path, int follow, SftpAttrs *attrs) {
+    SftpBuf body = {0};
+    sftp_put_cstring(&body, path);
+    SftpRequest *r = sftp_send(s, follow ? SSH_FXP_STAT : SSH_FXP_LSTAT, &body, NULL, 0);
+    sftp_buf_free(&body);
+    sftp_wait(s, r);
+    int ok = r->type == SSH_FXP_ATTRS && sftp_get_attrs(&r->reply, attrs);
+    sftp_request_free(r);
+    return ok;
+}
+
+int sftp_realpath(SftpSession *s, const char *path, char *out, size_t size) {
+    SftpBuf body = {0};
+    sftp_put_cstring(&body, path);
+    SftpRequest *r = sftp_send(s, SSH_FXP_REALPATH, &body, NULL, 0);
+    sftp_buf_free(&body);
+    sftp_wait(s, r);
+    uint32_t count, len;
+    const unsigned char *name;
+    int ok = r->type == SSH_FXP_NAME && sftp_get_u32(&r->reply, &count) && count >= 1 &&
+             sftp_get_string(&r->reply, &name, &len) && len < size;
+    if (ok) {
+        memcpy(out, name, len);
+        out[len] = '\0';
+    }
+    sftp_request_free(r);
+    return ok;
+}
+
+int sftp_open_handle(SftpSession *s, uint8_t type, const char *path, uint32_t pflags, const SftpAttrs *attrs, SftpHandle *h) {
+    SftpBuf body = {0};
+    sftp_put_cstring(&body, path);
+    if (type == SSH_FXP_OPEN) {
+        sftp_put_u32(&body, pflags);
+        sftp_put_attrs(&body, attrs);
+    }
+    SftpRequest *r = sftp_send(s, type, &body, NULL, 0);
+    sftp_buf_free(&body);
+    sftp_wait(s, r);
+    const unsigned char *data;
+    int ok = r->type == SSH_FXP_HANDLE && sftp_get_string(&r->reply, &data, &h->len) &&
+             h->len <= sizeof(h->data);
+    if (ok) memcpy(h->data, data, h->len);
+    sftp_request_free(r);
+    return ok;
+}
+
+int sftp_close_handle(SftpSession *s, const SftpHandle *h) {
+    SftpBuf body = {0};
+    sftp_put_string(&body, h->data, h->len);
+    int ok = sftp_simple_request(s, SSH_FXP_CLOSE, &body);
+    sftp_buf_free(&body);
+    return ok;
+}
+
+int sftp_fsetstat(SftpSession *s, const SftpHandle *h, const SftpAttrs *attrs) {
+    SftpBuf body = {0};
+    sftp_put_string(&body, h->data, h->len);
+    sftp_put_attrs(&body, attrs);
+    int ok = sftp_simple_request(s, SSH_FXP_FSETSTAT, &body);
+    sftp_buf_free(&body);
+    return ok;
+}
+
+// A READ whose DATA, when sink_fd is not -1, the reader thread lands at
+// the same offset of sink_fd instead of keeping it in the reply.
+static SftpRequest *sftp_send_read(SftpSession *s, const SftpHandle *h, uint64_t offset, uint32_t len, int sink_fd) {
+    SftpBuf body = {0};
+    sftp_put_string(&body, h->data, h->len);
+    sftp_put_u64(&body, offset);
+    sftp_put_u32(&body, len);
+    SftpRequest *r = body.failed ? NULL : sftp_request_new();
+    if (r) {
+        r->sink_fd = sink_fd;
+        r->sink_offset = offset;
+        r->sink_len = len;
+        r = sftp_post(s, r, SSH_FXP_READ, &body, NULL, -1, 0, 0);
+    }
+    sftp_buf_free(&body);
+    return r ? r : &sftp_unsent_request;
+}
+
+// A WRITE of len bytes from data, or taken from fd at offset when data is
+// NULL.
+static SftpRequest *sftp_send_write(SftpSession *s, const SftpHandle *h, uint64_t offset, const void *data, int fd,
+                                    uint32_t len) {
+    SftpBuf body = {0};
+    sftp_put_string(&body, h->data, h->len);
+    sftp_put_u64(&body, offset);
+    sftp_put_u32(&body, len);
+    SftpRequest *r = body.failed ? NULL : sftp_request_new();
+    if (r) r = sftp_post(s, r, SSH_FXP_WRITE, &body, data, fd, offset, len);
+    sftp_buf_free(&body);
+    return r ? r : &sftp_unsent_request;
+}
+
+// Directory-ness comes from d_type when the filesystem reports it. A stat
+// relative to the directory fd is only issued for links, unknown types, or
+// when size/mtime/mode are wanted, and never opens the entry itself.
+void read_local_dir(FileList *list, const char *path) {
+    file_list_reset(list);
+    add_file_entry(list, "..", 1);
+    
+    strncpy(list->cwd, path, PATH_MAX-1);
+    list->cwd[PATH_MAX-1] = '\0';
+    list->selected = 0;
+    list->scroll_offset = 0;
+    
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    int dfd = dirfd(dir);
+    struct dirent *entry;
+    
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0) continue;
+        if (strcmp(entry->d_name, "..") == 0) continue;
+        if (!show_hidden_files && entry->d_name[0] == '.') continue;
+        
+        int is_dir = entry->d_type == DT_DIR;
+        int need_stat = local_scan_metadata || entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK;
+        struct stat st;
+        int have_stat = need_stat && fstatat(dfd, entry->d_name, &st, AT_NO_AUTOMOUNT) == 0;
+        if (need_stat && !have_stat) {
+            have_stat = fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) == 0;
+        }
+        if (have_stat) is_dir = S_ISDIR(st.st_mode);
+        
+        FileEntry *e = add_file_entry(list, entry->d_name, is_dir);
+        if (!e) break;
+        if (have_stat) {
+            e->mode = st.st_mode;
+            if (local_scan_metadata) {
+                e->size = st.st_size;
+                e->mtime = st.st_mtime;
+            }
+        } else if (entry->d_type != DT_UNKNOWN) {
+            e->mode = DTTOIF(entry->d_type);
+        }
+    }
+    closedir(dir);
+    
+    sort_file_list(list);
+}
+
+static void sftp_resolve_links(SftpSession *s, FileList *list) {
+    SftpRequest *reqs[SFTP_MAX_OUTSTANDING];
+    int indexes[SFTP_MAX_OUTSTANDING];
+    int n = 0;
+    for (int i = 0; i <= list->count; i++) {
+        if (i < list->count && S_ISLNK(list->files[i].mode)) {
+            char link_path[PATH_MAX];
+            join_path(link_path, sizeof(link_path), list->cwd, file_name(list, i));
+            SftpBuf body = {0};
+            sftp_put_cstring(&body, link_path);
+            reqs[n] = sftp_send(s, SSH_FXP_STAT, &body, NULL, 0);
+            sftp_buf_free(&body);
+            indexes[n++] = i;
+        }
+        if (n == SFTP_MAX_OUTSTANDING || (i == list->count && n > 0)) {
+            for (int j = 0; j < n; j++) {
+                SftpAttrs attrs;
+                sftp_wait(s, reqs[j]);
+                if (reqs[j]->type == SSH_FXP_ATTRS && sftp_get_attrs(&reqs[j]->reply, &attrs) &&
+                    (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+                    list->files[indexes[j]].is_dir = S_ISDIR(attrs.permissions);
+                }
+                sftp_request_free(reqs[j]);
+            }
+            n = 0;
+        }
+    }
+}
+
+typedef struct {
+    int (*cancelled)(void *ctx);
+    void (*batch)(void *ctx, const FileList *list);
+    void *ctx;
+    int all_entries;
+} ListingHooks;
+
+// Hidden entries follow the pane setting unless the caller wants them all.
+static int listing_skips(const ListingHooks *hooks, const char *name) {
+    return name[0] == '.' && !show_hidden_files && !(hooks && hooks->all_entries);
+}
+
+int sftp_read_remote_dir(SftpSession *s, FileList *list, const char *path, const ListingHooks *hooks) {
+    file_list_reset(list);
+    if (!add_file_entry(list, "..", 1)) return 0;
+    strncpy(list->cwd, path, PATH_MAX-1);
+    list->cwd[PATH_MAX-1] = '\0';
+    list->selected = 0;
+    list->scroll_offset = 0;
+
+    SftpHandle h;
+    if (!sftp_open_handle(s, SSH_FXP_OPENDIR, path, 0, NULL, &h)) return 0;
+
+    SftpBuf body = {0};
+    sftp_put_string(&body, h.data, h.len);
+    // Only an EOF status ends the listing; any other reply, or the session
+    // dying, leaves it incomplete.
+    int done = 0, failed = 0;
+    while (!done) {
+        if (hooks && hooks->cancelled && hooks->cancelled(hooks->ctx)) {
+            sftp_buf_free(&body);
+            sftp_close_handle(s, &h);
+            return 0;
+        }
+        SftpRequest *r = sftp_send(s, SSH_FXP_READDIR, &body, NULL, 0);
+        sftp_wait(s, r);
+        uint32_t count = 0;
+        if (r->type == SSH_FXP_STATUS && sftp_status_code(r) == SSH_FX_EOF) {
+            done = 1;
+        } else if (r->type != SSH_FXP_NAME || !sftp_get_u32(&r->reply, &count)) {
+            failed = done = 1;
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            const unsigned char *name, *longname;
+            uint32_t name_len, longname_len;
+            SftpAttrs attrs;
+            if (!sftp_get_string(&r->reply, &name, &name_len) ||
+                !sftp_get_string(&r->reply, &longname, &longname_len) ||
+                !sftp_get_attrs(&r->reply, &attrs)) {
+                failed = done = 1;
+                break;
+            }
+            if (name_len == 0 || memchr(name, '\0', name_len)) continue;
+            if ((name_len == 1 && name[0] == '.') || (name_len == 2 && memcmp(name, "..", 2) == 0)) continue;
+            if (listing_skips(hooks, (const char *)name)) continue;
+
+            mode_t mode = (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ? attrs.permissions : 0;
+            FileEntry *e = add_file_entry_n(list, (const char *)name, name_len, S_ISDIR(mode));
+            if (!e) {
+                failed = done = 1;
+                break;
+            }
+            e->mode = mode;
+            if (attrs.flags & SSH_FILEXFER_ATTR_SIZE) e->size = attrs.size;
+            if (attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME) e->mtime = attrs.mtime;
+        }
+        sftp_request_free(r);
+        if (!failed && hooks && hooks->batch) hooks->batch(hooks->ctx, list);
+    }
+    sftp_buf_free(&body);
+    sftp_close_handle(s, &h);
+    if (failed) {
+        file_list_reset(list);
+        return 0;
+    }
+    sftp_resolve_links(s, list);
+    sort_file_list(list);
+    return 1;
+}
+
+int read_remote_dir_shell(FileList *list, const char *host, const char *path, const ListingHooks *hooks) {
+    char quoted[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX + 128], cmd[QUOTED_PATH_MAX * 4 + 640];
+    if (!shell_quote(quoted, sizeof(quoted), path)) return 0;
+    snprintf(remote, sizeof(remote), "cd %s 2>/dev/null && ls -la | awk 'NR>2 {printf \"%%s|%%s|%%s\\n\", $1, $5, $NF}'",
+             quoted);
+    if (!ssh_remote_command(cmd, sizeof(cmd), host, remote)) return 0;
+    
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    char *output;
+    FILE *fp = capture_command(cmd, &output);
+    if (!fp) return 0;
+    
+    file_list_reset(list);
+    int ok = add_file_entry(list, "..", 1) != NULL;
+    
+    strncpy(list->cwd, path, PATH_MAX-1);
+    list->cwd[PATH_MAX-1] = '\0';
+    
+    char line[MAX_FILENAME_LEN * 2];
+    while (ok && fgets(line, sizeof(line), fp)) {
+        char permissions[11];
+        
+        char *perm_end = strchr(line, '|');
+        if (!perm_end) continue;
+        
+        *perm_end = '\0';
+        strncpy(permissions, line, sizeof(permissions)-1);
+        permissions[sizeof(permissions)-1] = '\0';
+        
+        char *size_end = strchr(perm_end + 1, '|');
+        if (!size_end) continue;
+        *size_end = '\0';
+        long long size = atoll(perm_end + 1);
+        
+        char *name_start = size_end + 1;
+        size_t len = strlen(name_start);
+        if (len > 0 && name_start[len-1] == '\n')
+            name_start[len-1] = '\0';
+            
+        if (strcmp(name_start, ".") == 0 || strcmp(name_start, "..") == 0)
+            continue;
+        if (listing_skips(hooks, name_start)) continue;
+        
+        FileEntry *e = add_file_entry(list, name_start, permissions[0] == 'd');
+        if (!e) {
+            ok = 0;
+            break;
+        }
+        if (permissions[0] == '-') e->size = size;
+    }
+    fclose(fp);
+    free(output);
+    record_remote_op(&started);
+    
+    sort_file_list(list);
+    
+    list->selected = 0;
+    list->scroll_offset = 0;
+    return ok;
+}
+
+typedef struct {
+    FileList list;
+    int used;
+    int show_hidden;
+    int prefetched;
+    long long fetched_ms;
+    unsigned long last_used;
+} ListingCacheEntry;
+
+typedef struct {
+    char host[MAX_HOSTNAME_LEN];
+    ListingCacheEntry entries[LISTING_CACHE_SLOTS];
+    long long ttl_ms;
+    unsigned long tick;
+    long hits;
+    long misses;
+    long prefetch_hits;
+    pthread_mutex_t lock;
+} ListingCache;
+
+static ListingCache listing_cache = {.ttl_ms = 30000, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void listing_cache_clear_locked(void) {
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+        file_list_free(&listing_cache.entries[i].list);
+        memset(&listing_cache.entries[i], 0, sizeof(ListingCacheEntry));
+    }
+}
+
+void listing_cache_clear(void) {
+    pthread_mutex_lock(&listing_cache.lock);
+    listing_cache_clear_locked();
+    pthread_mutex_unlock(&listing_cache.lock);
+}
+
+static ListingCacheEntry *listing_cache_find(const char *host, const char *path) {
+    if (strcmp(listing_cache.host, host) != 0) return NULL;
+    for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+        ListingCacheEntry *e = &listing_cache.entries[i];
+        if (e->used && strcmp(e->list.cwd, path) == 0) return e;
+    }
+    return NULL;
+}
+
+static int listing_cache_fresh(const ListingCacheEntry *e) {
+    return e && e->show_hidden == show_hidden_files &&
+           monotonic_ms() - e->fetched_ms < listing_cache.ttl_ms;
+}
+
+int listing_cache_contains(const char *host, const char *path) {
+    pthread_mutex_lock(&listing_cache.lock);
+    int fresh = listing_cache_fresh(listing_cache_find(host, path));
+    pthread_mutex_unlock(&listing_cache.lock);
+    return fresh;
+}
+
+void listing_cache_invalidate(const char *host, const char *path) {
+    pthread_mutex_lock(&listing_cache.lock);
+    ListingCacheEntry *e = listing_cache_find(host, path);
+    if (e) e->used = 0;
+    pthread_mutex_unlock(&listing_cache.lock);
+}
+
+int listing_cache_get(const char *host, const char *path, FileList *list) {
+    pthread_mutex_lock(&listing_cache.lock);
+    ListingCacheEntry *e = listing_cache_find(host, path);
+    if (!listing_cache_fresh(e) || !file_list_copy(list, &e->list)) {
+        listing_cache.misses++;
+        pthread_mutex_unlock(&listing_cache.lock);
+        return 0;
+    }
+    list->selected = 0;
+    list->scroll_offset = 0;
+    e->last_used = ++listing_cache.tick;
+    listing_cache.hits++;
+    if (e->prefetched) {
+        listing_cache.prefetch_hits++;
+        e->prefetched = 0;
+    }
+    pthread_mutex_unlock(&listing_cache.lock);
+    return 1;
+}
+
+void listing_cache_put(const char *host, const FileList *list, int prefetched) {
+    if (listing_cache.ttl_ms <= 0) return;
+    pthread_mutex_lock(&listing_cache.lock);
+    if (strcmp(listing_cache.host, host) != 0) {
+        listing_cache_clear_locked();
+        strncpy(listing_cache.host, host, MAX_HOSTNAME_LEN-1);
+    }
+    ListingCacheEntry *e = listing_cache_find(host, list->cwd);
+    if (!e) {
+        e = &listing_cache.entries[0];
+        for (int i = 0; i < LISTING_CACHE_SLOTS; i++) {
+            ListingCacheEntry *candidate = &listing_cache.entries[i];
+            if (!candidate->used) {
+                e = candidate;
+                break;
+            }
+            if (candidate->last_used < e->last_used) e = candidate;
+        }
+    }
+    if (!file_list_copy(&e->list, list)) {
+        e->used = 0;
+        pthread_mutex_unlock(&listing_cache.lock);
+        return;
+    }
+    for (int i = 0; i < e->list.count; i++) e->list.files[i].selected = 0;
+    e->used = 1;
+    e->show_hidden = show_hidden_files;
+    e->prefetched = prefetched;
+    e->fetched_ms = monotonic_ms();
+    e->last_used = ++listing_cache.tick;
+    pthread_mutex_unlock(&listing_cache.lock);
+}
+
+int fetch_remote_dir(FileList *list, const char *host, const char *path, const ListingHooks *hooks) {
+    if (sftp_session.alive) {
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int ok = sftp_read_remote_dir(&sftp_session, list, path, hooks);
+        record_remote_op(&started);
+        if (ok || sftp_session.alive) return ok;
+    }
+    return read_remote_dir_shell(list, host, path, hooks);
+}
+
+// Serves recently visited directories from the listing cache and only goes
+// to the network once an entry is missing, stale or invalidated.
+int read_remote_dir(FileList *list, const char *host, const char *path) {
+    if (listing_cache_get(host, path, list)) return 1;
+    int ok = fetch_remote_dir(list, host, path, NULL);
+    if (ok) listing_cache_put(host, list, 0);
+    return ok;
+}
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int budget;
+    unsigned long generation;
+    char host[MAX_HOSTNAME_LEN];
+    char paths[PREFETCH_MAX_DIRS][PATH_MAX];
+    int count;
+    int next;
+    long issued;
+    long completed;
+    long cancelled;
+} Prefetcher;
+
+static Prefetcher prefetcher = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .budget = 4
+};
+
+// Polled from the listing without the lock; the writers hold it and store
+// atomically, so a relaxed load is enough to notice a newer request.
+static int prefetch_stale(void *ctx) {
+    return *(unsigned long *)ctx != __atomic_load_n(&prefetcher.generation, __ATOMIC_RELAXED) ||
+           !__atomic_load_n(&prefetcher.running, __ATOMIC_RELAXED);
+}
+
+// Lists queued directories on a worker thread and parks the results in the
+// listing cache. Every new request bumps the generation, which makes the
+// in-flight listing bail out at its next READDIR batch.
+void *prefetch_thread(void *arg) {
+    (void)arg;
+    FileList scratch = {0};
+
+    pthread_mutex_lock(&prefetcher.lock);
+    while (prefetcher.running) {
+        if (prefetcher.next >= prefetcher.count) {
+            pthread_cond_wait(&prefetcher.cond, &prefetcher.lock);
+            continue;
+        }
+        unsigned long generation = prefetcher.generation;
+        char path[PATH_MAX], host[MAX_HOSTNAME_LEN];
+        strcpy(path, prefetcher.paths[prefetcher.next++]);
+        strcpy(host, prefetcher.host);
+        prefetcher.issued++;
+        pthread_mutex_unlock(&prefetcher.lock);
+
+        ListingHooks hooks = {.cancelled = prefetch_stale, .ctx = &generation};
+        int cached = listing_cache_contains(host, path);
+        int ok = cached || fetch_remote_dir(&scratch, host, path, &hooks);
+
+        pthread_mutex_lock(&prefetcher.lock);
+        if (generation != prefetcher.generation) {
+            prefetcher.cancelled++;
+        } else if (ok) {
+            if (!cached) listing_cache_put(host, &scratch, 1);
+            prefetcher.completed++;
+        }
+        ui_notify();
+    }
+    pthread_mutex_unlock(&prefetcher.lock);
+    file_list_free(&scratch);
+    return NULL;
+}
+
+void start_prefetcher(void) {
+    if (prefetcher.budget <= 0 || listing_cache.ttl_ms <= 0) return;
+    prefetcher.running = 1;
+    if (pthread_create(&prefetcher.thread, NULL, prefetch_thread, NULL) != 0) {
+        prefetcher.running = 0;
+    }
+}
+
+void stop_prefetcher(void) {
+    if (!prefetcher.running) return;
+    pthread_mutex_lock(&prefetcher.lock);
+    __atomic_store_n(&prefetcher.running, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&prefetcher.generation, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&prefetcher.cond);
+    pthread_mutex_unlock(&prefetcher.lock);
+    pthread_join(prefetcher.thread, NULL);
+}
+
+// Replaces the prefetch queue with the highlighted directory followed by
+// its nearest sibling directories, up to the configured budget.
+void prefetch_around(const char *host, const FileList *list) {
+    if (!prefetcher.running) return;
+    pthread_mutex_lock(&prefetcher.lock);
+    __atomic_add_fetch(&prefetcher.generation, 1, __ATOMIC_RELAXED);
+    prefetcher.count = 0;
+    prefetcher.next = 0;
+    strncpy(prefetcher.host, host, MAX_HOSTNAME_LEN-1);
+    int limit = prefetcher.budget < PREFETCH_MAX_DIRS ? prefetcher.budget : PREFETCH_MAX_DIRS;
+    for (int distance = 0; distance < list->count && prefetcher.count < limit; distance++) {
+        for (int side = 0; side < (distance ? 2 : 1) && prefetcher.count < limit; side++) {
+            int i = side ? list->selected - distance : list->selected + distance;
+            if (i <= 0 || i >= list->count || !list->files[i].is_dir) continue;
+            join_path(prefetcher.paths[prefetcher.count], PATH_MAX, list->cwd, file_name(list, i));
+            if (listing_cache_contains(host, prefetcher.paths[prefetcher.count])) continue;
+            prefetcher.count++;
+        }
+    }
+    if (prefetcher.count > 0) pthread_cond_signal(&prefetcher.cond);
+    pthread_mutex_unlock(&prefetcher.lock);
+}
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int running;
+    int pending;
+    int loading;
+    int finished;
+    unsigned long generation;
+    char host[MAX_HOSTNAME_LEN];
+    char path[PATH_MAX];
+    FileList staging;
+    int consumed;
+} RemoteLister;
+
+static RemoteLister remote_lister = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+typedef struct {
+    unsigned long generation;
+    int published;
+} RemoteListerJob;
+
+// Polled without the lock, like prefetch_stale.
+static int remote_lister_superseded(void *ctx) {
+    RemoteListerJob *job = (RemoteListerJob *)ctx;
+    return job->generation != __atomic_load_n(&remote_lister.generation, __ATOMIC_RELAXED) ||
+           !__atomic_load_n(&remote_lister.running, __ATOMIC_RELAXED);
+}
+
+static void remote_lister_batch(void *ctx, const FileList *list) {
+    RemoteListerJob *job = (RemoteListerJob *)ctx;
+    pthread_mutex_lock(&remote_lister.lock);
+    if (job->generation == remote_lister.generation) {
+        file_list_append(&remote_lister.staging, list, job->published);
+    }
+    pthread_mutex_unlock(&remote_lister.lock);
+    job->published = list->count;
+    ui_notify();
+}
+
+// Fetches the directory the remote pane is showing on a worker thread and
+// stages each READDIR batch for the UI to merge. A newer request bumps the
+// generation so the superseded listing stops instead of queueing up.
+void *remote_lister_thread(void *arg) {
+    (void)arg;
+    FileList scratch = {0};
+
+    pthread_mutex_lock(&remote_lister.lock);
+    while (remote_lister.running) {
+        if (!remote_lister.pending) {
+            pthread_cond_wait(&remote_lister.cond, &remote_lister.lock);
+            continue;
+        }
+        remote_lister.pending = 0;
+        RemoteListerJob job = {remote_lister.generation, 0};
+        char host[MAX_HOSTNAME_LEN], path[PATH_MAX];
+        strcpy(host, remote_lister.host);
+        strcpy(path, remote_lister.path);
+        pthread_mutex_unlock(&remote_lister.lock);
+
+        ListingHooks hooks = {.cancelled = remote_lister_superseded, .batch = remote_lister_batch, .ctx = &job};
+        int ok = fetch_remote_dir(&scratch, host, path, &hooks);
+
+        pthread_mutex_lock(&remote_lister.lock);
+        if (job.generation == remote_lister.generation) {
+            if (ok && file_list_copy(&remote_lister.staging, &scratch)) {
+                listing_cache_put(host, &scratch, 0);
+            } else if (ok) {
+                // Keep the pane as it is rather than show a partial preview.
+                file_list_reset(&remote_lister.staging);
+            }
+            remote_lister.finished = 1;
+            ui_notify();
+        }
+    }
+    pthread_mutex_unlock(&remote_lister.lock);
+    file_list_free(&scratch);
+    return NULL;
+}
+
+void start_remote_lister(void) {
+    remote_lister.running = 1;
+    if (pthread_create(&remote_lister.thread, NULL, remote_lister_thread, NULL) != 0) {
+        remote_lister.running = 0;
+    }
+}
+
+void stop_remote_lister(void) {
+    if (remote_lister.running) {
+        pthread_mutex_lock(&remote_lister.lock);
+        __atomic_store_n(&remote_lister.running, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&remote_lister.generation, 1, __ATOMIC_RELAXED);
+        pthread_cond_signal(&remote_lister.cond);
+        pthread_mutex_unlock(&remote_lister.lock);
+        pthread_join(remote_lister.thread, NULL);
+    }
+    file_list_free(&remote_lister.staging);
+}
+
+// Shows a cached listing immediately; otherwise resets the pane to ".."
+// and hands the directory to the lister thread.
+void read_remote_dir_async(FileList *list, const char *host, const char *path) {
+    if (!remote_lister.running) {
+        read_remote_dir(list, host, path);
+        return;
+    }
+    char target[PATH_MAX];
+    strncpy(target, path, PATH_MAX-1);
+    target[PATH_MAX-1] = '\0';
+
+    pthread_mutex_lock(&remote_lister.lock);
+    __atomic_add_fetch(&remote_lister.generation, 1, __ATOMIC_RELAXED);
+    if (listing_cache_get(host, target, list)) {
+        remote_lister.loading = 0;
+        pthread_mutex_unlock(&remote_lister.lock);
+        return;
+    }
+    file_list_reset(list);
+    add_file_entry(list, "..", 1);
+    strcpy(list->cwd, target);
+    list->selected = 0;
+    list->scroll_offset = 0;
+
+    strncpy(remote_lister.host, host, MAX_HOSTNAME_LEN-1);
+    strcpy(remote_lister.path, target);
+    file_list_reset(&remote_lister.staging);
+    remote_lister.consumed = 0;
+    remote_lister.finished = 0;
+    remote_lister.loading = 1;
+    remote_lister.pending = 1;
+    pthread_cond_signal(&remote_lister.cond);
+    pthread_mutex_unlock(&remote_lister.lock);
+}
+
+static void merge_entry_state(FileList *list, const char *highlighted, const FileList *old) {
+    for (int i = 0; old && i < old->count; i++) {
+        if (!old->files[i].selected) continue;
+        for (int j = 0; j < list->count; j++) {
+            if (strcmp(file_name(list, j), file_name(old, i)) == 0) {
+                list->files[j].selected = 1;
+                break;
+            }
+        }
+    }
+    for (int j = 0; j < list->count; j++) {
+        if (strcmp(file_name(list, j), highlighted) == 0) {
+            list->selected = j;
+            break;
+        }
+    }
+    if (list->selected >= list->count) list->selected = list->count - 1;
+}
+
+// Sorts the entries appended since `sorted` and merges them into the
+// already sorted prefix, so streaming a huge directory stays linear per batch.
+static void merge_sorted_tail(FileList *list, int sorted) {
+    int tail = list->count - sorted;
+    if (tail <= 0) return;
+    qsort_r(list->files + sorted, tail, sizeof(FileEntry), compare_file_entries, list->names);
+    if (sorted == 0) return;
+    FileEntry *merged = malloc(list->count * sizeof(FileEntry));
+    if (merged == NULL) {
+        sort_file_list(list);
+        return;
+    }
+    int i = 0, j = sorted, k = 0;
+    while (i < sorted && j < list->count) {
+        if (compare_file_entries(&list->files[j], &list->files[i], list->names) < 0) {
+            merged[k++] = list->files[j++];
+        } else {
+            merged[k++] = list->files[i++];
+        }
+    }
+    while (i < sorted) merged[k++] = list->files[i++];
+    while (j < list->count) merged[k++] = list->files[j++];
+    memcpy(list->files, merged, list->count * sizeof(FileEntry));
+    free(merged);
+}
+
+// Merges whatever the lister staged since the last call into the pane,
+// keeping the highlighted entry and selections stable across re-sorts.
+// Returns 1 when the pane changed.
+int remote_lister_poll(FileList *list, int display_count) {
+    if (!remote_lister.running) return 0;
+    pthread_mutex_lock(&remote_lister.lock);
+    if (!remote_lister.loading) {
+        pthread_mutex_unlock(&remote_lister.lock);
+        return 0;
+    }
+    FileList *staging = &remote_lister.staging;
+    if (!remote_lister.finished && staging->count == remote_lister.consumed) {
+        pthread_mutex_unlock(&remote_lister.lock);
+        return 0;
+    }
+
+    char highlighted[PATH_MAX];
+    snprintf(highlighted, sizeof(highlighted), "%s", file_name(list, list->selected));
+    if (remote_lister.finished) {
+        FileList old = {0};
+        file_list_copy(&old, list);
+        if (staging->count > 0) {
+            file_list_copy(list, staging);
+            list->selected = old.selected;
+            list->scroll_offset = old.scroll_offset;
+        }
+        merge_entry_state(list, highlighted, &old);
+        file_list_free(&old);
+        remote_lister.loading = 0;
+    } else {
+        int sorted = list->count;
+        file_list_append(list, staging, remote_lister.consumed);
+        remote_lister.consumed = staging->count;
+        merge_sorted_tail(list, sorted);
+        merge_entry_state(list, highlighted, NULL);
+    }
+    pthread_mutex_unlock(&remote_lister.lock);
+
+    if (list->selected < list->scroll_offset) list->scroll_offset = list->selected;
+    if (display_count > 0 && list->selected >= list->scroll_offset + display_count) {
+        list->scroll_offset = list->selected - display_count + 1;
+    }
+    return 1;
+}
+
+int remote_lister_loading(void) {
+    pthread_mutex_lock(&remote_lister.lock);
+    int loading = remote_lister.loading;
+    pthread_mutex_unlock(&remote_lister.lock);
+    return loading;
+}
+
+// What each row of a window last showed, so a frame only repaints the
+// rows whose content changed.  A row signature of 0 means "unknown".
+typedef struct {
+    uint64_t *rows;
+    int height;
+    int width;
+    int offset;
+    char title[256];
+} PaneDamage;
+
+static uint64_t row_signature(const char *text, uint64_t flags) {
+    uint64_t hash = 14695981039346656037ULL ^ flags;
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash ? hash : 1;
+}
+
+// Returns 1 when the whole window has to be redrawn: first use, a resize,
+// or an explicit invalidation.
+static int pane_damage_prepare(PaneDamage *damage, int height, int width) {
+    if (damage->rows && damage->height == height && damage->width == width) return 0;
+    uint64_t *rows = realloc(damage->rows, (height > 0 ? height : 1) * sizeof(uint64_t));
+    if (!rows) {
+        free(damage->rows);
+        damage->rows = NULL;
+        damage->height = 0;
+        return 1;
+    }
+    memset(rows, 0, (height > 0 ? height : 1) * sizeof(uint64_t));
+    damage->rows = rows;
+    damage->height = height;
+    damage->width = width;
+    damage->title[0] = '\0';
+    return 1;
+}
+
+static void pane_damage_invalidate(PaneDamage *damage) {
+    damage->height = 0;
+}
+
+static void pane_damage_free(PaneDamage *damage) {
+    free(damage->rows);
+    memset(damage, 0, sizeof(*damage));
+}
+
+// Returns 1 when the row needs repainting and records its new signature.
+static int pane_damage_row(PaneDamage *damage, int row, uint64_t signature) {
+    if (!damage->rows || row >= damage->height) return 1;
+    if (damage->rows[row] == signature) return 0;
+    damage->rows[row] = signature;
+    return 1;
+}
+
+// Redraws the border title only when it changed; a full redraw has already
+// drawn a fresh border.
+static void pane_damage_title(PaneDamage *damage, WINDOW *win, int full, int x, const char *title) {
+    if (!full && strcmp(damage->title, title) == 0) return;
+    if (!full) mvwhline(win, 0, 1, ACS_HLINE, getmaxx(win) - 2);
+    mvwprintw(win, 0, x, "%s", title);
+    snprintf(damage->title, sizeof(damage->title), "%s", title);
+}
+
+void draw_file_list(WINDOW *win, FileList *list, int focus, int width, int height, const char *title,
+                    PaneDamage *damage) {
+    int full = pane_damage_prepare(damage, height, width);
+    if (full) {
+        werase(win);
+        box(win, 0, 0);
+    }
+    pane_damage_title(damage, win, full, (width - strlen(title)) / 2, title);
+    
+    int display_count = height - 2;
+    
+    // Scrolling by a few rows moves the rows already drawn instead of
+    // repainting them; only the rows scrolled into view are formatted again.
+    int shift = list->scroll_offset - damage->offset;
+    damage->offset = list->scroll_offset;
+    if (!full && shift != 0 && abs(shift) < display_count) {
+        wsetscrreg(win, 1, display_count);
+        scrollok(win, TRUE);
+        wscrl(win, shift);
+        scrollok(win, FALSE);
+        int kept = display_count - abs(shift);
+        int first = shift > 0 ? 1 + kept : 1;
+        if (shift > 0) {
+            memmove(&damage->rows[1], &damage->rows[1 + shift], kept * sizeof(uint64_t));
+        } else {
+            memmove(&damage->rows[1 - shift], &damage->rows[1], kept * sizeof(uint64_t));
+        }
+        for (int y = first; y < first + abs(shift); y++) {
+            damage->rows[y] = 0;
+            mvwaddch(win, y, 0, ACS_VLINE);
+            mvwaddch(win, y, width - 1, ACS_VLINE);
+        }
+    }
+    
+    for (int i = 0; i < display_count; ++i) {
+        int file_index = list->scroll_offset + i;
+        int screen_y = i + 1;
+        
+        if (file_index >= list->count) {
+            if (pane_damage_row(damage, screen_y, 1)) {
+                mvwprintw(win, screen_y, 1, "%*s", width - 2, "");
+            }
+            continue;
+        }
+        
+        int highlighted = file_index == list->selected && focus;
+        uint64_t flags = (uint64_t)list->files[file_index].size << 3 |
+                         (uint64_t)list->files[file_index].is_dir << 2 |
+                         (uint64_t)(list->files[file_index].selected != 0) << 1 | (uint64_t)highlighted;
+        if (!pane_damage_row(damage, screen_y, row_signature(file_name(list, file_index), flags))) {
+            continue;
+        }
+        
+        if (highlighted) {
+            wattron(win, A_REVERSE);
+        }
+        
+        char prefix[3] = "  ";
+        if (list->files[file_index].selected) {
+            strcpy(prefix, "* ");
+        }
+        
+        char size_str[16] = "";
+        if (!list->files[file_index].is_dir && list->files[file_index].size >= 0) {
+            format_size(size_str, sizeof(size_str), list->files[file_index].size);
+        }
+        
+        if (list->files[file_index].is_dir) {
+            wattron(win, COLOR_PAIR(COLOR_PAIR_DIRECTORY));
+            mvwprintw(win, screen_y, 1, "%s%-*.*s", prefix, width-4, width-4, file_name(list, file_index));
+            wattroff(win, COLOR_PAIR(COLOR_PAIR_DIRECTORY));
+        } else {
+            if (list->files[file_index].selected) {
+                wattron(win, COLOR_PAIR(COLOR_PAIR_SELECTED));
+            }
+            mvwprintw(win, screen_y, 1, "%s%-*.*s%9s", prefix, width-13, width-13, file_name(list, file_index), size_str);
+            if (list->files[file_index].selected) {
+                wattroff(win, COLOR_PAIR(COLOR_PAIR_SELECTED));
+            }
+        }
+        
+        if (highlighted) {
+            wattroff(win, A_REVERSE);
+        }
+    }
+    wnoutrefresh(win);
+}
+
+void resolve_remote_path(char *path, size_t size, const char *host) {
+    if (strncmp(path, "~/", 2) == 0 || strcmp(path, "~") == 0) {
+        char cmd[PATH_MAX * 2], home[PATH_MAX] = "";
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        
+        FILE *fp;
+        char *output;
+        if (sftp_session.alive && !sftp_realpath(&sftp_session, ".", home, sizeof(home))) {
+            home[0] = '\0';
+        }
+        
+        if (!home[0]) {
+            snprintf(cmd, sizeof(cmd), "%s %s 'echo $HOME' 2>/dev/null", ssh_command(), host);
+            fp = capture_command(cmd, &output);
+            if (fp) {
+                if (fgets(home, sizeof(home), fp)) {
+                    size_t len = strlen(home);
+                    if (len > 0 && home[len-1] == '\n')
+                        home[len-1] = '\0';
+                }
+                fclose(fp);
+                free(output);
+            }
+        }
+        
+        if (!home[0]) {
+            char username[64] = "";
+            snprintf(cmd, sizeof(cmd), "%s %s 'whoami' 2>/dev/null", ssh_command(), host);
+            fp = capture_command(cmd, &output);
+            if (fp) {
+                if (fgets(username, sizeof(username), fp)) {
+                    size_t len = strlen(username);
+                    if (len > 0 && username[len-1] == '\n')
+                        username[len-1] = '\0';
+                }
+                fclose(fp);
+                free(output);
+                
+                if (strcmp(username, "root") == 0) {
+                    strcpy(home, "/root");
+                } else {
+                    snprintf(home, sizeof(home), "/home/%s", username);
+                }
+            }
+        }
+        record_remote_op(&started);
+        
+        if (strcmp(path, "~") == 0) {
+            strncpy(path, home, size-1);
+            path[size-1] = '\0';
+        } else {
+            char temp[PATH_MAX];
+            snprintf(temp, sizeof(temp), "%s%s", home, path+1);
+            strncpy(path, temp, size-1);
+            path[size-1] = '\0';
+        }
+    }
+}
+
+#define RATE_SAMPLE_MS 250
+#define RATE_SMOOTHING 0.3
+
+void transfer_stats_begin(TransferStats *st, int64_t total) {
+    memset(st, 0, sizeof(*st));
+    st->total = total;
+    st->started_ms = st->sample_ms = monotonic_ms();
+}
+
+// Counts offset bytes already at the destination as done without letting
+// them inflate the rate.
+void transfer_stats_resume(TransferStats *st, int64_t offset) {
+    st->done = st->sample_done = st->resumed = offset;
+}
+
+void transfer_stats_update(TransferStats *st, int64_t done) {
+    long long now = monotonic_ms();
+    st->done = done;
+    if (now > st->started_ms) st->average = (done - st->resumed) * 1000.0 / (now - st->started_ms);
+    if (now - st->sample_ms >= RATE_SAMPLE_MS) {
+        double instant = (done - st->sample_done) * 1000.0 / (now - st->sample_ms);
+        st->rate = st->sample_done == st->resumed && st->rate == 0 ? instant
+                 : RATE_SMOOTHING * instant + (1 - RATE_SMOOTHING) * st->rate;
+        st->sample_ms = now;
+        st->sample_done = done;
+    }
+}
+
+// Wakes the UI only when something it shows has moved: the percentage, or
+// the rate after a new sample.
+static void transfer_progress(TransferStatus *ts, int64_t done) {
+    int before = ts->progress;
+    long long sampled = ts->stats.sample_ms;
+    transfer_stats_update(&ts->stats, done);
+    if (ts->stats.total > 0) {
+        int64_t pct = done * 100 / ts->stats.total;
+        ts->progress = pct > 100 ? 100 : (int)pct;
+    }
+    if (ts->progress != before || ts->stats.sample_ms != sampled) ui_notify();
+}
+
+// Bandwidth shaping: every transfer draws from its own bucket, capped at
+// per_transfer, and from the one shared by all of them. Both caps can be
+// changed while transfers run; waiters pick up the new rate on their next
+// check.
+#define SHAPER_BURST_MS 100
+
+static struct {
+    pthread_mutex_t lock;
+    TokenBucket total;
+    double per_transfer;
+} shaper = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Milliseconds until the bucket is out of debt, after topping it up.
+static long long token_bucket_wait(TokenBucket *b, long long now) {
+    if (b->rate <= 0) return 0;
+    double depth = b->rate * SHAPER_BURST_MS / 1000;
+    b->tokens += b->rate * (now - b->refill_ms) / 1000;
+    if (b->tokens > depth) b->tokens = depth;
+    b->refill_ms = now;
+    return b->tokens >= 0 ? 0 : (long long)(-b->tokens * 1000 / b->rate) + 1;
+}
+
+static void shaper_set(double total, double per_transfer) {
+    pthread_mutex_lock(&shaper.lock);
+    shaper.total.rate = total > 0 ? total : 0;
+    shaper.per_transfer = per_transfer > 0 ? per_transfer : 0;
+    pthread_mutex_unlock(&shaper.lock);
+    ui_notify();
+}
+
+static int shaper_active(void) {
+    pthread_mutex_lock(&shaper.lock);
+    int active = shaper.total.rate > 0 || shaper.per_transfer > 0;
+    pthread_mutex_unlock(&shaper.lock);
+    return active;
+}
+
+// Blocks until both buckets allow len more bytes for ts, then charges
+// them. Returns 0 if the transfer was cancelled while waiting.
+static int shaper_take(TransferStatus *ts, size_t len) {
+    pthread_mutex_lock(&shaper.lock);
+    while (!ts->cancel_requested) {
+        long long now = monotonic_ms();
+        ts->bucket.rate = shaper.per_transfer;
+        long long wait = token_bucket_wait(&shaper.total, now);
+        long long own = token_bucket_wait(&ts->bucket, now);
+        if (own > wait) wait = own;
+        if (wait == 0) {
+            if (shaper.total.rate > 0) shaper.total.tokens -= len;
+            if (ts->bucket.rate > 0) ts->bucket.tokens -= len;
+            break;
+        }
+        pthread_mutex_unlock(&shaper.lock);
+        napms(wait < RATE_SAMPLE_MS ? (int)wait : RATE_SAMPLE_MS);
+        pthread_mutex_lock(&shaper.lock);
+    }
+    pthread_mutex_unlock(&shaper.lock);
+    return !ts->cancel_requested;
+}
+
+// "20M", "512K", "1.5G" or plain bytes per second; -1 if it is none of
+// those.
+static double parse_rate(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    const char *units = "KMGT";
+    const char *unit = *end ? strchr(units, toupper((unsigned char)*end)) : NULL;
+    if (unit) {
+        for (long i = 0; i <= unit - units; i++) value *= 1024;
+        end++;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (strcmp(end, "/s") == 0) end += 2;
+    return *end ? -1 : value;
+}
+
+// scp prints no progress without a tty. For uploads, find the process in
+// the child's tree that holds the source open and read its file offset.
+static int64_t scp_source_offset(pid_t pid, const char *source, int depth) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *dir = opendir(path);
+    if (dir) {
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            char link_path[PATH_MAX], target[PATH_MAX];
+            if (!join_path(link_path, sizeof(link_path), path, entry->d_name)) continue;
+            ssize_t n = readlink(link_path, target, sizeof(target) - 1);
+            if (n <= 0) continue;
+            target[n] = '\0';
+            if (strcmp(target, source) != 0) continue;
+
+            int len = snprintf(link_path, sizeof(link_path), "/proc/%d/fdinfo/%s", (int)pid, entry->d_name);
+            FILE *fp = len > 0 && (size_t)len < sizeof(link_path) ? fopen(link_path, "r") : NULL;
+            long long pos = -1;
+            if (fp) {
+                if (fscanf(fp, "pos: %lld", &pos) != 1) pos = -1;
+                fclose(fp);
+            }
+            closedir(dir);
+            return pos;
+        }
+        closedir(dir);
+    }
+    if (depth >= 3) return -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)pid, (int)pid);
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    int child;
+    int64_t offset = -1;
+    while (offset < 0 && fscanf(fp, "%d", &child) == 1) {
+        offset = scp_source_offset(child, source, depth + 1);
+    }
+    fclose(fp);
+    return offset;
+}
+
+// How far a child process has got with the file: the growing destination
+// file for downloads, the offset of the process reading the source for
+// uploads. source is the resolved path from transfer_source_path.
+static int64_t transfer_sampled_done(const TransferStatus *ts, pid_t pid, const char *source) {
+    if (ts->direction == 1) return scp_source_offset(pid, source, 0);
+    struct stat st;
+    return stat(ts->dest, &st) == 0 ? st.st_size : -1;
+}
+
+static void transfer_source_path(const TransferStatus *ts, char *source) {
+    if (ts->direction != 1 || !realpath(ts->source, source)) snprintf(source, PATH_MAX, "%s", ts->source);
+}
+
+// Samples progress until scp is done. A cancel request turns into SIGTERM,
+// and SIGKILL later if scp ignores it.
+static void monitor_transfer_progress(TransferStatus *ts, SupervisedChild *child) {
+    char source[PATH_MAX];
+    transfer_source_path(ts, source);
+
+    int terminated = 0;
+    while (!supervisor_wait(child, RATE_SAMPLE_MS)) {
+        if (ts->cancel_requested && !terminated) {
+            supervisor_terminate(child);
+            terminated = 1;
+        }
+        int64_t done = transfer_sampled_done(ts, child->pid, source);
+        if (done >= 0) transfer_progress(ts, done);
+    }
+}
+
+// BLAKE2b (RFC 7693), unkeyed, for checking that transfers arrived
+// intact. Its 64-bit rounds are quick in plain C; the speed comes from
+// hashing a file as independent chunks on several threads.
+typedef struct {
+    uint64_t h[8];
+    uint64_t t;
+    unsigned char buf[128];
+    size_t buf_len;
+    size_t out_len;
+} Blake2b;
+
+static const uint64_t blake2b_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static inline uint64_t rotr64(uint64_t x, int n) {
+    return x >> n | x << (64 - n);
+}
+
+static inline void blake2b_mix(uint64_t *v, int a, int b, int c, int d, uint64_t x, uint64_t y) {
+    v[a] += v[b] + x;
+    v[d] = rotr64(v[d] ^ v[a], 32);
+    v[c] += v[d];
+    v[b] = rotr64(v[b] ^ v[c], 24);
+    v[a] += v[b] + y;
+    v[d] = rotr64(v[d] ^ v[a], 16);
+    v[c] += v[d];
+    v[b] = rotr64(v[b] ^ v[c], 63);
+}
+
+static void blake2b_compress(Blake2b *b, const unsigned char *block, int last) {
+    static const unsigned char sigma[10][16] = {
+        {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15}, {14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3},
+        {11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4}, {7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8},
+        {9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13}, {2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9},
+        {12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11}, {13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10},
+        {6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5}, {10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0},
+    };
+    uint64_t m[16], v[16];
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(m, block, sizeof(m));
+#else
+    for (int i = 0; i < 16; i++) {
+        m[i] = 0;
+        for (int j = 7; j >= 0; j--) m[i] = m[i] << 8 | block[i * 8 + j];
+    }
+#endif
+    for (int i = 0; i < 8; i++) {
+        v[i] = b->h[i];
+        v[i + 8] = blake2b_iv[i];
+    }
+    v[12] ^= b->t;
+    if (last) v[14] = ~v[14];
+    // Unrolled so the message schedule becomes constant indexing.
+#pragma GCC unroll 12
+    for (int r = 0; r < 12; r++) {
+        const unsigned char *s = sigma[r % 10];
+        blake2b_mix(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+        blake2b_mix(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+        blake2b_mix(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+        blake2b_mix(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+        blake2b_mix(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+        blake2b_mix(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        blake2b_mix(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+        blake2b_mix(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+    }
+    for (int i = 0; i < 8; i++) b->h[i] ^= v[i] ^ v[i + 8];
+}
+
+static void blake2b_init(Blake2b *b, size_t out_len) {
+    memcpy(b->h, blake2b_iv, sizeof(b->h));
+    b->h[0] ^= 0x01010000 ^ out_len;
+    b->t = 0;
+    b->buf_len = 0;
+    b->out_len = out_len;
+}
+
+// The last block is held back until blake2b_final, which has to flag it.
+static void blake2b_update(Blake2b *b, const void *data, size_t len) {
+    const unsigned char *p = data;
+    while (len > 0) {
+        if (b->buf_len == sizeof(b->buf)) {
+            b->t += sizeof(b->buf);
+            blake2b_compress(b, b->buf, 0);
+            b->buf_len = 0;
+        }
+        if (b->buf_len == 0 && len > sizeof(b->buf)) {
+            b->t += sizeof(b->buf);
+            blake2b_compress(b, p, 0);
+            p += sizeof(b->buf);
+            len -= sizeof(b->buf);
+            continue;
+        }
+        size_t n = sizeof(b->buf) - b->buf_len < len ? sizeof(b->buf) - b->buf_len : len;
+        memcpy(b->buf + b->buf_len, p, n);
+        b->buf_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void blake2b_final(Blake2b *b, unsigned char *out) {
+    b->t += b->buf_len;
+    memset(b->buf + b->buf_len, 0, sizeof(b->buf) - b->buf_len);
+    blake2b_compress(b, b->buf, 1);
+    for (size_t i = 0; i < b->out_len; i++) out[i] = (unsigned char)(b->h[i / 8] >> (8 * (i % 8)));
+}
+
+// A verified transfer hashes its file as VERIFY_CHUNK_SIZE chunks, and the
+// chunk digests in turn, so both ends can spread the work over threads.
+// Each chunk picks up the bytes that pass through this process in order
+// from its start; whatever it misses (a resumed prefix, data moved by a
+// child process, a reply that came back short) is read from the local file
+// once the transfer is done.
+#define VERIFY_CHUNK_SIZE (8 << 20)
+#define VERIFY_DIGEST_SIZE 32
+#define VERIFY_THREADS 4
+#define VERIFY_LOCKS 64
+
+typedef struct {
+    Blake2b state;
+    int64_t hashed;
+} VerifyChunk;
+
+// Chunk i is guarded by locks[i % VERIFY_LOCKS]. The locks live apart from
+// the chunks, which are reallocated as the file turns out longer.
+struct StreamVerifier {
+    VerifyChunk *chunks;
+    int64_t count;
+    pthread_mutex_t locks[VERIFY_LOCKS];
+};
+
+// Returns 0, leaving v as it was, when the chunks cannot be allocated.
+static int verify_add_chunks(StreamVerifier *v, int64_t size) {
+    int64_t count = size > 0 ? (size + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE : 1;
+    if (count <= v->count) return 1;
+    VerifyChunk *chunks = realloc(v->chunks, count * sizeof(VerifyChunk));
+    if (chunks == NULL) return 0;
+    v->chunks = chunks;
+    for (int64_t i = v->count; i < count; i++) {
+        blake2b_init(&v->chunks[i].state, VERIFY_DIGEST_SIZE);
+        v->chunks[i].hashed = 0;
+    }
+    v->count = count;
+    return 1;
+}
+
+// size is what the file is expected to be; bytes fed past it are left for
+// the catch-up at the end. Returns NULL when out of memory.
+static StreamVerifier *verify_new(int64_t size) {
+    StreamVerifier *v = calloc(1, sizeof(StreamVerifier));
+    if (v && !verify_add_chunks(v, size)) {
+        free(v);
+        return NULL;
+    }
+    if (v) {
+        for (int i = 0; i < VERIFY_LOCKS; i++) pthread_mutex_init(&v->locks[i], NULL);
+    }
+    return v;
+}
+
+static void verify_free(StreamVerifier *v) {
+    for (int i = 0; i < VERIFY_LOCKS; i++) pthread_mutex_destroy(&v->locks[i]);
+    free(v->chunks);
+    free(v);
+}
+
+// Called with file bytes at offset as they are sent or received. Safe from
+// several stream threads at once; they only contend within a chunk.
+static void verify_feed(StreamVerifier *v, int64_t offset, const void *data, size_t len) {
+    if (!v) return;
+    const char *p = data;
+    while (len > 0) {
+        int64_t index = offset / VERIFY_CHUNK_SIZE, within = offset % VERIFY_CHUNK_SIZE;
+        size_t n = (int64_t)len < VERIFY_CHUNK_SIZE - within ? len : (size_t)(VERIFY_CHUNK_SIZE - within);
+        if (index >= v->count) return;
+        VerifyChunk *c = &v->chunks[index];
+        pthread_mutex_t *lock = &v->locks[index % VERIFY_LOCKS];
+        pthread_mutex_lock(lock);
+        if (c->hashed == within) {
+            blake2b_update(&c->state, p, n);
+            c->hashed += n;
+        }
+        pthread_mutex_unlock(lock);
+        offset += n;
+        p += n;
+        len -= n;
+    }
+}
+
+// What a READ reply brought: landed in fd already when it was sent with a
+// sink, otherwise written there now and shown to v. Returns
+// 0 unless it is DATA that fits in want bytes and reached the file.
+static int sftp_land_read(SftpRequest *r, int fd, uint64_t offset, uint32_t want, StreamVerifier *v,
+                          uint32_t *len) {
+    const unsigned char *data;
+    if (r->type != SSH_FXP_DATA) return 0;
+    if (r->sink_fd >= 0) {
+        *len = r->sunk;
+        return 1;
+    }
+    if (!sftp_get_string(&r->reply, &data, len) || *len > want || !pwrite_full(fd, data, *len, offset)) return 0;
+    verify_feed(v, offset, data, *len);
+    return 1;
+}
+
+typedef struct {
+    SftpRequest *req;
+    uint64_t offset;
+    uint32_t len;
+} SftpWindowSlot;
+
+// Everything below the lowest offset the window still owes has landed, so
+// a failed download can be cut back to a clean prefix to resume from.
+static uint64_t sftp_window_low_water(const SftpWindowSlot *window, int head, int inflight, uint64_t limit) {
+    for (int i = 0; i < inflight; i++) {
+        uint64_t offset = window[(head + i) % SFTP_MAX_OUTSTANDING].offset;
+        if (offset < limit) limit = offset;
+    }
+    return limit;
+}
+
+// Keeps up to SFTP_MAX_OUTSTANDING reads in flight and lands each reply at
+// its own offset, so short reads are simply re-requested for the remainder.
+// Unless the verifier has to see the data, the reader thread splices it
+// straight into the file. A non-zero offset keeps that many verified bytes
+// of the destination.
+static int sftp_download_file(SftpSession *s, TransferStatus *ts, int64_t offset) {
+    SftpAttrs attrs;
+    if (!sftp_stat(s, ts->source, 1, &attrs)) return 0;
+    SftpHandle h;
+    if (!sftp_open_handle(s, SSH_FXP_OPEN, ts->source, SSH_FXF_READ, NULL, &h)) return 0;
+
+    mode_t mode = (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ? attrs.permissions & 0777 : 0644;
+    int fd = open(ts->dest, O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC), mode);
+    if (fd < 0 || (offset > 0 && ftruncate(fd, offset) < 0)) {
+        if (fd >= 0) close(fd);
+        sftp_close_handle(s, &h);
+        return 0;
+    }
+
+    int has_size = (attrs.flags & SSH_FILEXFER_ATTR_SIZE) != 0;
+    transfer_stats_begin(&ts->stats, has_size ? (int64_t)attrs.size : -1);
+    transfer_stats_resume(&ts->stats, offset);
+    SftpWindowSlot window[SFTP_MAX_OUTSTANDING];
+    int head = 0, inflight = 0, eof = 0, ok = 1;
+    int sink = ts->verifier ? -1 : fd;
+    uint64_t next_offset = offset, received = offset, prefix = UINT64_MAX;
+    while (1) {
+        while (ok && !eof && !ts->cancel_requested && inflight < SFTP_MAX_OUTSTANDING &&
+               (!has_size || next_offset < attrs.size)) {
+            if (!shaper_take(ts, SFTP_CHUNK_SIZE)) break;
+            SftpWindowSlot *slot = &window[(head + inflight) % SFTP_MAX_OUTSTANDING];
+            slot->offset = next_offset;
+            slot->len = SFTP_CHUNK_SIZE;
+            slot->req = sftp_send_read(s, &h, slot->offset, slot->len, sink);
+            next_offset += SFTP_CHUNK_SIZE;
+            inflight++;
+        }
+        if (inflight == 0) break;
+
+        SftpWindowSlot done = window[head];
+        head = (head + 1) % SFTP_MAX_OUTSTANDING;
+        inflight--;
+        sftp_wait(s, done.req);
+
+        int was_ok = ok;
+        uint64_t owed = next_offset;
+        uint32_t data_len;
+        if (ok && done.req->type == SSH_FXP_DATA) {
+            if (!sftp_land_read(done.req, fd, done.offset, done.len, ts->verifier, &data_len)) {
+                ok = 0;
+            } else {
+                received += data_len;
+                if (data_len > 0 && data_len < done.len && !ts->cancel_requested) {
+                    SftpWindowSlot *slot = &window[(head + inflight) % SFTP_MAX_OUTSTANDING];
+                    slot->offset = done.offset + data_len;
+                    slot->len = done.len - data_len;
+                    slot->req = sftp_send_read(s, &h, slot->offset, slot->len, sink);
+                    inflight++;
+                }
+            }
+        } else if (ok && sftp_status_code(done.req) == SSH_FX_EOF) {
+            eof = 1;
+        } else {
+            ok = 0;
+        }
+        if (was_ok && !ok) owed = done.offset;
+        sftp_request_free(done.req);
+
+        if (ts->cancel_requested) ok = 0;
+        if (was_ok && !ok) prefix = sftp_window_low_water(window, head, inflight, owed);
+        transfer_progress(ts, received);
+    }
+
+    if (ok && (attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME)) {
+        struct timespec times[2] = {{attrs.atime, 0}, {attrs.mtime, 0}};
+        futimens(fd, times);
+    }
+    struct stat st;
+    if (!ok && fstat(fd, &st) == 0 && prefix < (uint64_t)st.st_size) {
+        if (ftruncate(fd, prefix) < 0) {
+            // The next attempt's prefix check will catch the gap instead.
+        }
+    }
+    if (close(fd) < 0) ok = 0;
+    sftp_close_handle(s, &h);
+    return ok;
+}
+
+static int sftp_upload_file(SftpSession *s, TransferStatus *ts, int64_t resume) {
+    int fd = open(ts->source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+
+    SftpAttrs attrs = {0};
+    attrs.flags = SSH_FILEXFER_ATTR_PERMISSIONS;
+    attrs.permissions = st.st_mode & 0777;
+    SftpHandle h;
+    uint32_t pflags = SSH_FXF_WRITE | SSH_FXF_CREAT | (resume > 0 ? 0 : SSH_FXF_TRUNC);
+    if (!sftp_open_handle(s, SSH_FXP_OPEN, ts->dest, pflags, &attrs, &h)) {
+        close(fd);
+        return 0;
+    }
+
+    // Without a verifier to feed, the chunks are spliced from the file into
+    // the channel and never pass through here.
+    char *buf = NULL;
+    if (ts->verifier && (buf = malloc(SFTP_CHUNK_SIZE)) == NULL) {
+        snprintf(ts->error, sizeof(ts->error), "out of memory");
+        sftp_close_handle(s, &h);
+        close(fd);
+        return 0;
+    }
+    transfer_stats_begin(&ts->stats, st.st_size);
+    transfer_stats_resume(&ts->stats, resume);
+    SftpWindowSlot window[SFTP_MAX_OUTSTANDING];
+    int head = 0, inflight = 0, ok = 1;
+    uint64_t offset = resume, acked = resume;
+    while (1) {
+        while (ok && !ts->cancel_requested && inflight < SFTP_MAX_OUTSTANDING && offset < (uint64_t)st.st_size) {
+            ssize_t n = st.st_size - offset < SFTP_CHUNK_SIZE ? (ssize_t)(st.st_size - offset) : SFTP_CHUNK_SIZE;
+            if (buf && (n = pread(fd, buf, SFTP_CHUNK_SIZE, offset)) <= 0) {
+                ok = 0;
+                break;
+            }
+            if (!shaper_take(ts, n)) break;
+            if (buf) verify_feed(ts->verifier, offset, buf, n);
+            SftpWindowSlot *slot = &window[(head + inflight) % SFTP_MAX_OUTSTANDING];
+            slot->offset = offset;
+            slot->len = n;
+            slot->req = sftp_send_write(s, &h, offset, buf, fd, n);
+            offset += n;
+            inflight++;
+        }
+        if (inflight == 0) break;
+
+        SftpWindowSlot done = window[head];
+        head = (head + 1) % SFTP_MAX_OUTSTANDING;
+        inflight--;
+        sftp_wait(s, done.req);
+        if (sftp_status_code(done.req) != SSH_FX_OK) ok = 0;
+        else acked += done.len;
+        sftp_request_free(done.req);
+
+        if (ts->cancel_requested) ok = 0;
+        transfer_progress(ts, acked);
+    }
+    free(buf);
+
+    if (ok) {
+        attrs.flags = SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME;
+        attrs.atime = st.st_atime;
+        attrs.mtime = st.st_mtime;
+        sftp_fsetstat(s, &h, &attrs);
+    }
+    if (!sftp_close_handle(s, &h)) ok = 0;
+    close(fd);
+    return ok;
+}
+
+#define TRANSFER_MAX_STREAMS 8
+#define STREAM_MIN_BYTES (64LL << 20)
+// One stripe per verify chunk, so streams never share a chunk's hash.
+#define STREAM_STRIPE_SIZE VERIFY_CHUNK_SIZE
+
+static int transfer_streams = 4;
+
+// One large file moved by several SFTP sessions at once. The file is cut
+// into stripes that streams claim in order, so a fast stream simply takes
+// more of them.
+typedef struct {
+    TransferStatus *ts;
+    int fd;
+    int upload;
+    uint64_t start;
+    uint64_t size;
+    int stripes;
+    int next_stripe;
+    unsigned char *stripe_done;
+    int failed;
+    int opened;
+    int finished;
+    pthread_mutex_t lock;
+} StripedTransfer;
+
+// Stripes sit on STREAM_STRIPE_SIZE boundaries, the first one starting
+// wherever the transfer resumed.
+static uint64_t stripe_start(const StripedTransfer *x, int i) {
+    return i == 0 ? x->start : x->start - x->start % STREAM_STRIPE_SIZE + (uint64_t)i * STREAM_STRIPE_SIZE;
+}
+
+typedef struct {
+    StripedTransfer *xfer;
+    SftpSession *session;
+    SftpSession own;
+    int64_t moved;
+    long long started_ms;
+    pthread_t thread;
+} TransferStream;
+
+// Pipelines one byte range through a session: reads for downloads, writes
+// for uploads, each chunk landing at its own offset.
+static int sftp_transfer_range(SftpSession *s, const SftpHandle *h, StripedTransfer *x,
+                               uint64_t start, uint64_t end, int64_t *moved) {
+    SftpWindowSlot window[SFTP_MAX_OUTSTANDING];
+    // Only a verifier needs the bytes here; otherwise they are spliced.
+    StreamVerifier *v = x->ts->verifier;
+    char *buf = NULL;
+    if (x->upload && v && (buf = malloc(SFTP_CHUNK_SIZE)) == NULL) return 0;
+    int sink = v ? -1 : x->fd;
+    int head = 0, inflight = 0, ok = 1;
+    uint64_t next = start;
+    while (1) {
+        while (ok && !x->failed && !x->ts->cancel_requested && inflight < SFTP_MAX_OUTSTANDING && next < end) {
+            uint32_t len = end - next < SFTP_CHUNK_SIZE ? (uint32_t)(end - next) : SFTP_CHUNK_SIZE;
+            if (!shaper_take(x->ts, len)) break;
+            SftpWindowSlot *slot = &window[(head + inflight) % SFTP_MAX_OUTSTANDING];
+            if (x->upload) {
+                if (buf && pread(x->fd, buf, len, next) != (ssize_t)len) {
+                    ok = 0;
+                    break;
+                }
+                if (buf) verify_feed(v, next, buf, len);
+                slot->req = sftp_send_write(s, h, next, buf, x->fd, len);
+            } else {
+                slot->req = sftp_send_read(s, h, next, len, sink);
+            }
+            slot->offset = next;
+            slot->len = len;
+            next += len;
+            inflight++;
+        }
+        if (inflight == 0) break;
+
+        SftpWindowSlot done = window[head];
+        head = (head + 1) % SFTP_MAX_OUTSTANDING;
+        inflight--;
+        sftp_wait(s, done.req);
+        uint32_t data_len;
+        if (!ok) {
+            // Draining what is still in flight.
+        } else if (x->upload) {
+            if (sftp_status_code(done.req) != SSH_FX_OK) ok = 0;
+            else __atomic_add_fetch(moved, done.len, __ATOMIC_RELAXED);
+        } else if (sftp_land_read(done.req, x->fd, done.offset, done.len, v, &data_len) && data_len > 0) {
+            __atomic_add_fetch(moved, data_len, __ATOMIC_RELAXED);
+            if (data_len < done.len) {
+                SftpWindowSlot *slot = &window[(head + inflight) % SFTP_MAX_OUTSTANDING];
+                slot->offset = done.offset + data_len;
+                slot->len = done.len - data_len;
+                slot->req = sftp_send_read(s, h, slot->offset, slot->len, sink);
+                inflight++;
+            }
+        } else {
+            // Includes EOF inside the range: the file shrank underneath us.
+            ok = 0;
+        }
+        sftp_request_free(done.req);
+    }
+    free(buf);
+    return ok && !x->failed && !x->ts->cancel_requested;
+}
+
+static void *transfer_stream_thread(void *arg) {
+    TransferStream *stream = (TransferStream *)arg;
+    StripedTransfer *x = stream->xfer;
+    if (!stream->session) {
+        // A stream that cannot get a session of its own just bows out; the
+        // others pick up its share of the stripes.
+        if (sftp_start_session(&stream->own, x->ts->hostname, 1) ||
+            sftp_start_session(&stream->own, x->ts->hostname, 0)) {
+            stream->session = &stream->own;
+        }
+    }
+    int ok = 1;
+    if (stream->session) {
+        pthread_mutex_lock(&x->lock);
+        x->opened++;
+        pthread_mutex_unlock(&x->lock);
+        ui_notify();
+        SftpHandle h;
+        const char *path = x->upload ? x->ts->dest : x->ts->source;
+        ok = sftp_open_handle(stream->session, SSH_FXP_OPEN, path, x->upload ? SSH_FXF_WRITE : SSH_FXF_READ,
+                              NULL, &h);
+        int has_handle = ok;
+        stream->started_ms = monotonic_ms();
+        while (ok) {
+            pthread_mutex_lock(&x->lock);
+            int i = x->failed || x->ts->cancel_requested ? x->stripes : x->next_stripe;
+            if (i < x->stripes) x->next_stripe++;
+            pthread_mutex_unlock(&x->lock);
+            if (i >= x->stripes) break;
+            uint64_t from = stripe_start(x, i);
+            uint64_t to = i + 1 < x->stripes ? stripe_start(x, i + 1) : x->size;
+            ok = sftp_transfer_range(stream->session, &h, x, from, to, &stream->moved);
+            if (ok) x->stripe_done[i] = 1;
+        }
+        if (has_handle && !sftp_close_handle(stream->session, &h)) {
+            ok = 0;
+        }
+        if (stream->session == &stream->own) sftp_close_session(&stream->own);
+    }
+    pthread_mutex_lock(&x->lock);
+    if (!ok) x->failed = 1;
+    x->finished++;
+    pthread_mutex_unlock(&x->lock);
+    return NULL;
+}
+
+// Moves a large file over several SFTP streams. The shared session is one
+// of them; the rest open their own. Returns -1 when the file is too small
+// or streams are turned off, so the caller moves it the usual way.
+static int sftp_striped_transfer(TransferStatus *ts, int64_t offset) {
+    if (transfer_streams < 2) return -1;
+    StripedTransfer x = {.ts = ts, .fd = -1, .upload = ts->direction == 1, .start = offset};
+    SftpAttrs attrs = {0};
+    struct stat st;
+    SftpHandle h;
+    if (x.upload) {
+        x.fd = open(ts->source, O_RDONLY | O_CLOEXEC);
+        if (x.fd < 0 || fstat(x.fd, &st) < 0 || st.st_size - offset < STREAM_MIN_BYTES) {
+            if (x.fd >= 0) close(x.fd);
+            return -1;
+        }
+        x.size = st.st_size;
+        // The shared session creates (or truncates) the file and keeps it
+        // open to set its attributes once every stream is done.
+        attrs.flags = SSH_FILEXFER_ATTR_PERMISSIONS;
+        attrs.permissions = st.st_mode & 0777;
+        uint32_t pflags = SSH_FXF_WRITE | SSH_FXF_CREAT | (offset > 0 ? 0 : SSH_FXF_TRUNC);
+        if (!sftp_open_handle(&sftp_session, SSH_FXP_OPEN, ts->dest, pflags, &attrs, &h)) {
+            close(x.fd);
+            return 0;
+        }
+    } else {
+        if (!sftp_stat(&sftp_session, ts->source, 1, &attrs)) return 0;
+        if (!(attrs.flags & SSH_FILEXFER_ATTR_SIZE) || (int64_t)attrs.size - offset < STREAM_MIN_BYTES) return -1;
+        x.size = attrs.size;
+        mode_t mode = (attrs.flags & SSH_FILEXFER_ATTR_PERMISSIONS) ? attrs.permissions & 0777 : 0644;
+        x.fd = open(ts->dest, O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC), mode);
+        if (x.fd < 0 || (offset > 0 && ftruncate(x.fd, offset) < 0)) {
+            if (x.fd >= 0) close(x.fd);
+            return 0;
+        }
+    }
+
+    x.stripes = (int)((x.size - (x.start - x.start % STREAM_STRIPE_SIZE) + STREAM_STRIPE_SIZE - 1) / STREAM_STRIPE_SIZE);
+    x.stripe_done = calloc(x.stripes, 1);
+    if (x.stripe_done == NULL) {
+        snprintf(ts->error, sizeof(ts->error), "out of memory");
+        if (x.upload) sftp_close_handle(&sftp_session, &h);
+        close(x.fd);
+        return 0;
+    }
+    pthread_mutex_init(&x.lock, NULL);
+    int count = transfer_streams < x.stripes ? transfer_streams : x.stripes;
+    TransferStream streams[TRANSFER_MAX_STREAMS];
+    memset(streams, 0, sizeof(streams));
+    transfer_stats_begin(&ts->stats, x.size);
+    transfer_stats_resume(&ts->stats, offset);
+    ts->streams = 1;
+    ts->stream_rate = 0;
+    int started = 0;
+    for (int i = 0; i < count; i++) {
+        streams[i].xfer = &x;
+        streams[i].session = i == 0 ? &sftp_session : NULL;
+        if (pthread_create(&streams[i].thread, NULL, transfer_stream_thread, &streams[i]) != 0) break;
+        started++;
+    }
+
+    int finished = 0;
+    while (!finished) {
+        napms(RATE_SAMPLE_MS);
+        pthread_mutex_lock(&x.lock);
+        finished = x.finished == started;
+        ts->streams = x.opened;
+        pthread_mutex_unlock(&x.lock);
+        int64_t moved = 0;
+        long long now = monotonic_ms();
+        for (int i = 0; i < started; i++) {
+            int64_t n = __atomic_load_n(&streams[i].moved, __ATOMIC_RELAXED);
+            moved += n;
+            long long ran = now - streams[i].started_ms;
+            if (streams[i].started_ms && ran >= RATE_SAMPLE_MS && n * 1000.0 / ran > ts->stream_rate) {
+                ts->stream_rate = n * 1000.0 / ran;
+            }
+        }
+        transfer_progress(ts, offset + moved);
+    }
+    for (int i = 0; i < started; i++) pthread_join(streams[i].thread, NULL);
+
+    int ok = !x.failed && !ts->cancel_requested && started > 0;
+    // Everything before the first unfinished stripe has landed; cut a
+    // failed transfer back to that so a retry can resume from it.
+    uint64_t landed = x.size;
+    for (int i = 0; i < x.stripes; i++) {
+        if (!x.stripe_done[i]) {
+            landed = stripe_start(&x, i);
+            ok = 0;
+            break;
+        }
+    }
+    if (x.upload) {
+        attrs.flags = ok ? SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME : SSH_FILEXFER_ATTR_SIZE;
+        attrs.size = landed;
+        attrs.atime = st.st_atime;
+        attrs.mtime = st.st_mtime;
+        sftp_fsetstat(&sftp_session, &h, &attrs);
+        if (!sftp_close_handle(&sftp_session, &h)) ok = 0;
+    } else {
+        if (ok && (attrs.flags & SSH_FILEXFER_ATTR_ACMODTIME)) {
+            struct timespec times[2] = {{attrs.atime, 0}, {attrs.mtime, 0}};
+            futimens(x.fd, times);
+        }
+        if (!ok && ftruncate(x.fd, landed) < 0) {
+            // The next attempt's prefix check will catch the gap instead.
+        }
+    }
+    if (close(x.fd) < 0) ok = 0;
+    pthread_mutex_destroy(&x.lock);
+    free(x.stripe_done);
+    return ok;
+}
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED,
+    JOB_STATES
+} TransferJobState;
+
+typedef struct TransferJob {
+    TransferStatus status;
+    TransferJobState state;
+    long journal_id;
+    struct TransferJob *next;
+} TransferJob;
+
+// Jobs stay on the list after they finish so the queue panel can show
+// them; dispatch points at the first job no worker has picked up yet.
+typedef struct {
+    TransferJob *head;
+    TransferJob *tail;
+    TransferJob *dispatch;
+    pthread_t workers[TRANSFER_MAX_WORKERS];
+    int worker_count;
+    int configured_workers;
+    int stopping;
+    int counts[JOB_STATES];
+    int pending[2];
+    unsigned long finished[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} TransferQueue;
+
+#define TRANSFER_RETRY_BASE_MS 1000
+#define TRANSFER_RETRY_MAX_MS 30000
+#define RESUME_MIN_BYTES (1 << 20)
+
+static int transfer_retries = 3;
+static int transfer_resume = 1;
+
+static TransferQueue transfer_queue = {
+    .configured_workers = 4,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+// scp always starts from byte zero, so a resumed transfer streams the
+// missing tail through ssh and appends it instead.
+// scp from OpenSSH 9.0 on speaks SFTP and takes the remote path as it is;
+// -O keeps the original protocol, where the remote shell reads the path,
+// so a quoted path means the same to every version. Older scp only has
+// the original protocol and rejects -O.
+static int scp_has_legacy_flag(void) {
+    static int known = -1;
+    if (known < 0) {
+        char *argv[] = {"scp", "-O", NULL};
+        SupervisedChild *c = supervisor_spawn(argv, 4096, 1);
+        int legacy = 0;
+        if (c) {
+            supervisor_wait(c, -1);
+            legacy = c->output && !strstr(c->output, "illegal option") && !strstr(c->output, "invalid option") &&
+                     !strstr(c->output, "unknown option");
+            supervisor_release(c);
+        }
+        __atomic_store_n(&known, legacy, __ATOMIC_RELAXED);
+    }
+    return __atomic_load_n(&known, __ATOMIC_RELAXED);
+}
+
+static int run_scp_transfer(TransferStatus *ts, int64_t offset) {
+    SupervisedChild *child;
+    if (offset > 0) {
+        // The tail goes over plain ssh: each path is quoted for the shell
+        // that reads it, the remote one twice.
+        char local[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX], remote_cmd[QUOTED_PATH_MAX + 64];
+        char ssh[QUOTED_PATH_MAX * 2], cmd[sizeof(ssh) + sizeof(local) + 64];
+        int fits = shell_quote(local, sizeof(local), ts->direction == 1 ? ts->source : ts->dest) &&
+                   shell_quote(remote, sizeof(remote), ts->direction == 1 ? ts->dest : ts->source);
+        if (ts->direction == 1) snprintf(remote_cmd, sizeof(remote_cmd), "cat >> %s", remote);
+        else snprintf(remote_cmd, sizeof(remote_cmd), "tail -c +%lld %s", (long long)offset + 1, remote);
+        fits = fits && ssh_remote_command(ssh, sizeof(ssh), ts->hostname, remote_cmd);
+        if (ts->direction == 1) snprintf(cmd, sizeof(cmd), "tail -c +%lld %s | %s", (long long)offset + 1, local, ssh);
+        else snprintf(cmd, sizeof(cmd), "%s >> %s", ssh, local);
+        if (!fits) {
+            snprintf(ts->error, sizeof(ts->error), "Path too long");
+            return 0;
+        }
+        char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+        child = supervisor_spawn(argv, 4096, 1);
+    } else {
+        // No local shell sees the names; only the remote side's is quoted.
+        char quoted[QUOTED_PATH_MAX], remote[MAX_HOSTNAME_LEN + sizeof(quoted) + 1];
+        char control_opt[PATH_MAX + 16];
+        if (!shell_quote(quoted, sizeof(quoted), ts->direction == 1 ? ts->dest : ts->source)) {
+            snprintf(ts->error, sizeof(ts->error), "Path too long");
+            return 0;
+        }
+        snprintf(remote, sizeof(remote), "%s:%s", ts->hostname, quoted);
+        char *argv[12];
+        int argc = 0;
+        argv[argc++] = "scp";
+        if (ssh_master.active) {
+            snprintf(control_opt, sizeof(control_opt), "ControlPath=%s", ssh_master.control_path);
+            argv[argc++] = "-o";
+            argv[argc++] = "ControlMaster=no";
+            argv[argc++] = "-o";
+            argv[argc++] = control_opt;
+        }
+        if (scp_has_legacy_flag()) argv[argc++] = "-O";
+        argv[argc++] = "-v";
+        argv[argc++] = "-p";
+        argv[argc++] = ts->direction == 1 ? ts->source : remote;
+        argv[argc++] = ts->direction == 1 ? remote : ts->dest;
+        argv[argc] = NULL;
+        child = supervisor_spawn(argv, 4096, 1);
+    }
+    if (!child) return 0;
+    int64_t total = -1;
+    struct stat st;
+    if (ts->direction == 1 && stat(ts->source, &st) == 0) total = st.st_size;
+    else if (ts->direction == 0) total = ts->stats.total;
+    transfer_stats_begin(&ts->stats, total);
+    transfer_stats_resume(&ts->stats, offset);
+
+    monitor_transfer_progress(ts, child);
+
+    int ok = supervisor_exit_code(child) == 0;
+    if (!ok && child->output) {
+        // scp -v is chatty; the last line is the one that says what failed.
+        char *end = child->output + child->output_len;
+        while (end > child->output && (end[-1] == '\n' || end[-1] == '\r')) *--end = '\0';
+        char *line = end;
+        while (line > child->output && line[-1] != '\n') line--;
+        strncpy(ts->error, line, sizeof(ts->error)-1);
+    }
+    supervisor_release(child);
+    return ok;
+}
+
+// Size of a remote file, or -1 if it does not exist or cannot be read.
+static int64_t remote_file_size(const char *host, const char *path) {
+    SftpAttrs attrs;
+    if (sftp_session.alive) {
+        if (!sftp_stat(&sftp_session, path, 1, &attrs) || !(attrs.flags & SSH_FILEXFER_ATTR_SIZE)) return -1;
+        return (int64_t)attrs.size;
+    }
+    char quoted[QUOTED_PATH_MAX], remote[sizeof(quoted) + 32], cmd[sizeof(remote) * 4 + 256];
+    if (!shell_quote(quoted, sizeof(quoted), path)) return -1;
+    snprintf(remote, sizeof(remote), "stat -L -c %%s %s", quoted);
+    if (!ssh_remote_command(cmd, sizeof(cmd), host, remote)) return -1;
+    char *output;
+    FILE *fp = capture_command(cmd, &output);
+    if (!fp) return -1;
+    char line[32];
+    int64_t size = fgets(line, sizeof(line), fp) && line[0] >= '0' && line[0] <= '9' ? atoll(line) : -1;
+    fclose(fp);
+    free(output);
+    return size;
+}
+
+// Digest of the first length bytes of path, computed where the file lives
+// (on host, or locally when host is NULL) so no file data crosses the link.
+static SupervisedChild *spawn_prefix_hash(const char *host, const char *path, int64_t length) {
+    char count[32];
+    snprintf(count, sizeof(count), "%lld", (long long)length);
+    if (!host) {
+        char *argv[] = {"/bin/sh", "-c", "head -c \"$1\" -- \"$2\" | sha256sum", "sh", count, (char *)path, NULL};
+        return supervisor_spawn(argv, 256, 0);
+    }
+    char quoted[QUOTED_PATH_MAX], remote[sizeof(quoted) + 64], cmd[sizeof(remote) * 4 + 256];
+    if (!shell_quote(quoted, sizeof(quoted), path)) return NULL;
+    snprintf(remote, sizeof(remote), "head -c %s %s | sha256sum", count, quoted);
+    if (!ssh_remote_command(cmd, sizeof(cmd), host, remote)) return NULL;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    return supervisor_spawn(argv, 256, 0);
+}
+
+// Hashes the prefix on both sides at once and compares the digests.
+static int transfer_prefix_matches(TransferStatus *ts, int64_t length) {
+    const char *local = ts->direction == 1 ? ts->source : ts->dest;
+    const char *remote = ts->direction == 1 ? ts->dest : ts->source;
+    SupervisedChild *hashes[2] = {spawn_prefix_hash(NULL, local, length),
+                                  spawn_prefix_hash(ts->hostname, remote, length)};
+    int ok = hashes[0] && hashes[1];
+    for (int i = 0; i < 2; i++) {
+        if (!hashes[i]) continue;
+        int terminated = 0;
+        while (!supervisor_wait(hashes[i], RATE_SAMPLE_MS)) {
+            if (ts->cancel_requested && !terminated) {
+                supervisor_terminate(hashes[i]);
+                terminated = 1;
+            }
+        }
+        if (supervisor_exit_code(hashes[i]) != 0 || !hashes[i]->output) ok = 0;
+    }
+    if (ok) {
+        size_t len = strcspn(hashes[0]->output, " \n");
+        ok = len == 64 && strcspn(hashes[1]->output, " \n") == len &&
+             memcmp(hashes[0]->output, hashes[1]->output, len) == 0;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (hashes[i]) supervisor_release(hashes[i]);
+    }
+    return ok && !ts->cancel_requested;
+}
+
+// How many bytes of an existing destination can be kept: a partial file
+// left by an earlier attempt is kept if it is a byte-for-byte prefix of
+// the source. Anything else is transferred from the start.
+static int64_t transfer_resume_offset(TransferStatus *ts) {
+    if (!transfer_resume) return 0;
+    int64_t partial = -1;
+    struct stat st;
+    if (ts->direction == 1) {
+        if (stat(ts->source, &st) != 0) return 0;
+        partial = remote_file_size(ts->hostname, ts->dest);
+        if (partial > st.st_size) return 0;
+    } else if (stat(ts->dest, &st) == 0 && S_ISREG(st.st_mode)) {
+        // A longer local file fails the check: the remote prefix comes up short.
+        partial = st.st_size;
+    }
+    if (partial < RESUME_MIN_BYTES) return 0;
+    ts->phase = "checking partial file";
+    ui_notify();
+    int matches = transfer_prefix_matches(ts, partial);
+    ts->phase = NULL;
+    return matches ? partial : 0;
+}
+
+// MD5 (RFC 1321) of one buffer. Only the strong hash of delta blocks; the
+// rebuilt file as a whole is checked with SHA-256.
+static void md5_digest(const unsigned char *data, size_t len, unsigned char out[16]) {
+    static const uint32_t K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const unsigned char R[4][4] = {{7, 12, 17, 22}, {5, 9, 14, 20}, {4, 11, 16, 23}, {6, 10, 15, 21}};
+    uint32_t state[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+    unsigned char tail[128];
+    size_t full = len & ~(size_t)63, tail_len = len - full;
+    memcpy(tail, data + full, tail_len);
+    tail[tail_len++] = 0x80;
+    size_t padded = tail_len <= 56 ? 64 : 128;
+    memset(tail + tail_len, 0, padded - tail_len);
+    for (int i = 0; i < 8; i++) tail[padded - 8 + i] = (unsigned char)((uint64_t)len * 8 >> (8 * i));
+
+    for (size_t offset = 0; offset < full + padded; offset += 64) {
+        const unsigned char *p = offset < full ? data + offset : tail + (offset - full);
+        uint32_t w[16];
+        for (int i = 0; i < 16; i++) {
+            w[i] = p[i * 4] | p[i * 4 + 1] << 8 | p[i * 4 + 2] << 16 | (uint32_t)p[i * 4 + 3] << 24;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        for (int i = 0; i < 64; i++) {
+            uint32_t f;
+            int g;
+            if (i < 16) { f = (b & c) | (~b & d); g = i; }
+            else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+            else if (i < 48) { f = b ^ c ^ d; g = (3 * i + 5) % 16; }
+            else { f = c ^ (b | ~d); g = (7 * i) % 16; }
+            uint32_t x = a + f + K[i] + w[g];
+            int r = R[i / 16][i % 4];
+            a = d;
+            d = c;
+            c = b;
+            b += x << r | x >> (32 - r);
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+    }
+    for (int i = 0; i < 16; i++) out[i] = (unsigned char)(state[i / 4] >> (8 * (i % 4)));
+}
+
+static void base64_encode(const char *in, size_t len, char *out) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const unsigned char *p = (const unsigned char *)in;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t v = p[i] << 16 | (i + 1 < len ? p[i + 1] << 8 : 0) | (i + 2 < len ? p[i + 2] : 0);
+        *out++ = digits[v >> 18];
+        *out++ = digits[v >> 12 & 63];
+        *out++ = i + 1 < len ? digits[v >> 6 & 63] : '=';
+        *out++ = i + 2 < len ? digits[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_MAX_COPY (16 << 20)
+#define DELTA_MAX_LITERAL (1 << 20)
+#define ADLER_MOD 65521
+
+// The remote half of a delta upload runs under python3, which brings zlib
+// and hashlib; the scripts travel base64-encoded on the command line so no
+// quoting survives the trip through ssh and the remote shell.
+static const char delta_signature_script[] =
+    "import sys, zlib, hashlib\n"
+    "f = open(sys.argv[2], 'rb')\n"
+    "n = int(sys.argv[3])\n"
+    "while True:\n"
+    "    b = f.read(n)\n"
+    "    if len(b) < n:\n"
+    "        break\n"
+    "    sys.stdout.write('%08x %s\\n' % (zlib.adler32(b), hashlib.md5(b).hexdigest()))\n";
+
+// Replays copy and literal records into a temporary file next to the
+// destination and renames it over the old copy only if its SHA-256 is the
+// one the stream ends with.
+static const char delta_patch_script[] =
+    "import sys, os, struct, hashlib, tempfile, signal\n"
+    "dest, block, mode, mtime = sys.argv[2], int(sys.argv[3]), int(sys.argv[4], 8), int(sys.argv[5])\n"
+    "for s in (signal.SIGHUP, signal.SIGTERM):\n"
+    "    signal.signal(s, lambda *a: sys.exit(3))\n"
+    "inp = sys.stdin.buffer\n"
+    "old = open(dest, 'rb')\n"
+    "fd, tmp = tempfile.mkstemp(dir=os.path.dirname(dest) or '.', prefix='.scp-tui-')\n"
+    "digest = hashlib.sha256()\n"
+    "ok = False\n"
+    "try:\n"
+    "    with os.fdopen(fd, 'wb') as out:\n"
+    "        while True:\n"
+    "            op = inp.read(1)\n"
+    "            if op == b'C':\n"
+    "                index, count = struct.unpack('>QI', inp.read(12))\n"
+    "                old.seek(index * block)\n"
+    "                data = old.read(count * block)\n"
+    "            elif op == b'L':\n"
+    "                data = inp.read(struct.unpack('>I', inp.read(4))[0])\n"
+    "            else:\n"
+    "                break\n"
+    "            out.write(data)\n"
+    "            digest.update(data)\n"
+    "        ok = op == b'E' and inp.read(64).decode() == digest.hexdigest()\n"
+    "        out.flush()\n"
+    "        os.fsync(out.fileno())\n"
+    "    if ok:\n"
+    "        os.chmod(tmp, mode)\n"
+    "        os.utime(tmp, (mtime, mtime))\n"
+    "        os.rename(tmp, dest)\n"
+    "finally:\n"
+    "    if not ok:\n"
+    "        os.unlink(tmp)\n"
+    "sys.exit(0 if ok else 3)\n";
+
+// Room for any remote_python_command: the script, the path quoted for the
+// remote shell, all of that quoted again locally, and the local input.
+#define REMOTE_PYTHON_CMD_MAX (QUOTED_PATH_MAX * 5 + 8192)
+
+// Runs script on host with the remote path and the plain words in args as
+// its arguments, feeding it input when set. Returns 0 when the command does
+// not fit.
+static int remote_python_command(char *cmd, size_t size, const char *host, const char *script,
+                                 const char *path, const char *args, const char *input) {
+    // Sized for the longest of the scripts.
+    char encoded[sizeof(delta_patch_script) * 4 / 3 + 8];
+    base64_encode(script, strlen(script), encoded);
+    char quoted[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX + sizeof(encoded) + 256];
+    if (!shell_quote(quoted, sizeof(quoted), path)) return 0;
+    int n = snprintf(remote, sizeof(remote), "python3 -c 'import base64,sys;exec(base64.b64decode(sys.argv[1]))' %s %s %s",
+                     encoded, quoted, args);
+    if (n < 0 || (size_t)n >= sizeof(remote) || !ssh_remote_command(cmd, size, host, remote)) return 0;
+    if (!input) return 1;
+    size_t used = strlen(cmd);
+    if (used + 3 >= size) return 0;
+    memcpy(cmd + used, " < ", 3);
+    return shell_quote(cmd + used + 3, size - used - 3, input);
+}
+
+// Block hashes of the remote copy, indexed by weak checksum.
+typedef struct {
+    uint32_t *weak;
+    unsigned char (*strong)[16];
+    int count;
+    int *bucket;
+    int *chain;
+    uint32_t mask;
+} DeltaSignature;
+
+static void delta_signature_free(DeltaSignature *sig) {
+    free(sig->weak);
+    free(sig->strong);
+    free(sig->bucket);
+    free(sig->chain);
+    memset(sig, 0, sizeof(*sig));
+}
+
+static uint32_t delta_bucket(uint32_t weak, uint32_t mask) {
+    return (uint32_t)(((uint64_t)weak * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+// rsync's choice: blocks of about the square root of the file size.
+static long delta_block_size(int64_t size) {
+    long block = DELTA_MIN_BLOCK;
+    while (block < DELTA_MAX_BLOCK && (int64_t)block * block < size) block += 1024;
+    return block;
+}
+
+static int delta_fetch_signature(TransferStatus *ts, long block, int64_t old_size, DeltaSignature *sig,
+                                 int64_t *received) {
+    char args[32], cmd[REMOTE_PYTHON_CMD_MAX];
+    snprintf(args, sizeof(args), "%ld", block);
+    if (!remote_python_command(cmd, sizeof(cmd), ts->hostname, delta_signature_script, ts->dest, args, NULL)) return 0;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    SupervisedChild *child = supervisor_spawn(argv, (old_size / block + 1) * 42 + 4096, 0);
+    if (!child) return 0;
+    int terminated = 0;
+    while (!supervisor_wait(child, RATE_SAMPLE_MS)) {
+        if (ts->cancel_requested && !terminated) {
+            supervisor_terminate(child);
+            terminated = 1;
+        }
+    }
+    int ok = supervisor_exit_code(child) == 0 && !ts->cancel_requested;
+    int capacity = (int)(old_size / block);
+    if (ok && capacity > 0) {
+        uint32_t buckets = 1;
+        while (buckets < (uint32_t)capacity * 2) buckets <<= 1;
+        sig->weak = malloc(capacity * sizeof(uint32_t));
+        sig->strong = malloc(capacity * sizeof(*sig->strong));
+        sig->chain = malloc(capacity * sizeof(int));
+        sig->bucket = malloc(buckets * sizeof(int));
+        ok = sig->weak && sig->strong && sig->chain && sig->bucket;
+        if (ok) {
+            sig->mask = buckets - 1;
+            memset(sig->bucket, 0xff, buckets * sizeof(int));
+        }
+    }
+    *received = child->output_len;
+    for (char *line = child->output; ok && line && *line && sig->count < capacity; ) {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        unsigned int weak;
+        char hex[33];
+        if (sscanf(line, "%8x %32s", &weak, hex) != 2 || strlen(hex) != 32) {
+            ok = 0;
+            break;
+        }
+        int j = sig->count++;
+        sig->weak[j] = weak;
+        for (int i = 0; i < 16; i++) {
+            unsigned int byte;
+            sscanf(hex + 2 * i, "%2x", &byte);
+            sig->strong[j][i] = (unsigned char)byte;
+        }
+        uint32_t b = delta_bucket(weak, sig->mask);
+        sig->chain[j] = sig->bucket[b];
+        sig->bucket[b] = j;
+        line = next;
+    }
+    supervisor_release(child);
+    if (!ok || sig->count == 0) {
+        delta_signature_free(sig);
+        return 0;
+    }
+    return 1;
+}
+
+// Copy and literal records bound for the remote patch script. Runs of
+// consecutive blocks are merged into one copy record.
+typedef struct {
+    FILE *out;
+    int64_t sent;
+    int64_t literal;
+    int64_t matched;
+    uint64_t copy_index;
+    uint32_t copy_count;
+    long block;
+} DeltaWriter;
+
+static void delta_put_be(FILE *out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) fputc((int)(v >> (8 * i)) & 0xff, out);
+}
+
+static void delta_flush_copy(DeltaWriter *w) {
+    if (w->copy_count == 0) return;
+    fputc('C', w->out);
+    delta_put_be(w->out, w->copy_index, 8);
+    delta_put_be(w->out, w->copy_count, 4);
+    w->sent += 13;
+    w->matched += (int64_t)w->copy_count * w->block;
+    w->copy_count = 0;
+}
+
+static void delta_emit_copy(DeltaWriter *w, uint64_t index) {
+    if (w->copy_count > 0 && index == w->copy_index + w->copy_count &&
+        (int64_t)(w->copy_count + 1) * w->block <= DELTA_MAX_COPY) {
+        w->copy_count++;
+        return;
+    }
+    delta_flush_copy(w);
+    w->copy_index = index;
+    w->copy_count = 1;
+}
+
+static void delta_emit_literal(DeltaWriter *w, const unsigned char *data, int64_t len) {
+    if (len <= 0) return;
+    delta_flush_copy(w);
+    while (len > 0) {
+        uint32_t n = len > DELTA_MAX_LITERAL ? DELTA_MAX_LITERAL : (uint32_t)len;
+        fputc('L', w->out);
+        delta_put_be(w->out, n, 4);
+        fwrite(data, 1, n, w->out);
+        w->sent += 5 + n;
+        w->literal += n;
+        data += n;
+        len -= n;
+    }
+}
+
+static void delta_adler(const unsigned char *data, long len, uint32_t *a, uint32_t *b) {
+    uint32_t sa = 1, sb = 0;
+    for (long i = 0; i < len; i++) {
+        sa = (sa + data[i]) % ADLER_MOD;
+        sb = (sb + sa) % ADLER_MOD;
+    }
+    *a = sa;
+    *b = sb;
+}
+
+// Slides a rolling Adler-32 over the new file one byte at a time; where it
+// matches a remote block and MD5 agrees, the block is referenced instead of
+// sent.
+static void delta_scan(TransferStatus *ts, const unsigned char *data, int64_t n, const DeltaSignature *sig,
+                       DeltaWriter *w) {
+    long block = w->block;
+    int64_t k = 0, literal_start = 0;
+    uint32_t a = 0, b = 0;
+    int rolled = 0, last = -1;
+    while (k + block <= n && !ts->cancel_requested) {
+        if (!rolled) {
+            delta_adler(data + k, block, &a, &b);
+            rolled = 1;
+        }
+        uint32_t weak = b << 16 | a;
+        unsigned char digest[16];
+        int digested = 0, match = -1;
+        for (int j = sig->bucket[delta_bucket(weak, sig->mask)]; j >= 0; j = sig->chain[j]) {
+            if (sig->weak[j] != weak) continue;
+            if (!digested) {
+                md5_digest(data + k, block, digest);
+                digested = 1;
+            }
+            if (memcmp(sig->strong[j], digest, 16) != 0) continue;
+            match = j;
+            if (j == last + 1) break;
+        }
+        if (match >= 0) {
+            delta_emit_literal(w, data + literal_start, k - literal_start);
+            delta_emit_copy(w, match);
+            last = match;
+            k += block;
+            literal_start = k;
+            rolled = 0;
+            continue;
+        }
+        if (k + block < n) {
+            uint32_t out = data[k], in = data[k + block];
+            a = (a + ADLER_MOD - out + in) % ADLER_MOD;
+            int64_t nb = ((int64_t)b - (int64_t)(block % ADLER_MOD) * out - 1 + a) % ADLER_MOD;
+            b = (uint32_t)(nb < 0 ? nb + ADLER_MOD : nb);
+        }
+        k++;
+        // The scan shows as the first tenth of the bar: it reads the whole
+        // file but is quick next to sending the literals. n is the file
+        // size, so the scaled position is just k / 10.
+        if ((k & 0xfffff) == 0) transfer_progress(ts, k / 10);
+    }
+    delta_emit_literal(w, data + literal_start, n - literal_start);
+    delta_flush_copy(w);
+}
+
+// Uploads only what changed against the remote copy, rsync style: the
+// remote side hashes its blocks, the local file is matched against them,
+// and the remote side rebuilds the file from its own blocks plus the
+// literal bytes. Returns -1 when a delta is not possible or not worth it
+// (no remote copy, no python3 there, mostly new content) so the caller
+// falls back to a full upload.
+static int delta_upload_file(TransferStatus *ts) {
+    if (ts->direction != 1) return -1;
+    int64_t old_size = remote_file_size(ts->hostname, ts->dest);
+    if (old_size < DELTA_MIN_BLOCK) return -1;
+    int fd = open(ts->source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    const unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    transfer_stats_begin(&ts->stats, st.st_size);
+    ts->phase = "computing delta";
+    ui_notify();
+    // The whole-file digest the remote result must match, hashed meanwhile.
+    SupervisedChild *whole = spawn_prefix_hash(NULL, ts->source, st.st_size);
+    long block = delta_block_size(old_size);
+    DeltaSignature sig = {0};
+    int64_t signature_bytes = 0;
+    int result = -1;
+    char ops_path[PATH_MAX] = "";
+    FILE *out = NULL;
+    DeltaWriter w = {0};
+    w.block = block;
+
+    if (!whole || !delta_fetch_signature(ts, block, old_size, &sig, &signature_bytes)) goto done;
+    const char *tmp = getenv("TMPDIR");
+    snprintf(ops_path, sizeof(ops_path), "%s/scp-tui-delta-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    int ops_fd = mkstemp(ops_path);
+    if (ops_fd < 0) {
+        ops_path[0] = '\0';
+        goto done;
+    }
+    out = fdopen(ops_fd, "w");
+    if (!out) {
+        close(ops_fd);
+        goto done;
+    }
+    w.out = out;
+    delta_scan(ts, data, st.st_size, &sig, &w);
+    if (ts->cancel_requested) {
+        result = 0;
+        goto done;
+    }
+    if (w.literal > st.st_size - st.st_size / 8) goto done;
+
+    int terminated = 0;
+    while (!supervisor_wait(whole, RATE_SAMPLE_MS)) {
+        if (ts->cancel_requested && !terminated) {
+            supervisor_terminate(whole);
+            terminated = 1;
+        }
+    }
+    if (supervisor_exit_code(whole) != 0 || !whole->output || strcspn(whole->output, " \n") != 64) goto done;
+    fputc('E', out);
+    fwrite(whole->output, 1, 64, out);
+    w.sent += 65;
+    int write_failed = ferror(out);
+    if (fclose(out) != 0 || write_failed) {
+        out = NULL;
+        goto done;
+    }
+    out = NULL;
+
+    char args[64], cmd[REMOTE_PYTHON_CMD_MAX];
+    snprintf(args, sizeof(args), "%ld %o %lld", block, (unsigned int)(st.st_mode & 0777), (long long)st.st_mtime);
+    if (!remote_python_command(cmd, sizeof(cmd), ts->hostname, delta_patch_script, ts->dest, args, ops_path))
+        goto done;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    SupervisedChild *child = supervisor_spawn(argv, 4096, 1);
+    if (!child) goto done;
+    ts->phase = NULL;
+    transfer_stats_begin(&ts->stats, st.st_size);
+    transfer_stats_resume(&ts->stats, w.matched);
+    terminated = 0;
+    while (!supervisor_wait(child, RATE_SAMPLE_MS)) {
+        if (ts->cancel_requested && !terminated) {
+            supervisor_terminate(child);
+            terminated = 1;
+        }
+        int64_t pos = scp_source_offset(child->pid, ops_path, 0);
+        if (pos >= 0) transfer_progress(ts, w.matched + (int64_t)((double)pos / w.sent * w.literal));
+    }
+    int code = supervisor_exit_code(child);
+    supervisor_release(child);
+    if (code == 0 && !ts->cancel_requested) {
+        // A file that changed throughout costs more than sending it whole.
+        int64_t saved = st.st_size - w.sent - signature_bytes;
+        ts->saved = saved > 0 ? saved : 0;
+        result = 1;
+    } else if (code == 3 && !ts->cancel_requested) {
+        // The rebuilt file did not match: send it whole instead.
+        result = -1;
+    } else {
+        snprintf(ts->error, sizeof(ts->error), "delta upload failed (exit %d)", code);
+        result = 0;
+    }
+
+done:
+    ts->phase = NULL;
+    if (out) fclose(out);
+    if (ops_path[0]) unlink(ops_path);
+    if (whole) {
+        if (!supervisor_wait(whole, 0)) {
+            supervisor_terminate(whole);
+            supervisor_wait(whole, -1);
+        }
+        supervisor_release(whole);
+    }
+    delta_signature_free(&sig);
+    munmap((void *)data, st.st_size);
+    return result;
+}
+
+#define BUNDLE_MAX_FILE_SIZE (256 * 1024)
+#define BUNDLE_MIN_FILES 4
+#define BUNDLE_MAX_FILES 1024
+#define TAR_BLOCK 512
+
+// ustar numbers are zero-padded octal ending in a NUL.
+static void tar_put_octal(unsigned char *field, int width, uint64_t value) {
+    char digits[24];
+    snprintf(digits, sizeof(digits), "%0*llo", width - 1, (unsigned long long)value);
+    memcpy(field, digits, width - 1);
+}
+
+static uint64_t tar_get_number(const unsigned char *field, int width) {
+    uint64_t value = 0;
+    if (field[0] & 0x80) {
+        // GNU base-256, for values that do not fit in octal.
+        value = field[0] & 0x7f;
+        for (int i = 1; i < width; i++) value = value << 8 | field[i];
+        return value;
+    }
+    int i = 0;
+    while (i < width && field[i] == ' ') i++;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++) value = value << 3 | (field[i] - '0');
+    return value;
+}
+
+static unsigned int tar_checksum(const unsigned char *header) {
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++) sum += i >= 148 && i < 156 ? ' ' : header[i];
+    return sum;
+}
+
+static void tar_header(unsigned char *header, const char *name, char type, unsigned int mode,
+                       uint64_t size, int64_t mtime) {
+    memset(header, 0, TAR_BLOCK);
+    size_t len = strlen(name);
+    memcpy(header, name, len < 100 ? len : 100);
+    tar_put_octal(header + 100, 8, mode);
+    tar_put_octal(header + 108, 8, 0);
+    tar_put_octal(header + 116, 8, 0);
+    tar_put_octal(header + 124, 12, size);
+    tar_put_octal(header + 136, 12, mtime > 0 ? (uint64_t)mtime : 0);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    char sum[8];
+    snprintf(sum, sizeof(sum), "%06o", tar_checksum(header));
+    memcpy(header + 148, sum, 7);
+    header[155] = ' ';
+}
+
+// Moves len bytes through a non-blocking pipe, within the bandwidth caps,
+// waking every sample period to check for a cancel. Returns 0 on end of
+// stream, error, or cancel.
+static int bundle_pipe_io(int fd, void *buf, size_t len, int writing, TransferStatus *ts) {
+    char *p = buf;
+    if (!shaper_take(ts, len)) return 0;
+    while (len > 0) {
+        if (ts->cancel_requested) return 0;
+        ssize_t n = writing ? write(fd, p, len) : read(fd, p, len);
+        if (n > 0) {
+            p += n;
+            len -= n;
+            continue;
+        }
+        if (n == 0 || (errno != EINTR && errno != EAGAIN)) return 0;
+        struct pollfd pfd = {.fd = fd, .events = writing ? POLLOUT : POLLIN};
+        poll(&pfd, 1, RATE_SAMPLE_MS);
+    }
+    return 1;
+}
+
+static int bundle_skip(int fd, uint64_t len, TransferStatus *ts) {
+    char buf[TAR_BLOCK * 8];
+    while (len > 0) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (!bundle_pipe_io(fd, buf, n, 0, ts)) return 0;
+        len -= n;
+    }
+    return 1;
+}
+
+static uint64_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+// Waits out one end of a streamed transfer (the remote tar, a compressor),
+// stopping it on a cancel, and turns a bad exit into the job's error using
+// the first thing it printed.
+static int stream_child_finish(TransferStatus *ts, SupervisedChild *child, int ok, const char *what) {
+    int terminated = 0;
+    while (!supervisor_wait(child, RATE_SAMPLE_MS)) {
+        if ((ts->cancel_requested || !ok) && !terminated) {
+            supervisor_terminate(child);
+            terminated = 1;
+        }
+    }
+    int code = supervisor_exit_code(child);
+    if (code != 0 && !ts->error[0] && !ts->cancel_requested) {
+        const char *message = child->output && child->output_len ? child->output : "";
+        snprintf(ts->error, sizeof(ts->error), "%s exited %d: %.*s", what, code,
+                 (int)strcspn(message, "\n"), message);
+    }
+    supervisor_release(child);
+    return ok && code == 0 && !ts->cancel_requested;
+}
+
+// "ssh host 'tar -C dir ...'" with dir quoted for both shells. A directory
+// that does not fit fails the job rather than run a cut-off command.
+static int bundle_tar_command(TransferStatus *ts, char *cmd, size_t size, const char *dir, const char *args) {
+    char quoted[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX + 64];
+    if (!shell_quote(quoted, sizeof(quoted), dir) ||
+        snprintf(remote, sizeof(remote), "tar -C %s %s", quoted, args) >= (int)sizeof(remote) ||
+        !ssh_remote_command(cmd, size, ts->hostname, remote)) {
+        snprintf(ts->error, sizeof(ts->error), "Path too long");
+        return 0;
+    }
+    return 1;
+}
+
+// Streams the bundle's files as one tar archive into a remote tar, so a
+// thousand small files cost one channel instead of a thousand scp runs.
+// Deletes the remote copy of a bundled file that did not arrive whole.
+static void bundle_remove_remote(TransferStatus *ts, const char *name) {
+    char path[PATH_MAX], quoted[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX + 16], cmd[QUOTED_PATH_MAX * 4 + 512];
+    if (!join_path(path, sizeof(path), ts->dest, name) || !shell_quote(quoted, sizeof(quoted), path)) return;
+    snprintf(remote, sizeof(remote), "rm -f -- %s", quoted);
+    if (!ssh_remote_command(cmd, sizeof(cmd), ts->hostname, remote)) return;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    run_quiet(argv);
+}
+
+static int bundle_upload(TransferStatus *ts) {
+    char cmd[QUOTED_PATH_MAX * 4 + 256];
+    if (!bundle_tar_command(ts, cmd, sizeof(cmd), ts->dest, "--no-same-owner -xf -")) return 0;
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return 0;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    SupervisedChild *child = supervisor_spawn_piped(argv, 4096, fds[0], -1);
+    close(fds[0]);
+    if (!child) {
+        close(fds[1]);
+        return 0;
+    }
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+    char *buf = malloc(65536);
+    const char **short_names = malloc((ts->files + 1) * sizeof(char *));
+    if (!buf || !short_names) {
+        free(buf);
+        free(short_names);
+        close(fds[1]);
+        snprintf(ts->error, sizeof(ts->error), "out of memory");
+        return stream_child_finish(ts, child, 0, "tar");
+    }
+    int short_count = 0;
+    unsigned char header[TAR_BLOCK];
+    int64_t sent = 0;
+    int ok = 1;
+    const char *name = ts->names;
+    for (int i = 0; ok && i < ts->files; i++, name += strlen(name) + 1) {
+        ts->current = name;
+        char path[PATH_MAX];
+        int fd = join_path(path, sizeof(path), ts->source, name) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            snprintf(ts->error, sizeof(ts->error), "cannot read %.100s", name);
+            if (fd >= 0) close(fd);
+            ok = 0;
+            break;
+        }
+        size_t name_len = strlen(name);
+        if (name_len >= 100) {
+            // GNU long-name record carries names that do not fit the header.
+            tar_header(header, "././@LongLink", 'L', 0644, name_len + 1, 0);
+            memset(buf, 0, TAR_BLOCK);
+            memcpy(buf, name, name_len);
+            ok = bundle_pipe_io(fds[1], header, TAR_BLOCK, 1, ts) &&
+                 bundle_pipe_io(fds[1], buf, name_len + 1 + tar_padding(name_len + 1), 1, ts);
+        }
+        tar_header(header, name, '0', st.st_mode & 0777, st.st_size, st.st_mtime);
+        ok = ok && bundle_pipe_io(fds[1], header, TAR_BLOCK, 1, ts);
+        // The header promised st_size bytes; a file that shrank meanwhile,
+        // or failed to read, is padded with zeros so the archive stays
+        // well-formed, and its remote copy is removed afterwards.
+        int whole = 1;
+        for (int64_t left = st.st_size; ok && left > 0; ) {
+            size_t want = left < 65536 ? (size_t)left : 65536;
+            ssize_t n = whole ? read(fd, buf, want) : 0;
+            if (n <= 0) {
+                whole = 0;
+                memset(buf, 0, want);
+                n = want;
+            }
+            ok = bundle_pipe_io(fds[1], buf, n, 1, ts);
+            left -= n;
+            sent += n;
+            transfer_progress(ts, sent);
+        }
+        memset(buf, 0, TAR_BLOCK);
+        ok = ok && bundle_pipe_io(fds[1], buf, tar_padding(st.st_size), 1, ts);
+        close(fd);
+        if (!whole) short_names[short_count++] = name;
+        else if (ok) ts->files_done++;
+    }
+    ts->current = NULL;
+    memset(buf, 0, TAR_BLOCK * 2);
+    ok = ok && bundle_pipe_io(fds[1], buf, TAR_BLOCK * 2, 1, ts);
+    free(buf);
+    close(fds[1]);
+    ok = stream_child_finish(ts, child, ok, "tar");
+    // Whatever became of the stream, files known to be cut short must not
+    // be left behind looking transferred.
+    for (int i = 0; i < short_count; i++) bundle_remove_remote(ts, short_names[i]);
+    if (ok && short_count > 0) {
+        snprintf(ts->error, sizeof(ts->error), "%.100s changed while being read", short_names[0]);
+        ok = 0;
+    }
+    free(short_names);
+    return ok;
+}
+
+typedef struct {
+    int fd;
+    const char *names;
+    size_t len;
+} BundleNameFeed;
+
+// The remote tar reads its file list from stdin while its archive comes
+// back on stdout, so the list is fed from a thread of its own.
+static void *bundle_feed_names(void *arg) {
+    BundleNameFeed *feed = (BundleNameFeed *)arg;
+    write_full(feed->fd, feed->names, feed->len);
+    close(feed->fd);
+    return NULL;
+}
+
+// Has the remote tar archive the bundle's files and unpacks the stream
+// here as it arrives. Only plain names are accepted back, so a hostile
+// archive cannot write outside the destination directory.
+static int bundle_download(TransferStatus *ts) {
+    char cmd[QUOTED_PATH_MAX * 4 + 256];
+    if (!bundle_tar_command(ts, cmd, sizeof(cmd), ts->source, "-h --null -T - -cf -")) return 0;
+    int names_fds[2], tar_fds[2];
+    if (pipe2(names_fds, O_CLOEXEC) < 0) return 0;
+    if (pipe2(tar_fds, O_CLOEXEC) < 0) {
+        close(names_fds[0]);
+        close(names_fds[1]);
+        return 0;
+    }
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    SupervisedChild *child = supervisor_spawn_piped(argv, 4096, names_fds[0], tar_fds[1]);
+    close(names_fds[0]);
+    close(tar_fds[1]);
+    if (!child) {
+        close(names_fds[1]);
+        close(tar_fds[0]);
+        return 0;
+    }
+    const char *last = ts->names;
+    for (int i = 0; i < ts->files; i++) last += strlen(last) + 1;
+    BundleNameFeed feed = {names_fds[1], ts->names, (size_t)(last - ts->names)};
+    pthread_t feeder;
+    int feeding = pthread_create(&feeder, NULL, bundle_feed_names, &feed) == 0;
+    if (!feeding) close(names_fds[1]);
+    fcntl(tar_fds[0], F_SETFL, fcntl(tar_fds[0], F_GETFL) | O_NONBLOCK);
+
+    char *buf = malloc(65536);
+    if (buf == NULL) snprintf(ts->error, sizeof(ts->error), "out of memory");
+    unsigned char header[TAR_BLOCK];
+    char long_name[PATH_MAX] = "";
+    const char *expected = ts->names;
+    int64_t received = 0;
+    int ok = feeding && buf;
+    while (ok) {
+        if (!bundle_pipe_io(tar_fds[0], header, TAR_BLOCK, 0, ts)) {
+            ok = 0;
+            break;
+        }
+        int empty = 1;
+        for (int i = 0; i < TAR_BLOCK && empty; i++) empty = header[i] == 0;
+        if (empty) break;
+        if (tar_get_number(header + 148, 8) != tar_checksum(header)) {
+            strcpy(ts->error, "corrupt tar stream");
+            ok = 0;
+            break;
+        }
+        char type = header[156];
+        uint64_t size = tar_get_number(header + 124, 12);
+        uint64_t padded = size + tar_padding(size);
+        if (type == 'L' || type == 'x') {
+            // A long name (GNU) or pax attributes naming the next entry.
+            if (size >= 65536 || !bundle_pipe_io(tar_fds[0], buf, padded, 0, ts)) {
+                ok = 0;
+                break;
+            }
+            buf[size] = '\0';
+            if (type == 'L') {
+                snprintf(long_name, sizeof(long_name), "%s", buf);
+            }
+            for (char *record = buf; type == 'x' && record < buf + size; ) {
+                char *end;
+                long len = strtol(record, &end, 10);
+                if (len <= 0 || record + len > buf + size) break;
+                if (strncmp(end, " path=", 6) == 0) {
+                    snprintf(long_name, sizeof(long_name), "%.*s", (int)(record + len - end - 7), end + 6);
+                }
+                record += len;
+            }
+            continue;
+        }
+        char name[PATH_MAX];
+        if (long_name[0]) {
+            snprintf(name, sizeof(name), "%s", long_name);
+            long_name[0] = '\0';
+        } else if (header[345]) {
+            snprintf(name, sizeof(name), "%.155s/%.100s", (char *)header + 345, (char *)header);
+        } else {
+            snprintf(name, sizeof(name), "%.100s", (char *)header);
+        }
+        if (type != '0' && type != '\0' && type != '7') {
+            ok = bundle_skip(tar_fds[0], padded, ts);
+            continue;
+        }
+        if (!name[0] || strchr(name, '/') || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            snprintf(ts->error, sizeof(ts->error), "unexpected name in tar stream: %.80s", name);
+            ok = 0;
+            break;
+        }
+        if (ts->files_done < ts->files && strcmp(name, expected) == 0) {
+            ts->current = expected;
+            expected += strlen(expected) + 1;
+        }
+        char path[PATH_MAX];
+        int fd = join_path(path, sizeof(path), ts->dest, name)
+            ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, (mode_t)tar_get_number(header + 100, 8) & 0777)
+            : -1;
+        if (fd < 0) {
+            snprintf(ts->error, sizeof(ts->error), "cannot write %.100s", name);
+            ok = 0;
+            break;
+        }
+        for (uint64_t left = size; ok && left > 0; ) {
+            size_t n = left < 65536 ? (size_t)left : 65536;
+            ok = bundle_pipe_io(tar_fds[0], buf, n, 0, ts) && write_full(fd, buf, n);
+            left -= n;
+            received += n;
+            transfer_progress(ts, received);
+        }
+        if (ok) {
+            struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {(time_t)tar_get_number(header + 136, 12), 0}};
+            futimens(fd, times);
+        }
+        if (close(fd) < 0) ok = 0;
+        ok = ok && bundle_skip(tar_fds[0], padded - size, ts);
+        if (ok) ts->files_done++;
+    }
+    ts->current = NULL;
+    free(buf);
+    close(tar_fds[0]);
+    ok = stream_child_finish(ts, child, ok, "tar");
+    if (feeding) pthread_join(feeder, NULL);
+    return ok;
+}
+
+// A bundle is retried as a whole; files that made it last time are simply
+// sent again.
+static int bundle_transfer(TransferStatus *ts) {
+    transfer_stats_begin(&ts->stats, ts->bundle_bytes);
+    ts->files_done = 0;
+    return ts->direction == 1 ? bundle_upload(ts) : bundle_download(ts);
+}
+
+// Files that compress well go through a streaming compressor on both ends
+// instead of SFTP or scp; the rest are sent as they are. The decision is
+// per file, from a sample of the blocks about to be sent.
+#define COMPRESS_MIN_BYTES (1LL << 20)
+#define COMPRESS_SAMPLE_SIZE (128 * 1024)
+#define COMPRESS_HASH_BITS 14
+#define COMPRESS_MAX_RATIO 0.8
+
+static int transfer_compress_level = 1;
+
+// Tried in order; both ends need the same one.
+typedef struct {
+    const char *name;
+    int max_level;
+} Compressor;
+
+static const Compressor compressors[] = {{"zstd", 19}, {"gzip", 9}};
+
+static struct {
+    pthread_mutex_t lock;
+    char host[MAX_HOSTNAME_LEN];
+    const Compressor *tool;
+} compress_probe = {PTHREAD_MUTEX_INITIALIZER, "", NULL};
+
+// First compressor found both here and on host, probed once per host.
+static const Compressor *compressor_for_host(const char *host) {
+    pthread_mutex_lock(&compress_probe.lock);
+    if (strcmp(compress_probe.host, host) != 0) {
+        compress_probe.tool = NULL;
+        for (size_t i = 0; i < sizeof(compressors) / sizeof(compressors[0]) && !compress_probe.tool; i++) {
+            char check[64], cmd[PATH_MAX * 2];
+            snprintf(check, sizeof(check), "command -v %s >/dev/null", compressors[i].name);
+            char *local[] = {"/bin/sh", "-c", check, NULL};
+            if (run_quiet(local) != 0) continue;
+            if (!ssh_remote_command(cmd, sizeof(cmd), host, check)) continue;
+            char *remote[] = {"/bin/sh", "-c", cmd, NULL};
+            if (run_quiet(remote) == 0) compress_probe.tool = &compressors[i];
+        }
+        snprintf(compress_probe.host, sizeof(compress_probe.host), "%s", host);
+    }
+    const Compressor *tool = compress_probe.tool;
+    pthread_mutex_unlock(&compress_probe.lock);
+    return tool;
+}
+
+// log2 to within a tenth of a bit, which is all the estimate below needs.
+static double log2_estimate(size_t x) {
+    int bits = 0;
+    while ((x >> bits) > 1) bits++;
+    return bits + (double)(x - ((size_t)1 << bits)) / (double)((size_t)1 << bits);
+}
+
+// Rough compressed size of buf as a fraction of its length: a greedy LZ
+// parse over 4-byte hashes, with each match costed at three bytes and the
+// literals left over at their order-0 entropy. Enough to tell a log from
+// an archive without carrying a codec.
+static double compress_estimate(const unsigned char *buf, size_t len) {
+    if (len < 64) return 1.0;
+    uint32_t *table = calloc((size_t)1 << COMPRESS_HASH_BITS, sizeof(uint32_t));
+    // Without a table, guess incompressible: the file is sent as it is.
+    if (table == NULL) return 1.0;
+    size_t counts[256] = {0};
+    size_t literals = 0, matches = 0, i = 0;
+    while (i + 4 <= len) {
+        uint32_t word;
+        memcpy(&word, buf + i, 4);
+        uint32_t slot = (word * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+        size_t candidate = table[slot];
+        table[slot] = (uint32_t)i + 1;
+        if (candidate && memcmp(buf + candidate - 1, buf + i, 4) == 0) {
+            size_t match = 4;
+            while (i + match < len && buf[candidate - 1 + match] == buf[i + match]) match++;
+            matches++;
+            i += match;
+            continue;
+        }
+        counts[buf[i++]]++;
+        literals++;
+    }
+    for (; i < len; i++, literals++) counts[buf[i]]++;
+    free(table);
+
+    double bits = 0;
+    for (int c = 0; c < 256; c++) {
+        if (counts[c]) bits += counts[c] * (log2_estimate(literals) - log2_estimate(counts[c]));
+    }
+    return (bits / 8 + matches * 3.0) / len;
+}
+
+// Reads up to want bytes about to be sent, together with the file's size,
+// mode and mtime; downloads fetch it all in one remote command. Returns
+// the number of sample bytes, or -1 if the file could not be read.
+static ssize_t compress_sample(TransferStatus *ts, int64_t offset, unsigned char *sample, size_t want,
+                               int64_t *size, unsigned *mode, long long *mtime) {
+    if (ts->direction == 1) {
+        int fd = open(ts->source, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        *size = st.st_size;
+        *mode = st.st_mode & 0777;
+        *mtime = st.st_mtime;
+        ssize_t n = want ? pread(fd, sample, want, offset) : 0;
+        close(fd);
+        return n;
+    }
+    char quoted[QUOTED_PATH_MAX], remote[sizeof(quoted) * 2 + 128], cmd[sizeof(remote) * 4 + 256];
+    if (!shell_quote(quoted, sizeof(quoted), ts->source)) return -1;
+    snprintf(remote, sizeof(remote), "stat -L -c '%%s %%a %%Y' %s && tail -c +%lld %s | head -c %zu", quoted,
+             (long long)offset + 1, quoted, want);
+    if (!ssh_remote_command(cmd, sizeof(cmd), ts->hostname, remote)) return -1;
+    char *output;
+    FILE *fp = capture_command(cmd, &output);
+    if (!fp) return -1;
+    long long length;
+    ssize_t n = -1;
+    if (fscanf(fp, "%lld %o %lld", &length, mode, mtime) == 3 && fgetc(fp) == '\n') {
+        *size = length;
+        n = want ? fread(sample, 1, want, fp) : 0;
+    }
+    fclose(fp);
+    free(output);
+    return n;
+}
+
+// Compressed bytes sent for each byte of the file, over what has been sent
+// so far.
+static double transfer_compress_ratio(const TransferStatus *ts) {
+    int64_t sent = ts->stats.done - ts->stats.resumed;
+    return ts->wire_bytes > 0 && sent > 0 ? (double)sent / ts->wire_bytes : 0;
+}
+
+static int piped_transfer(TransferStatus *ts, int64_t offset, const Compressor *tool, int level,
+                          int64_t size, unsigned mode, long long mtime);
+
+// Sends the file through a compressor when the sample says it will pay.
+// Returns -1 when it will not (or no compressor is around), so the caller
+// sends the file as it is.
+static int compressed_transfer(TransferStatus *ts, int64_t offset) {
+    if (transfer_compress_level <= 0) return -1;
+    if (ts->direction == 0 && ts->stats.total >= 0 && ts->stats.total - offset < COMPRESS_MIN_BYTES) return -1;
+    const Compressor *tool = compressor_for_host(ts->hostname);
+    if (!tool) return -1;
+
+    unsigned char *sample = malloc(COMPRESS_SAMPLE_SIZE);
+    if (sample == NULL) return -1;
+    int64_t size = -1;
+    unsigned mode = 0644;
+    long long mtime = 0;
+    ssize_t got = compress_sample(ts, offset, sample, COMPRESS_SAMPLE_SIZE, &size, &mode, &mtime);
+    double estimate = got > 0 && size - offset >= COMPRESS_MIN_BYTES ? compress_estimate(sample, got) : 1.0;
+    free(sample);
+    if (estimate > COMPRESS_MAX_RATIO) return -1;
+
+    int level = transfer_compress_level < tool->max_level ? transfer_compress_level : tool->max_level;
+    return piped_transfer(ts, offset, tool, level, size, mode, mtime);
+}
+
+// Moves up to len bytes of a stream from one descriptor to the other; at
+// least one is a pipe, and an offset is given for the one that is a file.
+// splice hands the pages over inside the kernel. Returns what splice does,
+// with errno EINVAL when the pair cannot be spliced.
+#define STREAM_PIPE_SIZE (1 << 20)
+
+static ssize_t stream_splice(int from, loff_t *from_off, int to, loff_t *to_off, size_t len) {
+    return splice(from, from_off, to, to_off, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+// Read and write for when splice will not do, or the bytes have to be
+// seen for the verifier.
+static ssize_t stream_copy(int from, loff_t *from_off, int to, loff_t *to_off, char *buf, size_t len,
+                           TransferStatus *ts) {
+    ssize_t n = from_off ? pread(from, buf, len, *from_off) : read(from, buf, len);
+    if (n <= 0) return n;
+    if (from_off) *from_off += n;
+    if (to_off) {
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = pwrite(to, buf + done, n - done, *to_off);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return -1;
+            done += w;
+            *to_off += w;
+        }
+    } else if (!bundle_pipe_io(to, buf, n, 1, ts)) {
+        return -1;
+    }
+    return n;
+}
+
+// Waits for whichever pipe end held the last move up: poll says which
+// ones are ready, and only the others are waited on.
+static void stream_wait(int from, int from_is_pipe, int to, int to_is_pipe) {
+    struct pollfd pfd[2];
+    int count = 0;
+    if (from_is_pipe) pfd[count++] = (struct pollfd){.fd = from, .events = POLLIN};
+    if (to_is_pipe) pfd[count++] = (struct pollfd){.fd = to, .events = POLLOUT};
+    poll(pfd, count, 0);
+    struct pollfd waiting[2];
+    int blocked = 0;
+    for (int i = 0; i < count; i++) {
+        if (!pfd[i].revents) waiting[blocked++] = pfd[i];
+    }
+    if (blocked) poll(waiting, blocked, RATE_SAMPLE_MS);
+}
+
+// Sends the file from offset over ssh with this process in the middle,
+// through tool on both ends if there is one. Without one, this process is
+// the local end itself and splices between the file and the ssh pipe, so
+// the data never passes through user space; compressed streams are
+// spliced from one pipe to the other. Every byte on the wire passes the
+// bandwidth shaper and the compressed ones are counted.
+static int piped_transfer(TransferStatus *ts, int64_t offset, const Compressor *tool, int level,
+                          int64_t size, unsigned mode, long long mtime) {
+    char quoted_source[QUOTED_PATH_MAX], quoted_dest[QUOTED_PATH_MAX];
+    char pack[QUOTED_PATH_MAX + 128], unpack[QUOTED_PATH_MAX + 128];
+    if (!shell_quote(quoted_source, sizeof(quoted_source), ts->source) ||
+        !shell_quote(quoted_dest, sizeof(quoted_dest), ts->dest)) {
+        snprintf(ts->error, sizeof(ts->error), "Path too long");
+        return 0;
+    }
+    if (!tool) {
+        snprintf(pack, sizeof(pack), "tail -c +%lld %s", (long long)offset + 1, quoted_source);
+        snprintf(unpack, sizeof(unpack), "cat %s %s", offset > 0 ? ">>" : ">", quoted_dest);
+    } else if (offset > 0) {
+        snprintf(pack, sizeof(pack), "tail -c +%lld %s | %s -q -%d -c", (long long)offset + 1, quoted_source,
+                 tool->name, level);
+    } else {
+        snprintf(pack, sizeof(pack), "%s -q -%d -c < %s", tool->name, level, quoted_source);
+    }
+    if (tool) snprintf(unpack, sizeof(unpack), "%s -q -d -c %s %s", tool->name, offset > 0 ? ">>" : ">", quoted_dest);
+    const char *what = tool ? tool->name : "ssh";
+    // The remote half is quoted again for the local shell.
+    char send_cmd[sizeof(pack) * 4 + 256], receive_cmd[sizeof(unpack) * 12 + 256];
+    int fits = 1;
+    if (ts->direction == 1) {
+        char remote[sizeof(unpack) * 3 + 64];
+        snprintf(send_cmd, sizeof(send_cmd), "%s", pack);
+        snprintf(remote, sizeof(remote), "%s && chmod %o %s && touch -d @%lld %s", unpack, mode, quoted_dest, mtime,
+                 quoted_dest);
+        fits = ssh_remote_command(receive_cmd, sizeof(receive_cmd), ts->hostname, remote);
+    } else {
+        fits = ssh_remote_command(send_cmd, sizeof(send_cmd), ts->hostname, pack);
+        snprintf(receive_cmd, sizeof(receive_cmd), "%s", unpack);
+    }
+    if (!fits) {
+        snprintf(ts->error, sizeof(ts->error), "Path too long");
+        return 0;
+    }
+
+    // Without a tool the local file takes the place of the local child.
+    int file_fd = -1;
+    if (!tool) {
+        file_fd = ts->direction == 1
+            ? open(ts->source, O_RDONLY | O_CLOEXEC)
+            : open(ts->dest, O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? 0 : O_TRUNC), 0644);
+        if (file_fd < 0 || (ts->direction == 0 && offset > 0 && ftruncate(file_fd, offset) < 0)) {
+            snprintf(ts->error, sizeof(ts->error), "%s: %s", ts->direction == 1 ? "cannot read source" :
+                     "cannot write destination", strerror(errno));
+            if (file_fd >= 0) close(file_fd);
+            return 0;
+        }
+    }
+    int local_sender = tool || ts->direction == 0;
+    int local_receiver = tool || ts->direction == 1;
+    int in_fds[2] = {-1, -1}, out_fds[2] = {-1, -1};
+    if ((local_sender && pipe2(in_fds, O_CLOEXEC) < 0) || (local_receiver && pipe2(out_fds, O_CLOEXEC) < 0)) {
+        if (in_fds[0] >= 0) {
+            close(in_fds[0]);
+            close(in_fds[1]);
+        }
+        if (file_fd >= 0) close(file_fd);
+        return 0;
+    }
+    char *receive_argv[] = {"/bin/sh", "-c", receive_cmd, NULL};
+    char *send_argv[] = {"/bin/sh", "-c", send_cmd, NULL};
+    SupervisedChild *receiver = local_receiver ? supervisor_spawn_piped(receive_argv, 4096, out_fds[0], -1) : NULL;
+    SupervisedChild *sender = local_sender && (receiver || !local_receiver)
+        ? supervisor_spawn_piped(send_argv, 4096, -1, in_fds[1]) : NULL;
+    if (local_receiver) close(out_fds[0]);
+    if (local_sender) close(in_fds[1]);
+    if ((local_receiver && !receiver) || (local_sender && !sender)) {
+        if (local_sender) close(in_fds[0]);
+        if (local_receiver) close(out_fds[1]);
+        if (file_fd >= 0) close(file_fd);
+        if (receiver) stream_child_finish(ts, receiver, 0, what);
+        return 0;
+    }
+    int from = local_sender ? in_fds[0] : file_fd;
+    int to = local_receiver ? out_fds[1] : file_fd;
+    if (local_sender) {
+        fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
+        fcntl(from, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    }
+    if (local_receiver) {
+        fcntl(to, F_SETFL, fcntl(to, F_GETFL) | O_NONBLOCK);
+        fcntl(to, F_SETPIPE_SZ, STREAM_PIPE_SIZE);
+    }
+
+    transfer_stats_begin(&ts->stats, size);
+    transfer_stats_resume(&ts->stats, offset);
+    ts->codec = tool ? tool->name : NULL;
+    ts->wire_bytes = 0;
+    char source[PATH_MAX];
+    transfer_source_path(ts, source);
+    char *buf = NULL;
+    loff_t file_offset = offset;
+    loff_t *from_off = local_sender ? NULL : &file_offset;
+    loff_t *to_off = local_receiver ? NULL : &file_offset;
+    // The verifier has to see every byte of the file.
+    int zero_copy = tool || !ts->verifier;
+    long long sampled = monotonic_ms();
+    int64_t streamed = 0;
+    int ok = 1;
+    while (ok && !ts->cancel_requested) {
+        ssize_t n = -1;
+        if (zero_copy) {
+            n = stream_splice(from, from_off, to, to_off, STREAM_PIPE_SIZE);
+            if (n > 0 && !shaper_take(ts, n)) ok = 0;
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                zero_copy = 0;
+                continue;
+            }
+        } else {
+            if (!buf && !(buf = malloc(65536))) {
+                snprintf(ts->error, sizeof(ts->error), "out of memory");
+                ok = 0;
+                break;
+            }
+            n = stream_copy(from, from_off, to, to_off, buf, 65536, ts);
+            // Writes into a pipe were shaped on the way; into the file they
+            // are shaped here.
+            if (n > 0 && !local_receiver && !shaper_take(ts, n)) ok = 0;
+            if (n > 0 && !tool) verify_feed(ts->verifier, offset + streamed, buf, n);
+        }
+        if (n > 0) {
+            if (tool) ts->wire_bytes += n;
+            streamed += n;
+        } else if (n == 0) {
+            break;
+        } else if (errno != EINTR && errno != EAGAIN) {
+            ok = 0;
+        } else {
+            stream_wait(from, local_sender, to, local_receiver);
+        }
+        long long now = monotonic_ms();
+        if (now - sampled >= RATE_SAMPLE_MS) {
+            sampled = now;
+            int64_t done = tool ? transfer_sampled_done(ts, sender->pid, source) : offset + streamed;
+            if (done >= 0) transfer_progress(ts, done);
+        }
+    }
+    free(buf);
+    if (local_sender) close(in_fds[0]);
+    if (local_receiver) close(out_fds[1]);
+    if (file_fd >= 0 && close(file_fd) < 0) ok = 0;
+    if (sender) ok = stream_child_finish(ts, sender, ok && !ts->cancel_requested, what);
+    if (receiver) ok = stream_child_finish(ts, receiver, ok, what);
+    if (ok && ts->direction == 0) {
+        struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+        if (chmod(ts->dest, mode) < 0 || utimensat(AT_FDCWD, ts->dest, times, 0) < 0) {
+            // The data is all there; only the metadata did not carry over.
+        }
+    }
+    return ok;
+}
+
+// Remote half of a verified transfer: the same chunked BLAKE2b as
+// verify_feed builds here, over the remote file, printed with its size,
+// mode and mtime.
+static const char verify_digest_script[] =
+    "import sys, os, hashlib\n"
+    "from concurrent.futures import ThreadPoolExecutor\n"
+    "path, chunk = sys.argv[2], int(sys.argv[3])\n"
+    "st = os.stat(path)\n"
+    "size = st.st_size\n"
+    "def digest(start):\n"
+    "    h = hashlib.blake2b(digest_size=32)\n"
+    "    with open(path, 'rb') as f:\n"
+    "        f.seek(start)\n"
+    "        left = min(chunk, size - start)\n"
+    "        while left > 0:\n"
+    "            b = f.read(min(left, 1 << 20))\n"
+    "            if not b:\n"
+    "                break\n"
+    "            h.update(b)\n"
+    "            left -= len(b)\n"
+    "    return h.digest()\n"
+    "with ThreadPoolExecutor(min(8, os.cpu_count() or 1)) as pool:\n"
+    "    parts = list(pool.map(digest, range(0, size, chunk) or [0]))\n"
+    "print(hashlib.blake2b(b''.join(parts), digest_size=32).hexdigest(), size, '%o' % (st.st_mode & 0o7777),\n"
+    "      int(st.st_mtime))\n";
+
+static int transfer_verify = 0;
+
+static SupervisedChild *spawn_remote_digest(TransferStatus *ts) {
+    char args[32], cmd[REMOTE_PYTHON_CMD_MAX];
+    snprintf(args, sizeof(args), "%d", VERIFY_CHUNK_SIZE);
+    if (!remote_python_command(cmd, sizeof(cmd), ts->hostname, verify_digest_script,
+                               ts->direction == 1 ? ts->dest : ts->source, args, NULL))
+        return NULL;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    return supervisor_spawn(argv, 4096, 1);
+}
+
+typedef struct {
+    StreamVerifier *v;
+    int fd;
+    int64_t size;
+    int64_t next;
+    unsigned char *digests;
+    int failed;
+} VerifyCatchUp;
+
+static void *verify_catch_up_thread(void *arg) {
+    VerifyCatchUp *job = (VerifyCatchUp *)arg;
+    char *buf = malloc(1 << 20);
+    if (buf == NULL) {
+        job->failed = 1;
+        return NULL;
+    }
+    int64_t i;
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->v->count) {
+        VerifyChunk *c = &job->v->chunks[i];
+        int64_t start = i * VERIFY_CHUNK_SIZE;
+        int64_t len = job->size - start < VERIFY_CHUNK_SIZE ? job->size - start : VERIFY_CHUNK_SIZE;
+        if (len < 0) len = 0;
+        if (c->hashed > len) {
+            blake2b_init(&c->state, VERIFY_DIGEST_SIZE);
+            c->hashed = 0;
+        }
+        while (c->hashed < len) {
+            size_t want = len - c->hashed < (1 << 20) ? (size_t)(len - c->hashed) : (1 << 20);
+            ssize_t n = pread(job->fd, buf, want, start + c->hashed);
+            if (n <= 0) {
+                job->failed = 1;
+                break;
+            }
+            blake2b_update(&c->state, buf, n);
+            c->hashed += n;
+        }
+        blake2b_final(&c->state, job->digests + i * VERIFY_DIGEST_SIZE);
+    }
+    free(buf);
+    return NULL;
+}
+
+// Finishes the local digest of path: chunks that missed bytes read them
+// from the file, on several threads. Writes the hex digest and returns
+// the file's size, or -1 if it could not be read.
+static int64_t verify_local_digest(StreamVerifier *v, const char *path, char hex[VERIFY_DIGEST_SIZE * 2 + 1]) {
+    VerifyCatchUp job = {.v = v};
+    struct stat st;
+    job.fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (job.fd < 0 || fstat(job.fd, &st) < 0) {
+        if (job.fd >= 0) close(job.fd);
+        return -1;
+    }
+    job.size = st.st_size;
+    // Chunks past the end of a file that came up short are dropped.
+    int64_t count = job.size > 0 ? (job.size + VERIFY_CHUNK_SIZE - 1) / VERIFY_CHUNK_SIZE : 1;
+    job.digests = verify_add_chunks(v, job.size) ? malloc(count * VERIFY_DIGEST_SIZE) : NULL;
+    if (job.digests == NULL) {
+        close(job.fd);
+        return -1;
+    }
+    int64_t all = v->count;
+    v->count = count;
+    pthread_t threads[VERIFY_THREADS];
+    int started = 0;
+    for (int i = 0; i < VERIFY_THREADS && i < count; i++) {
+        if (pthread_create(&threads[i], NULL, verify_catch_up_thread, &job) == 0) started++;
+    }
+    if (started == 0) verify_catch_up_thread(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    v->count = all;
+    close(job.fd);
+
+    unsigned char root[VERIFY_DIGEST_SIZE];
+    Blake2b b;
+    blake2b_init(&b, VERIFY_DIGEST_SIZE);
+    blake2b_update(&b, job.digests, count * VERIFY_DIGEST_SIZE);
+    blake2b_final(&b, root);
+    free(job.digests);
+    for (int i = 0; i < VERIFY_DIGEST_SIZE; i++) snprintf(hex + i * 2, 3, "%02x", root[i]);
+    return job.failed ? -1 : job.size;
+}
+
+// Sets up verification for one attempt. The remote digest of a download's
+// source can run alongside the transfer; an upload's has to wait for the
+// file to land. Out of memory, ts->error is set and the attempt fails.
+static SupervisedChild *verify_begin(TransferStatus *ts) {
+    ts->verified = 0;
+    if (!transfer_verify) return NULL;
+    struct stat st;
+    int64_t size = ts->direction == 0 ? ts->stats.total : stat(ts->source, &st) == 0 ? st.st_size : 0;
+    ts->verifier = verify_new(size);
+    if (!ts->verifier) {
+        snprintf(ts->error, sizeof(ts->error), "out of memory");
+        return NULL;
+    }
+    return ts->direction == 0 ? spawn_remote_digest(ts) : NULL;
+}
+
+// Compares both digests once the transfer is through; a mismatch fails the
+// attempt, so it is retried like any other failure. A remote end that
+// cannot compute its digest leaves the transfer marked unverified.
+static int verify_end(TransferStatus *ts, SupervisedChild *remote, int ok) {
+    if (!ts->verifier) return ok;
+    if (ok && !ts->cancel_requested) {
+        ts->phase = "verifying";
+        ui_notify();
+        if (!remote) remote = spawn_remote_digest(ts);
+        char local[VERIFY_DIGEST_SIZE * 2 + 1];
+        int64_t size = verify_local_digest(ts->verifier, ts->direction == 1 ? ts->source : ts->dest, local);
+        int terminated = 0;
+        while (remote && !supervisor_wait(remote, RATE_SAMPLE_MS)) {
+            if (ts->cancel_requested && !terminated) {
+                supervisor_terminate(remote);
+                terminated = 1;
+            }
+        }
+        char digest[VERIFY_DIGEST_SIZE * 2 + 1];
+        long long remote_size;
+        if (!remote || supervisor_exit_code(remote) != 0 || !remote->output ||
+            sscanf(remote->output, "%64s %lld", digest, &remote_size) != 2) {
+            ts->verified = -1;
+        } else if (size < 0) {
+            snprintf(ts->error, sizeof(ts->error), "cannot hash %.100s", ts->direction == 1 ? ts->source : ts->dest);
+            ok = 0;
+        } else if (size != remote_size || strcmp(digest, local) != 0) {
+            snprintf(ts->error, sizeof(ts->error), "checksum mismatch: %.12s here, %.12s remote", local, digest);
+            ok = 0;
+        } else {
+            ts->verified = 1;
+        }
+        ts->phase = NULL;
+    }
+    if (remote) {
+        if (!supervisor_wait(remote, 0)) {
+            supervisor_terminate(remote);
+            supervisor_wait(remote, -1);
+        }
+        supervisor_release(remote);
+    }
+    verify_free(ts->verifier);
+    ts->verifier = NULL;
+    return ok && !ts->cancel_requested;
+}
+
+// Opt-in download cache, keyed by content. Before a download of at least
+// CACHE_MIN_BYTES the remote side computes the file's verify digest; a
+// blob already cached under that digest is cloned (or copied) to the
+// destination instead of crossing the link. Downloaded files are added
+// once their local digest matches. Blobs are evicted oldest-used first
+// when the cache outgrows SCP_TUI_DOWNLOAD_CACHE.
+#define CACHE_MIN_BYTES (1 << 20)
+
+static struct {
+    pthread_mutex_t lock;
+    int64_t limit;
+    char dir[PATH_MAX];
+    long hits;
+    long misses;
+    int64_t saved;
+} download_cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// mkdir -p, one component at a time.
+static void mkdir_parents(char *dir, mode_t mode) {
+    for (char *p = dir + 1; ; p++) {
+        if (*p == '/' || *p == '\0') {
+            char c = *p;
+            *p = '\0';
+            mkdir(dir, mode);
+            *p = c;
+            if (!c) break;
+        }
+    }
+}
+
+static void download_cache_init(int64_t limit) {
+    download_cache.limit = limit;
+    if (limit <= 0) return;
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    if (cache && *cache) {
+        snprintf(download_cache.dir, sizeof(download_cache.dir), "%s/scp-tui/blobs", cache);
+    } else {
+        snprintf(download_cache.dir, sizeof(download_cache.dir), "%s/.cache/scp-tui/blobs", home ? home : ".");
+    }
+    mkdir_parents(download_cache.dir, 0700);
+}
+
+// A reflink where the filesystem has them, else an in-kernel copy, else
+// read and write.
+static const char *cache_copy_file(int in, int out, int64_t size) {
+    if (ioctl(out, FICLONE, in) == 0) return "reflinked";
+    int64_t done = 0;
+    while (done < size) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, size - done, 0);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done == size) return "copied";
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = pread(in, buf, sizeof(buf), done)) > 0) {
+        if (!write_full(out, buf, n)) return NULL;
+        done += n;
+    }
+    return n == 0 && done == size ? "copied" : NULL;
+}
+
+// Copies from into a new file at to, through a temporary name so a
+// half-written file never shows up under the real one.
+static const char *cache_copy_path(const char *from, const char *to, int64_t size, mode_t mode) {
+    char tmp[PATH_MAX + 32];
+    int len = snprintf(tmp, sizeof(tmp), "%s.tmp.%d.%ld", to, (int)getpid(), (long)syscall(SYS_gettid));
+    if (len < 0 || (size_t)len >= sizeof(tmp)) return NULL;
+    int in = open(from, O_RDONLY | O_CLOEXEC);
+    if (in < 0) return NULL;
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+    if (out < 0) {
+        close(in);
+        return NULL;
+    }
+    const char *how = cache_copy_file(in, out, size);
+    close(in);
+    if (close(out) < 0) how = NULL;
+    if (how && rename(tmp, to) == 0) return how;
+    unlink(tmp);
+    return NULL;
+}
+
+typedef struct {
+    char name[VERIFY_DIGEST_SIZE * 2 + 1];
+    int64_t size;
+    time_t used;
+} CacheBlob;
+
+static int compare_cache_blobs(const void *a, const void *b) {
+    time_t ua = ((const CacheBlob *)a)->used, ub = ((const CacheBlob *)b)->used;
+    return ua < ub ? -1 : ua > ub;
+}
+
+// Caller holds download_cache.lock. A blob's mtime is when it was last
+// used, so the oldest go first.
+static void download_cache_evict(void) {
+    DIR *dir = opendir(download_cache.dir);
+    if (!dir) return;
+    CacheBlob *blobs = NULL;
+    size_t count = 0, cap = 0;
+    int64_t total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        struct stat st;
+        if (strlen(entry->d_name) != VERIFY_DIGEST_SIZE * 2) continue;
+        if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) continue;
+        CacheBlob *grown = grow_buffer(blobs, &cap, count + 1, sizeof(CacheBlob), 64);
+        if (!grown) break;
+        blobs = grown;
+        snprintf(blobs[count].name, sizeof(blobs[count].name), "%s", entry->d_name);
+        blobs[count].size = st.st_size;
+        blobs[count].used = st.st_mtime;
+        total += blobs[count++].size;
+    }
+    if (total > download_cache.limit) {
+        qsort(blobs, count, sizeof(CacheBlob), compare_cache_blobs);
+        for (size_t i = 0; i < count && total > download_cache.limit; i++) {
+            if (unlinkat(dirfd(dir), blobs[i].name, 0) == 0) total -= blobs[i].size;
+        }
+    }
+    closedir(dir);
+    free(blobs);
+}
+
+// Looks the download's source up by its remote digest, which is left in
+// key (empty when there is none). Returns 1 when the destination was
+// filled from the cache.
+static int download_cache_fetch(TransferStatus *ts, char key[VERIFY_DIGEST_SIZE * 2 + 1]) {
+    key[0] = '\0';
+    ts->cache_hit = NULL;
+    if (download_cache.limit <= 0 || ts->direction != 0 || ts->stats.total < CACHE_MIN_BYTES) return 0;
+    ts->phase = "hashing remote file";
+    ui_notify();
+    SupervisedChild *c = spawn_remote_digest(ts);
+    int terminated = 0;
+    while (c && !supervisor_wait(c, RATE_SAMPLE_MS)) {
+        if (ts->cancel_requested && !terminated) {
+            supervisor_terminate(c);
+            terminated = 1;
+        }
+    }
+    long long size = -1, mtime = 0;
+    unsigned mode = 0644;
+    if (c && supervisor_exit_code(c) == 0 && c->output &&
+        (sscanf(c->output, "%64s %lld %o %lld", key, &size, &mode, &mtime) != 4 ||
+         strlen(key) != VERIFY_DIGEST_SIZE * 2)) {
+        key[0] = '\0';
+    }
+    if (c) supervisor_release(c);
+    ts->phase = NULL;
+    if (!key[0] || ts->cancel_requested) return 0;
+
+    // A cache directory too deep for the blob's name counts as a miss.
+    char blob[PATH_MAX];
+    struct stat st;
+    const char *how = NULL;
+    if (join_path(blob, sizeof(blob), download_cache.dir, key) && stat(blob, &st) == 0 && st.st_size == size) {
+        how = cache_copy_path(blob, ts->dest, size, mode & 07777);
+        if (how) {
+            struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = mtime}};
+            utimensat(AT_FDCWD, ts->dest, times, 0);
+            // Touched on use, for eviction.
+            utimensat(AT_FDCWD, blob, NULL, 0);
+        }
+    }
+    pthread_mutex_lock(&download_cache.lock);
+    if (how) {
+        download_cache.hits++;
+        download_cache.saved += size;
+    } else {
+        download_cache.misses++;
+    }
+    pthread_mutex_unlock(&download_cache.lock);
+    if (!how) return 0;
+    ts->cache_hit = how;
+    transfer_stats_resume(&ts->stats, size);
+    return 1;
+}
+
+// Adds a finished download under its remote digest once the local copy
+// is confirmed to hash the same.
+static void download_cache_store(TransferStatus *ts, const char *key) {
+    if (!key[0] || ts->stats.total > download_cache.limit) return;
+    ts->phase = "caching";
+    ui_notify();
+    StreamVerifier *v = verify_new(ts->stats.total);
+    char local[VERIFY_DIGEST_SIZE * 2 + 1];
+    int64_t size = v ? verify_local_digest(v, ts->dest, local) : -1;
+    if (v) verify_free(v);
+    if (size >= 0 && strcmp(local, key) == 0) {
+        char blob[PATH_MAX];
+        if (join_path(blob, sizeof(blob), download_cache.dir, key) && cache_copy_path(ts->dest, blob, size, 0600)) {
+            pthread_mutex_lock(&download_cache.lock);
+            download_cache_evict();
+            pthread_mutex_unlock(&download_cache.lock);
+        }
+    }
+    ts->phase = NULL;
+}
+
+// Runs one transfer to completion on the calling thread, continuing from a
+// partial destination when one checks out.
+int run_file_transfer(TransferStatus *ts) {
+    int ok;
+    ts->progress = 0;
+    ts->error[0] = '\0';
+    if (ts->files > 0) {
+        if (!bundle_transfer(ts)) return 0;
+        ts->progress = 100;
+        return 1;
+    }
+    if (ts->options & TRANSFER_DELTA) {
+        int delta = delta_upload_file(ts);
+        if (delta >= 0) {
+            if (delta) ts->progress = 100;
+            return delta;
+        }
+        ts->saved = 0;
+    }
+    char cache_key[VERIFY_DIGEST_SIZE * 2 + 1];
+    if (download_cache_fetch(ts, cache_key)) {
+        ts->verified = 0;
+        ts->progress = 100;
+        return 1;
+    }
+    if (ts->cancel_requested) return 0;
+    int64_t offset = transfer_resume_offset(ts);
+    if (ts->cancel_requested) return 0;
+    ts->codec = NULL;
+    ts->streams = 0;
+    SupervisedChild *remote_digest = verify_begin(ts);
+    if (ts->error[0]) return 0;
+    ok = compressed_transfer(ts, offset);
+    if (ok >= 0) {
+        if (!ok && !ts->error[0] && !ts->cancel_requested) strcpy(ts->error, "compressed transfer failed");
+    } else if (!sftp_session.alive && shaper_active()) {
+        // scp would move the bytes out of the shaper's sight.
+        int64_t size = -1;
+        unsigned mode = 0644;
+        long long mtime = 0;
+        ok = compress_sample(ts, offset, NULL, 0, &size, &mode, &mtime) >= 0 &&
+             piped_transfer(ts, offset, NULL, 0, size, mode, mtime);
+        if (!ok && !ts->error[0] && !ts->cancel_requested) strcpy(ts->error, "transfer failed");
+    } else if (sftp_session.alive) {
+        ok = sftp_striped_transfer(ts, offset);
+        if (ok < 0) {
+            ok = ts->direction == 1 ? sftp_upload_file(&sftp_session, ts, offset)
+                                    : sftp_download_file(&sftp_session, ts, offset);
+        }
+        if (!ok && !ts->error[0]) {
+            strcpy(ts->error, sftp_session.alive ? "SFTP transfer failed" : "SFTP session lost");
+        }
+    } else {
+        ok = run_scp_transfer(ts, offset);
+    }
+    ok = verify_end(ts, remote_digest, ok);
+    if (ok && !ts->cancel_requested) {
+        download_cache_store(ts, cache_key);
+        if (ts->stats.total > 0) transfer_stats_update(&ts->stats, ts->stats.total);
+        ts->progress = 100;
+        return 1;
+    }
+    return 0;
+}
+
+// Failed attempts are retried after a delay that doubles each time, with
+// some jitter so parallel workers do not reconnect in lockstep. Each retry
+// resumes from what the previous attempt left behind.
+static int run_transfer_with_retries(TransferStatus *ts) {
+    unsigned int seed = (unsigned int)monotonic_ms() ^ (unsigned int)(uintptr_t)ts;
+    long delay = TRANSFER_RETRY_BASE_MS;
+    for (ts->attempts = 0; ; ts->attempts++) {
+        if (run_file_transfer(ts)) return 1;
+        if (ts->cancel_requested || ts->attempts >= transfer_retries) return 0;
+        long jitter = rand_r(&seed) % (delay / 2 + 1) - delay / 4;
+        ts->retry_at_ms = monotonic_ms() + delay + jitter;
+        ui_notify();
+        long long now;
+        while (!ts->cancel_requested && (now = monotonic_ms()) < ts->retry_at_ms) {
+            long long left = ts->retry_at_ms - now;
+            napms(left < RATE_SAMPLE_MS ? (int)left : RATE_SAMPLE_MS);
+        }
+        ts->retry_at_ms = 0;
+        if (ts->cancel_requested) return 0;
+        delay = delay * 2 > TRANSFER_RETRY_MAX_MS ? TRANSFER_RETRY_MAX_MS : delay * 2;
+    }
+}
+
+// Caller holds transfer_queue.lock. The worker running the job notices
+// within one progress tick and stops its transfer.
+void cancel_transfer(TransferStatus *ts) {
+    ts->cancel_requested = 1;
+}
+
+// Append-only record of the queue, one file per host, so a batch cut short
+// by a crash, a dead terminal or a quit can be picked up on the next
+// launch. Lines are
+//   Q id parent direction options size files <TAB>source<TAB>dest<TAB>names
+//   S id        (a worker started it, so a partial file may exist)
+//   D id state  (finished: done, failed or cancelled)
+// with parent the id of the walk that queued the job. Workers only append
+// to a buffer; the UI loop writes it out at most every JOURNAL_FLUSH_MS,
+// so a burst of small files costs one write and one fdatasync.
+#define JOURNAL_FLUSH_MS 200
+
+typedef struct {
+    long id;
+    long parent;
+    int direction;
+    int options;
+    int64_t size;
+    int files;
+    char *source;
+    char *dest;
+    char *names;
+    size_t names_len;
+    int started;
+    int finished;
+} JournalEntry;
+
+static struct {
+    pthread_mutex_t lock;
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+    long long flushed_ms;
+    long next_id;
+    long outstanding;
+    int dirty;
+    // Left from the previous session until the user answers the offer.
+    JournalEntry *entries;
+    size_t count;
+    // "source\tdest" of files finished under walks that are being redone,
+    // sorted, so the new walk can skip them.
+    char **done;
+    size_t done_count;
+    size_t done_cap;
+} journal = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .next_id = 1};
+
+// Tabs, newlines, backslashes and NULs are written as escapes so a field
+// never spans a separator. This and journal_printf return 0, having
+// appended nothing, when the buffer cannot grow.
+static int journal_put_field(const char *data, size_t len) {
+    char *buf = grow_buffer(journal.buf, &journal.cap, journal.len + 2 * len + 1, 1, 4096);
+    if (!buf) return 0;
+    journal.buf = buf;
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        const char *escape = c == '\\' ? "\\\\" : c == '\t' ? "\\t" : c == '\n' ? "\\n" : c == '\0' ? "\\0" : NULL;
+        if (escape) {
+            memcpy(journal.buf + journal.len, escape, 2);
+            journal.len += 2;
+        } else {
+            journal.buf[journal.len++] = c;
+        }
+    }
+    return 1;
+}
+
+// Caller holds journal.lock.
+static int journal_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    char *buf = grow_buffer(journal.buf, &journal.cap, journal.len + n + 1, 1, 4096);
+    if (!buf) return 0;
+    journal.buf = buf;
+    va_start(ap, fmt);
+    vsnprintf(journal.buf + journal.len, n + 1, fmt, ap);
+    va_end(ap);
+    journal.len += n;
+    return 1;
+}
+
+// Caller holds journal.lock. Appends a whole Q record or nothing.
+static int journal_put_queued(long id, long parent, int direction, int options, long long size, int files,
+                              const char *source, const char *dest, const char *names, size_t names_len) {
+    size_t start = journal.len;
+    if (journal_printf("Q %ld %ld %d %d %lld %d\t", id, parent, direction, options, size, files) &&
+        journal_put_field(source, strlen(source)) && journal_printf("\t") && journal_put_field(dest, strlen(dest)) &&
+        journal_printf("\t") && journal_put_field(names, names_len) && journal_printf("\n")) {
+        return 1;
+    }
+    journal.len = start;
+    return 0;
+}
+
+static size_t bundle_names_len(const char *names, int files) {
+    const char *p = names;
+    for (int i = 0; i < files; i++) p += strlen(p) + 1;
+    return p - names;
+}
+
+// Records a job as it is queued, unless it already has an id (a job
+// carried over from the last session is still on file).
+static void journal_queued(TransferJob *job) {
+    TransferStatus *ts = &job->status;
+    pthread_mutex_lock(&journal.lock);
+    long parent = ts->walk && !(ts->options & TRANSFER_WALK) ? ts->walk->journal_id : 0;
+    // A job that does not make it into the buffer is simply not on file.
+    if (journal.fd >= 0 && job->journal_id == 0 &&
+        journal_put_queued(journal.next_id, parent, ts->direction, ts->options, (long long)ts->stats.total,
+                           ts->files, ts->source, ts->dest, ts->files > 0 ? ts->names : "",
+                           ts->files > 0 ? bundle_names_len(ts->names, ts->files) : 0)) {
+        job->journal_id = journal.next_id++;
+        if (ts->options & TRANSFER_WALK) ts->walk->journal_id = job->journal_id;
+        journal.outstanding++;
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static void journal_event(const TransferJob *job, char type, int state) {
+    pthread_mutex_lock(&journal.lock);
+    if (journal.fd >= 0 && job->journal_id > 0) {
+        if (type == 'D') {
+            journal_printf("D %ld %d\n", job->journal_id, state);
+            journal.outstanding--;
+        } else {
+            journal_printf("%c %ld\n", type, job->journal_id);
+        }
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Called from the UI loop. Writes out what the workers appended, and
+// empties the file once nothing on it is outstanding any more. Returns
+// whether records were held back, so the loop knows to come round again.
+static int journal_flush(int force) {
+    pthread_mutex_lock(&journal.lock);
+    long long now = monotonic_ms();
+    if (journal.fd < 0 || (!force && now - journal.flushed_ms < JOURNAL_FLUSH_MS)) {
+        int held = journal.fd >= 0 && journal.len > 0;
+        pthread_mutex_unlock(&journal.lock);
+        return held;
+    }
+    journal.flushed_ms = now;
+    int fd = journal.fd;
+    char *buf = journal.buf;
+    size_t len = journal.len;
+    int empty = journal.outstanding == 0 && journal.count == 0;
+    journal.buf = NULL;
+    journal.len = journal.cap = 0;
+    if (len > 0) journal.dirty = 1;
+    int truncate = empty && journal.dirty;
+    if (truncate) journal.dirty = 0;
+    pthread_mutex_unlock(&journal.lock);
+
+    // Only this thread writes, so records stay in order without the lock.
+    if (truncate) {
+        if (ftruncate(fd, 0) < 0) {
+            // Stale records are only an offer the user can decline.
+        }
+    } else if (len > 0) {
+        write_full(fd, buf, len);
+        fdatasync(fd);
+    }
+    free(buf);
+    return 0;
+}
+
+
+// Returns 0 when the path does not fit: cut short, it would name some
+// other file.
+static int journal_path(char *path, size_t size, const char *host) {
+    const char *state = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    char dir[PATH_MAX];
+    int n;
+    if (state && *state) {
+        n = snprintf(dir, sizeof(dir), "%s/scp-tui", state);
+    } else {
+        n = snprintf(dir, sizeof(dir), "%s/.local/state/scp-tui", home ? home : ".");
+    }
+    if (n < 0 || (size_t)n >= sizeof(dir)) return 0;
+    n = snprintf(path, size, "%s/%s.journal", dir, host);
+    if (n < 0 || (size_t)n >= size) return 0;
+    mkdir_parents(dir, 0700);
+    for (char *p = path + strlen(dir) + 1; *p; p++) {
+        if (*p == '/') *p = '_';
+    }
+    return 1;
+}
+
+// Undoes journal_put_field in place; returns the decoded length.
+static size_t journal_unescape(char *field) {
+    char *out = field;
+    for (char *p = field; *p; p++) {
+        if (*p != '\\' || !p[1]) {
+            *out++ = *p;
+            continue;
+        }
+        p++;
+        *out++ = *p == 't' ? '\t' : *p == 'n' ? '\n' : *p == '0' ? '\0' : *p;
+    }
+    *out = '\0';
+    return out - field;
+}
+
+static JournalEntry *journal_find(JournalEntry *entries, size_t count, long id) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (entries[mid].id == id) return &entries[mid];
+        if (entries[mid].id < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+static int journal_compare_done(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int journal_walk_pending(JournalEntry *entries, size_t count, long parent) {
+    JournalEntry *walk = parent ? journal_find(entries, count, parent) : NULL;
+    return walk && !walk->finished;
+}
+
+// A pair that cannot be remembered only means the file is moved again.
+static void journal_add_done(const char *source, const char *dest) {
+    char **done = grow_buffer(journal.done, &journal.done_cap, journal.done_count + 1, sizeof(char *), 64);
+    if (!done) return;
+    journal.done = done;
+    size_t len = strlen(source) + strlen(dest) + 2;
+    char *pair = malloc(len);
+    if (pair == NULL) return;
+    snprintf(pair, len, "%s\t%s", source, dest);
+    journal.done[journal.done_count++] = pair;
+}
+
+// Whether a walk being redone already moved this file last time.
+static int journal_done_contains(const char *source, const char *dest) {
+    if (journal.done_count == 0) return 0;
+    size_t len = strlen(source) + strlen(dest) + 2;
+    char *pair = malloc(len);
+    if (pair == NULL) return 0;
+    snprintf(pair, len, "%s\t%s", source, dest);
+    int found = bsearch(&pair, journal.done, journal.done_count, sizeof(char *), journal_compare_done) != NULL;
+    free(pair);
+    return found;
+}
+
+static int journal_write_entry(FILE *fp, const JournalEntry *e) {
+    pthread_mutex_lock(&journal.lock);
+    int ok = journal_put_queued(e->id, e->parent, e->direction, e->options, (long long)e->size, e->files,
+                                e->source, e->dest, e->names ? e->names : "", e->names_len) &&
+             (!e->finished || journal_printf("D %ld %d\n", e->id, JOB_DONE));
+    if (ok) fwrite(journal.buf, 1, journal.len, fp);
+    journal.len = 0;
+    pthread_mutex_unlock(&journal.lock);
+    return ok;
+}
+
+static void journal_entries_free(JournalEntry *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(entries[i].source);
+        free(entries[i].dest);
+        free(entries[i].names);
+    }
+    free(entries);
+}
+
+// Opens the host's journal and reads what the last session left behind.
+// The file is rewritten to just that: jobs still outstanding, plus files
+// already done under walks that will run again. Those are what the offer
+// in journal_offer_resume is about. Out of memory, the file is left alone
+// and this session is not journaled.
+static void journal_open(const char *host) {
+    char path[PATH_MAX];
+    if (!journal_path(path, sizeof(path), host)) return;
+    char *data = NULL;
+    size_t data_len = 0, data_cap = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    int failed = 0;
+    if (fd >= 0) {
+        ssize_t n;
+        do {
+            char *grown = grow_buffer(data, &data_cap, data_len + 65536 + 1, 1, 65536);
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            data = grown;
+            n = read(fd, data + data_len, 65536);
+            if (n > 0) data_len += n;
+        } while (n > 0);
+        close(fd);
+        if (data) data[data_len] = '\0';
+    }
+
+    JournalEntry *entries = NULL;
+    size_t count = 0, cap = 0;
+    char *save = NULL;
+    for (char *line = data ? strtok_r(data, "\n", &save) : NULL; line; line = strtok_r(NULL, "\n", &save)) {
+        long id, parent;
+        int direction, options, files, state;
+        long long size;
+        char *fields[3];
+        if (line[0] == 'Q' && sscanf(line, "Q %ld %ld %d %d %lld %d", &id, &parent, &direction, &options, &size,
+                                     &files) == 6 &&
+            (fields[0] = strchr(line, '\t')) && (fields[1] = strchr(fields[0] + 1, '\t')) &&
+            (fields[2] = strchr(fields[1] + 1, '\t')) && (count == 0 || id > entries[count - 1].id)) {
+            for (int i = 0; i < 3; i++) *fields[i]++ = '\0';
+            JournalEntry *grown = grow_buffer(entries, &cap, count + 1, sizeof(JournalEntry), 64);
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            entries = grown;
+            JournalEntry *e = &entries[count++];
+            memset(e, 0, sizeof(*e));
+            e->id = id;
+            e->parent = parent;
+            e->direction = direction;
+            e->options = options;
+            e->size = size;
+            e->files = files;
+            journal_unescape(fields[0]);
+            journal_unescape(fields[1]);
+            e->source = strdup(fields[0]);
+            e->dest = strdup(fields[1]);
+            if (files > 0) {
+                e->names_len = journal_unescape(fields[2]);
+                e->names = malloc(e->names_len + 1);
+                if (e->names) memcpy(e->names, fields[2], e->names_len + 1);
+            }
+            if (!e->source || !e->dest || (files > 0 && !e->names)) {
+                failed = 1;
+                break;
+            }
+        } else if (sscanf(line, "S %ld", &id) == 1) {
+            JournalEntry *e = journal_find(entries, count, id);
+            if (e) e->started = 1;
+        } else if (sscanf(line, "D %ld %d", &id, &state) == 2) {
+            JournalEntry *e = journal_find(entries, count, id);
+            if (e) e->finished = state == JOB_DONE ? 1 : 2;
+        }
+        // Anything else, such as a line cut short by a crash, is skipped.
+    }
+    free(data);
+    if (failed) {
+        journal_entries_free(entries, count);
+        return;
+    }
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.new", path);
+    int tmp_fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    FILE *fp = tmp_fd >= 0 ? fdopen(tmp_fd, "w") : NULL;
+    if (!fp && tmp_fd >= 0) close(tmp_fd);
+    char *keep = calloc(count ? count : 1, 1);
+    if (!keep) {
+        if (fp) fclose(fp);
+        unlink(tmp);
+        journal_entries_free(entries, count);
+        return;
+    }
+    int written = 1;
+    long next_id = count ? entries[count - 1].id + 1 : 1;
+    for (size_t i = 0; i < count; i++) {
+        JournalEntry *e = &entries[i];
+        int redone = journal_walk_pending(entries, count, e->parent);
+        keep[i] = !e->finished && !redone;
+        if (keep[i] || (redone && e->finished == 1)) {
+            if (fp && !journal_write_entry(fp, e)) written = 0;
+        }
+        if (!redone || e->finished != 1) continue;
+        // Done under a walk that will run again: remembered, not offered.
+        if (e->files == 0) {
+            journal_add_done(e->source, e->dest);
+            continue;
+        }
+        const char *name = e->names;
+        for (int k = 0; k < e->files; k++, name += strlen(name) + 1) {
+            char source[PATH_MAX], dest[PATH_MAX];
+            join_path(source, sizeof(source), e->source, name);
+            join_path(dest, sizeof(dest), e->dest, name);
+            journal_add_done(source, dest);
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (keep[i]) {
+            entries[kept++] = entries[i];
+            continue;
+        }
+        free(entries[i].source);
+        free(entries[i].dest);
+        free(entries[i].names);
+    }
+    free(keep);
+    if (journal.done_count > 1) {
+        qsort(journal.done, journal.done_count, sizeof(char *), journal_compare_done);
+    }
+    int ok = fp && written && fflush(fp) == 0 && fdatasync(fileno(fp)) == 0;
+    if (fp) fclose(fp);
+    if (ok) rename(tmp, path);
+    else unlink(tmp);
+
+    pthread_mutex_lock(&journal.lock);
+    journal.fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    journal.entries = entries;
+    journal.count = kept;
+    journal.outstanding = kept;
+    journal.next_id = next_id;
+    journal.dirty = kept > 0 || journal.done_count > 0;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+// Stops recording before the workers are torn down at exit, so the
+// transfers cut short there stay outstanding for the next launch.
+static void journal_close(void) {
+    journal_flush(1);
+    pthread_mutex_lock(&journal.lock);
+    if (journal.fd >= 0) close(journal.fd);
+    journal.fd = -1;
+    for (size_t i = 0; i < journal.done_count; i++) free(journal.done[i]);
+    journal.done_count = 0;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+static void transfer_job_finish(TransferJob *job, TransferJobState state) {
+    journal_event(job, 'D', state);
+    transfer_queue.counts[job->state]--;
+    transfer_queue.counts[state]++;
+    job->state = state;
+    job->status.is_active = 0;
+    transfer_queue.pending[job->status.direction]--;
+    transfer_queue.finished[job->status.direction]++;
+    ui_notify();
+}
+
+static int run_tree_walk(TransferStatus *ts);
+static void tree_walk_settle(TransferStatus *ts, int ok);
+
+void *transfer_worker_thread(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&transfer_queue.lock);
+    while (1) {
+        while (transfer_queue.dispatch && transfer_queue.dispatch->state != JOB_QUEUED) {
+            transfer_queue.dispatch = transfer_queue.dispatch->next;
+        }
+        if (transfer_queue.stopping) break;
+        if (!transfer_queue.dispatch) {
+            pthread_cond_wait(&transfer_queue.cond, &transfer_queue.lock);
+            continue;
+        }
+        TransferJob *job = transfer_queue.dispatch;
+        transfer_queue.dispatch = job->next;
+        transfer_queue.counts[JOB_QUEUED]--;
+        transfer_queue.counts[JOB_RUNNING]++;
+        job->state = JOB_RUNNING;
+        job->status.is_active = 1;
+        pthread_mutex_unlock(&transfer_queue.lock);
+        journal_event(job, 'S', 0);
+        ui_notify();
+
+        int walking = job->status.options & TRANSFER_WALK;
+        int ok = walking ? run_tree_walk(&job->status) : run_transfer_with_retries(&job->status);
+        if (job->status.walk && !walking) tree_walk_settle(&job->status, ok);
+        if (ok && job->status.direction == 1) {
+            char dir[PATH_MAX];
+            strcpy(dir, job->status.dest);
+            listing_cache_invalidate(job->status.hostname, job->status.files ? dir : dirname(dir));
+        }
+
+        pthread_mutex_lock(&transfer_queue.lock);
+        transfer_job_finish(job, ok ? JOB_DONE : job->status.cancel_requested ? JOB_CANCELLED : JOB_FAILED);
+    }
+    pthread_mutex_unlock(&transfer_queue.lock);
+    return NULL;
+}
+
+void start_transfer_workers(void) {
+    int n = transfer_queue.configured_workers;
+    if (n < 1) n = 1;
+    if (n > TRANSFER_MAX_WORKERS) n = TRANSFER_MAX_WORKERS;
+    transfer_queue.stopping = 0;
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&transfer_queue.workers[i], NULL, transfer_worker_thread, NULL) != 0) break;
+        transfer_queue.worker_count++;
+    }
+}
+
+static TransferJob *transfer_job_new(int direction, const char *source, const char *dest, const char *host,
+                                     int64_t size, TreeWalk *walk) {
+    TransferJob *job = calloc(1, sizeof(TransferJob));
+    if (!job) return NULL;
+    job->status.source = strdup(source);
+    job->status.dest = strdup(dest);
+    if (!job->status.source || !job->status.dest) {
+        free(job->status.source);
+        free(job->status.dest);
+        free(job);
+        return NULL;
+    }
+    int n = snprintf(job->status.hostname, sizeof(job->status.hostname), "%s", host);
+    if (n < 0 || (size_t)n >= sizeof(job->status.hostname)) {
+        free(job->status.source);
+        free(job->status.dest);
+        free(job);
+        return NULL;
+    }
+    job->status.direction = direction;
+    job->status.stats.total = size;
+    job->status.walk = walk;
+    job->state = JOB_QUEUED;
+    return job;
+}
+
+static void transfer_queue_push(TransferJob *job) {
+    int direction = job->status.direction;
+    journal_queued(job);
+    pthread_mutex_lock(&transfer_queue.lock);
+    if (job->status.walk) job->status.walk->refs++;
+    if (transfer_queue.tail) transfer_queue.tail->next = job;
+    else transfer_queue.head = job;
+    transfer_queue.tail = job;
+    if (!transfer_queue.dispatch) transfer_queue.dispatch = job;
+    transfer_queue.counts[JOB_QUEUED]++;
+    transfer_queue.pending[direction]++;
+    pthread_cond_signal(&transfer_queue.cond);
+    pthread_mutex_unlock(&transfer_queue.lock);
+}
+
+int transfer_queue_add(int direction, const char *source, const char *dest, const char *host, int64_t size,
+                       int options) {
+    TransferJob *job = transfer_job_new(direction, source, dest, host, size, NULL);
+    if (!job) return 0;
+    job->status.options = options;
+    transfer_queue_push(job);
+    return 1;
+}
+
+// Queues files of one directory as a single tar-streamed job. names holds
+// files NUL-terminated names back to back; the job takes ownership.
+int transfer_queue_add_bundle(int direction, const char *source_dir, const char *dest_dir, const char *host,
+                              char *names, int files, int64_t size, TreeWalk *walk) {
+    TransferJob *job = transfer_job_new(direction, source_dir, dest_dir, host, size, walk);
+    if (!job) return 0;
+    job->status.names = names;
+    job->status.files = files;
+    job->status.bundle_bytes = size;
+    transfer_queue_push(job);
+    return 1;
+}
+
+int transfer_queue_busy(void) {
+    pthread_mutex_lock(&transfer_queue.lock);
+    int busy = transfer_queue.counts[JOB_QUEUED] + transfer_queue.counts[JOB_RUNNING];
+    pthread_mutex_unlock(&transfer_queue.lock);
+    return busy;
+}
+
+void transfer_queue_cancel_all(void) {
+    pthread_mutex_lock(&transfer_queue.lock);
+    for (TransferJob *job = transfer_queue.head; job; job = job->next) {
+        if (job->state == JOB_QUEUED) {
+            transfer_job_finish(job, JOB_CANCELLED);
+        } else if (job->state == JOB_RUNNING) {
+            cancel_transfer(&job->status);
+        }
+    }
+    pthread_mutex_unlock(&transfer_queue.lock);
+}
+
+// Drops finished jobs from the panel; running and queued ones stay.
+void transfer_queue_clear_finished(void) {
+    pthread_mutex_lock(&transfer_queue.lock);
+    TransferJob **link = &transfer_queue.head;
+    transfer_queue.tail = NULL;
+    while (*link) {
+        TransferJob *job = *link;
+        if (job->state == JOB_QUEUED || job->state == JOB_RUNNING) {
+            transfer_queue.tail = job;
+            link = &job->next;
+            continue;
+        }
+        if (transfer_queue.dispatch == job) transfer_queue.dispatch = job->next;
+        transfer_queue.counts[job->state]--;
+        *link = job->next;
+        if (job->status.walk && --job->status.walk->refs == 0) free(job->status.walk);
+        free(job->status.names);
+        free(job->status.source);
+        free(job->status.dest);
+        free(job);
+    }
+    pthread_mutex_unlock(&transfer_queue.lock);
+}
+
+void stop_transfer_workers(void) {
+    transfer_queue_cancel_all();
+    pthread_mutex_lock(&transfer_queue.lock);
+    transfer_queue.stopping = 1;
+    pthread_cond_broadcast(&transfer_queue.cond);
+    pthread_mutex_unlock(&transfer_queue.lock);
+    for (int i = 0; i < transfer_queue.worker_count; i++) {
+        pthread_join(transfer_queue.workers[i], NULL);
+    }
+    transfer_queue.worker_count = 0;
+    transfer_queue_clear_finished();
+}
+
+int file_exists(const char *path) {
+    return access(path, F_OK) != -1;
+}
+
+static int compare_name_indexes(const void *a, const void *b, void *list) {
+    return strcmp(file_name(list, *(const int *)a), file_name(list, *(const int *)b));
+}
+
+static void remote_files_exist_sftp(SftpSession *s, const char *dir, const FileList *src,
+                                    const int *pending, int n, unsigned char *exists, int *answered) {
+    SftpRequest *reqs[SFTP_MAX_OUTSTANDING];
+    for (int base = 0; base < n && s->alive; base += SFTP_MAX_OUTSTANDING) {
+        int batch = n - base < SFTP_MAX_OUTSTANDING ? n - base : SFTP_MAX_OUTSTANDING;
+        for (int j = 0; j < batch; j++) {
+            char path[PATH_MAX];
+            join_path(path, sizeof(path), dir, file_name(src, pending[base + j]));
+            SftpBuf body = {0};
+            sftp_put_cstring(&body, path);
+            reqs[j] = sftp_send(s, SSH_FXP_LSTAT, &body, NULL, 0);
+            sftp_buf_free(&body);
+        }
+        for (int j = 0; j < batch; j++) {
+            sftp_wait(s, reqs[j]);
+            if (reqs[j]->type == SSH_FXP_ATTRS) {
+                exists[pending[base + j]] = 1;
+                answered[base + j] = 1;
+            } else if (reqs[j]->type == SSH_FXP_STATUS && sftp_status_code(reqs[j]) == SSH_FX_NO_SUCH_FILE) {
+                answered[base + j] = 1;
+            }
+            sftp_request_free(reqs[j]);
+        }
+    }
+}
+
+static void remote_files_exist_shell(const char *host, const char *dir, const FileList *src,
+                                     const int *pending, int n, unsigned char *exists, int *answered) {
+    const char *tmp = getenv("TMPDIR");
+    char list_path[PATH_MAX];
+    snprintf(list_path, sizeof(list_path), "%s/scp-tui-exists-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    int fd = mkstemp(list_path);
+    if (fd < 0) return;
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        unlink(list_path);
+        return;
+    }
+    // One line per path, so paths that hold a newline or do not fit are
+    // left out (and unanswered) rather than shifting every later answer.
+    int *sent = malloc(sizeof(int) * (n + 1));
+    int sent_count = 0;
+    for (int i = 0; sent && i < n; i++) {
+        char path[PATH_MAX];
+        if (!join_path(path, sizeof(path), dir, file_name(src, pending[i])) || strchr(path, '\n')) continue;
+        fprintf(out, "%s\n", path);
+        sent[sent_count++] = i;
+    }
+    int write_failed = ferror(out);
+    if (fclose(out) != 0 || write_failed || !sent) {
+        free(sent);
+        unlink(list_path);
+        return;
+    }
+
+    char quoted_list[QUOTED_PATH_MAX], cmd[QUOTED_PATH_MAX * 2 + 512];
+    int fits = shell_quote(quoted_list, sizeof(quoted_list), list_path) &&
+               ssh_remote_command(cmd, sizeof(cmd), host,
+                                  "while IFS= read -r f; do if [ -e \"$f\" ] || [ -L \"$f\" ]; then echo 1; "
+                                  "else echo 0; fi; done");
+    if (fits) {
+        size_t used = strlen(cmd);
+        int tail = snprintf(cmd + used, sizeof(cmd) - used, " < %s", quoted_list);
+        fits = tail >= 0 && (size_t)tail < sizeof(cmd) - used;
+    }
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    char *output;
+    FILE *fp = fits ? capture_command(cmd, &output) : NULL;
+    if (fp) {
+        char line[8];
+        for (int i = 0; i < sent_count && fgets(line, sizeof(line), fp); i++) {
+            exists[pending[sent[i]]] = line[0] == '1';
+            answered[sent[i]] = 1;
+        }
+        fclose(fp);
+        free(output);
+        record_remote_op(&started);
+    }
+    free(sent);
+    unlink(list_path);
+}
+
+// Fills exists[] for every selected entry of src, as seen in the remote
+// directory dir. The pane's listing answers while it is fresh; whatever it
+// cannot answer (hidden names, names with newlines) costs one pipelined
+// LSTAT batch, or a single ssh command when SFTP is down. Unanswered
+// entries are reported as existing so the user still gets asked.
+void remote_files_exist(const char *host, const FileList *listing, const char *dir,
+                        const FileList *src, unsigned char *exists) {
+    int *pending = malloc(sizeof(int) * (src->count + 1));
+    int *answered = calloc(src->count + 1, sizeof(int));
+    if (!pending || !answered) {
+        free(pending);
+        free(answered);
+        memset(exists, 1, src->count);
+        return;
+    }
+    int n = 0;
+    for (int i = 0; i < src->count; i++) {
+        exists[i] = 0;
+        if (src->files[i].selected) pending[n++] = i;
+    }
+
+    if (n > 0 && strcmp(listing->cwd, dir) == 0 && !remote_lister_loading() &&
+        listing_cache_contains(host, dir)) {
+        qsort_r(pending, n, sizeof(int), compare_name_indexes, (void *)src);
+        for (int i = 0; i < listing->count; i++) {
+            const char *name = file_name(listing, i);
+            int lo = 0, hi = n;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                int cmp = strcmp(file_name(src, pending[mid]), name);
+                if (cmp == 0) {
+                    exists[pending[mid]] = 1;
+                    break;
+                }
+                if (cmp < 0) lo = mid + 1;
+                else hi = mid;
+            }
+        }
+        int kept = 0;
+        for (int i = 0; i < n; i++) {
+            const char *name = file_name(src, pending[i]);
+            if (exists[pending[i]]) continue;
+            if ((!show_hidden_files && name[0] == '.') || strchr(name, '\n')) pending[kept++] = pending[i];
+        }
+        n = kept;
+    }
+
+    if (n > 0 && sftp_session.alive) {
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        remote_files_exist_sftp(&sftp_session, dir, src, pending, n, exists, answered);
+        record_remote_op(&started);
+        int kept = 0;
+        for (int i = 0; i < n; i++) {
+            if (!answered[i]) pending[kept++] = pending[i];
+        }
+        n = kept;
+        memset(answered, 0, sizeof(int) * n);
+    }
+
+    if (n > 0) {
+        int kept = 0;
+        for (int i = 0; i < n; i++) {
+            if (!strchr(file_name(src, pending[i]), '\n')) pending[kept++] = pending[i];
+            else exists[pending[i]] = 1;
+        }
+        remote_files_exist_shell(host, dir, src, pending, kept, exists, answered);
+        for (int i = 0; i < kept; i++) {
+            if (!answered[i]) exists[pending[i]] = 1;
+        }
+    }
+    free(pending);
+    free(answered);
+}
+
+// One prompt for the whole selection: overwrite all, none, or decide per
+// file. Skipped entries are deselected so the transfer loop passes them by.
+void confirm_overwrites(WINDOW *status, FileList *src, const unsigned char *exists) {
+    int total = 0, clashes = 0;
+    for (int i = 0; i < src->count; i++) {
+        if (!src->files[i].selected) continue;
+        total++;
+        if (exists[i]) clashes++;
+    }
+    if (clashes == 0) return;
+
+    if (clashes == 1) {
+        mvwprintw(status, 0, 1, "1 of %d files already exists, overwrite? (a: all / n: none)", total);
+    } else {
+        mvwprintw(status, 0, 1, "%d of %d files already exist, overwrite? (a: all / n: none / p: per file)", clashes, total);
+    }
+    wclrtoeol(status);
+    wrefresh(status);
+    int choice = wgetch(status);
+    if (choice == 'a' || choice == 'A' || choice == 'y' || choice == 'Y') return;
+    int per_file = clashes > 1 && (choice == 'p' || choice == 'P');
+
+    for (int i = 0; i < src->count; i++) {
+        if (!src->files[i].selected || !exists[i]) continue;
+        if (per_file) {
+            mvwprintw(status, 0, 1, "File %s already exists, overwrite? (y/n)", file_name(src, i));
+            wclrtoeol(status);
+            wrefresh(status);
+            int confirm = wgetch(status);
+            if (confirm == 'y' || confirm == 'Y') continue;
+        }
+        src->files[i].selected = 0;
+    }
+}
+
+// Reads "total/per transfer" caps from the status line, e.g. "20M/5M".
+// A part left out keeps its current value and 0 lifts it; the new caps
+// apply to running transfers straight away.
+void prompt_bandwidth_limits(WINDOW *status) {
+    char input[32] = "";
+    mvwprintw(status, 0, 1, "Bandwidth limit, total/per transfer (e.g. 20M/5M, 0 = none): ");
+    wclrtoeol(status);
+    wrefresh(status);
+    echo();
+    curs_set(1);
+    wgetnstr(status, input, sizeof(input) - 1);
+    noecho();
+    curs_set(0);
+
+    pthread_mutex_lock(&shaper.lock);
+    double total = shaper.total.rate, each = shaper.per_transfer;
+    pthread_mutex_unlock(&shaper.lock);
+    char *slash = strchr(input, '/');
+    if (slash) *slash = '\0';
+    double value;
+    if (input[0] && (value = parse_rate(input)) >= 0) total = value;
+    if (slash && slash[1] && (value = parse_rate(slash + 1)) >= 0) each = value;
+    shaper_set(total, each);
+}
+
+// Small selected files (unknown sizes count as small) are queued as tar
+// bundles of up to BUNDLE_MAX_FILES each and deselected, leaving the rest
+// for the caller to queue one by one.
+static void queue_small_file_bundles(int direction, FileList *src, const char *dest_dir, const char *host,
+                                     TreeWalk *walk) {
+    int *picked = malloc(src->count * sizeof(int));
+    if (!picked) return;
+    int count = 0;
+    for (int i = 0; i < src->count; i++) {
+        const FileEntry *e = &src->files[i];
+        if (e->selected && !e->is_dir && e->size < BUNDLE_MAX_FILE_SIZE) picked[count++] = i;
+    }
+    for (int from = 0; count >= BUNDLE_MIN_FILES && from < count; from += BUNDLE_MAX_FILES) {
+        int files = count - from < BUNDLE_MAX_FILES ? count - from : BUNDLE_MAX_FILES;
+        size_t len = 0;
+        int64_t bytes = 0;
+        for (int k = 0; k < files; k++) {
+            const FileEntry *e = &src->files[picked[from + k]];
+            len += e->name_len + 1;
+            if (e->size > 0) bytes += e->size;
+        }
+        char *names = malloc(len), *p = names;
+        if (!names) break;
+        for (int k = 0; k < files; k++) {
+            const FileEntry *e = &src->files[picked[from + k]];
+            memcpy(p, file_name(src, picked[from + k]), e->name_len + 1);
+            p += e->name_len + 1;
+        }
+        if (!transfer_queue_add_bundle(direction, src->cwd, dest_dir, host, names, files, bytes, walk)) {
+            free(names);
+            break;
+        }
+        for (int k = 0; k < files; k++) src->files[picked[from + k]].selected = 0;
+    }
+    free(picked);
+}
+
+#define WALK_THREADS 4
+#define WALK_MAX_DEPTH 64
+
+int transfer_queue_add_walk(int direction, const char *source_dir, const char *dest_dir, const char *host,
+                            int options) {
+    TreeWalk *walk = calloc(1, sizeof(TreeWalk));
+    if (!walk) return 0;
+    TransferJob *job = transfer_job_new(direction, source_dir, dest_dir, host, 0, walk);
+    if (!job) {
+        free(walk);
+        return 0;
+    }
+    job->status.options = options | TRANSFER_WALK;
+    transfer_queue_push(job);
+    return 1;
+}
+
+// Puts what the last session left unfinished back on the queue under the
+// same journal ids, so their records carry on where they stopped. Partial
+// files are picked up by the usual resume check when each job runs.
+static int journal_requeue(const JournalEntry *e, const char *host) {
+    TreeWalk *walk = NULL;
+    if (e->options & TRANSFER_WALK) {
+        walk = calloc(1, sizeof(TreeWalk));
+        if (!walk) return 0;
+        walk->journal_id = e->id;
+    }
+    TransferJob *job = transfer_job_new(e->direction, e->source, e->dest, host, e->size, walk);
+    if (!job) {
+        free(walk);
+        return 0;
+    }
+    job->journal_id = e->id;
+    job->status.options = e->options;
+    if (e->files > 0) {
+        job->status.names = e->names;
+        job->status.files = e->files;
+        job->status.bundle_bytes = e->size;
+    } else {
+        free(e->names);
+    }
+    transfer_queue_push(job);
+    return 1;
+}
+
+// Asks once, at startup, whether to pick up the last session's transfers.
+void journal_offer_resume(WINDOW *status, const char *host) {
+    pthread_mutex_lock(&journal.lock);
+    JournalEntry *entries = journal.entries;
+    size_t count = journal.count;
+    pthread_mutex_unlock(&journal.lock);
+    if (count == 0) return;
+
+    mvwprintw(status, 0, 1, "%zu unfinished transfer%s from the last session, resume? (y/n)", count,
+              count == 1 ? "" : "s");
+    wclrtoeol(status);
+    wrefresh(status);
+    int confirm = wgetch(status);
+    int resume = confirm == 'y' || confirm == 'Y';
+
+    pthread_mutex_lock(&journal.lock);
+    journal.entries = NULL;
+    journal.count = 0;
+    if (!resume) {
+        // Nothing on file is wanted any more; the next flush empties it.
+        journal.outstanding = 0;
+        journal.dirty = 1;
+        for (size_t i = 0; i < journal.done_count; i++) free(journal.done[i]);
+        journal.done_count = 0;
+    }
+    pthread_mutex_unlock(&journal.lock);
+    for (size_t i = 0; i < count; i++) {
+        if (resume && journal_requeue(&entries[i], host)) {
+            free(entries[i].source);
+            free(entries[i].dest);
+            continue;
+        }
+        if (resume) journal_event(&(TransferJob){.journal_id = entries[i].id}, 'D', JOB_FAILED);
+        free(entries[i].source);
+        free(entries[i].dest);
+        free(entries[i].names);
+    }
+    free(entries);
+    journal_flush(1);
+    mvwprintw(status, 0, 1, STATUS_HELP_TEXT);
+    wclrtoeol(status);
+    wrefresh(status);
+}
+
+// A file job of a walk has finished; bundles count for all their files.
+static void tree_walk_settle(TransferStatus *ts, int ok) {
+    int files = ts->files > 0 ? ts->files : 1;
+    if (ok) {
+        __atomic_add_fetch(&ts->walk->files_done, files, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ts->walk->bytes_done, ts->files > 0 ? ts->bundle_bytes : ts->stats.total,
+                           __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&ts->walk->files_failed, files, __ATOMIC_RELAXED);
+    }
+}
+
+// Lists a local directory for a walk: hidden entries included and sizes
+// always read. Links keep S_IFLNK in mode so the walk can tell a link to a
+// directory from the real thing.
+static int walk_list_local(FileList *list, const char *path) {
+    file_list_reset(list);
+    strncpy(list->cwd, path, PATH_MAX-1);
+    list->cwd[PATH_MAX-1] = '\0';
+    DIR *dir = opendir(path);
+    if (!dir) return 0;
+    int dfd = dirfd(dir);
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        struct stat st;
+        if (fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) < 0) continue;
+        mode_t mode = st.st_mode;
+        if (S_ISLNK(mode) && fstatat(dfd, entry->d_name, &st, AT_NO_AUTOMOUNT) < 0) continue;
+        FileEntry *e = add_file_entry(list, entry->d_name, S_ISDIR(st.st_mode));
+        if (!e) {
+            closedir(dir);
+            return 0;
+        }
+        e->mode = mode;
+        e->size = st.st_size;
+        e->mtime = st.st_mtime;
+    }
+    closedir(dir);
+    return 1;
+}
+
+// Returns 0 when the path does not fit.
+static int walk_path(char *out, size_t size, const char *root, const char *relative) {
+    if (relative[0]) return join_path(out, size, root, relative);
+    int n = snprintf(out, size, "%s", root);
+    return n >= 0 && (size_t)n < size;
+}
+
+// Creates one level's directories at the destination in a single round:
+// a pipelined batch of SFTP MKDIRs, one ssh running mkdir -p over a list,
+// or plain mkdir locally. Directories that already exist are fine.
+static int walk_make_dirs(TransferStatus *ts, char **dirs, int count) {
+    char path[PATH_MAX];
+    if (ts->direction == 0) {
+        for (int i = 0; i < count; i++) {
+            if (!walk_path(path, sizeof(path), ts->dest, dirs[i])) return 0;
+            if (mkdir(path, 0755) < 0 && errno != EEXIST) return 0;
+        }
+        return 1;
+    }
+    if (sftp_session.alive) {
+        SftpRequest *reqs[SFTP_MAX_OUTSTANDING];
+        int sent[SFTP_MAX_OUTSTANDING];
+        int n = 0, failed = 0;
+        for (int i = 0; i <= count; i++) {
+            if (i < count && !walk_path(path, sizeof(path), ts->dest, dirs[i])) {
+                failed = 1;
+            } else if (i < count) {
+                SftpBuf body = {0};
+                sftp_put_cstring(&body, path);
+                sftp_put_attrs(&body, NULL);
+                sent[n] = i;
+                reqs[n++] = sftp_send(&sftp_session, SSH_FXP_MKDIR, &body, NULL, 0);
+                sftp_buf_free(&body);
+            }
+            if (n == SFTP_MAX_OUTSTANDING || (i == count && n > 0)) {
+                for (int j = 0; j < n; j++) {
+                    sftp_wait(&sftp_session, reqs[j]);
+                    uint32_t code = sftp_status_code(reqs[j]);
+                    sftp_request_free(reqs[j]);
+                    if (code == SSH_FX_OK) continue;
+                    // SFTP v3 reports an existing directory as a plain
+                    // failure; anything else, or a file in the way, is real.
+                    SftpAttrs attrs;
+                    if (code != SSH_FX_FAILURE || !walk_path(path, sizeof(path), ts->dest, dirs[sent[j]]) ||
+                        !sftp_stat(&sftp_session, path, 1, &attrs) || !S_ISDIR(attrs.permissions)) {
+                        failed = 1;
+                    }
+                }
+                n = 0;
+            }
+        }
+        return sftp_session.alive && !failed;
+    }
+
+    const char *tmp = getenv("TMPDIR");
+    char list_path[PATH_MAX];
+    snprintf(list_path, sizeof(list_path), "%s/scp-tui-mkdir-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    int fd = mkstemp(list_path);
+    if (fd < 0) return 0;
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        unlink(list_path);
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        if (dirs[i][0]) fwrite(dirs[i], 1, strlen(dirs[i]) + 1, out);
+    }
+    int write_failed = ferror(out);
+    if (fclose(out) != 0 || write_failed) {
+        unlink(list_path);
+        return 0;
+    }
+    // The list is read by the local shell and fed through ssh, so only the
+    // destination reaches the remote shell.
+    char quoted[QUOTED_PATH_MAX], quoted_list[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX * 2 + 64];
+    char cmd[QUOTED_PATH_MAX * 9 + 1024];
+    int n = -1;
+    if (shell_quote(quoted, sizeof(quoted), ts->dest) && shell_quote(quoted_list, sizeof(quoted_list), list_path))
+        n = snprintf(remote, sizeof(remote), "mkdir -p %s && cd %s && xargs -0 -r mkdir -p --", quoted, quoted);
+    int code = -1;
+    if (n >= 0 && (size_t)n < sizeof(remote) && ssh_remote_command(cmd, sizeof(cmd), ts->hostname, remote)) {
+        size_t used = strlen(cmd);
+        snprintf(cmd + used, sizeof(cmd) - used, " < %s", quoted_list);
+        char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+        code = run_quiet(argv);
+    }
+    unlink(list_path);
+    return code == 0;
+}
+
+// One level of the walk, listed by several threads at once. Each listed
+// directory's files are queued right away; its subdirectories are
+// collected for the next level.
+typedef struct {
+    TransferStatus *ts;
+    char **dirs;
+    int count;
+    int next;
+    int depth;
+    int root_failed;
+    char **found;
+    int found_count;
+    size_t found_cap;
+    pthread_mutex_t lock;
+} WalkLevel;
+
+static int walk_cancelled(void *ctx) {
+    return ((TransferStatus *)ctx)->cancel_requested;
+}
+
+// Queues the files of one listed directory: small ones as bundles (unless
+// the walk is a delta upload), the rest as a job each.
+static void walk_queue_files(TransferStatus *ts, FileList *list, const char *dest_dir) {
+    TreeWalk *walk = ts->walk;
+    int files = 0, done = 0;
+    int64_t bytes = 0, done_bytes = 0;
+    for (int i = 0; i < list->count; i++) {
+        FileEntry *e = &list->files[i];
+        if (e->is_dir) continue;
+        files++;
+        if (e->size > 0) bytes += e->size;
+        char src_path[PATH_MAX], dest_path[PATH_MAX];
+        // Names whose paths do not fit are never queued; selected entries
+        // are known to join cleanly below.
+        if (!join_path(src_path, sizeof(src_path), list->cwd, file_name(list, i)) ||
+            !join_path(dest_path, sizeof(dest_path), dest_dir, file_name(list, i))) {
+            __atomic_add_fetch(&walk->skipped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (journal_done_contains(src_path, dest_path)) {
+            // Moved before the last session ended.
+            done++;
+            if (e->size > 0) done_bytes += e->size;
+            continue;
+        }
+        e->selected = 1;
+    }
+    __atomic_add_fetch(&walk->files_found, files, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walk->files_done, done, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walk->bytes_done, done_bytes, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&walk->bytes_found, bytes, __ATOMIC_RELAXED);
+    int options = ts->options & TRANSFER_DELTA;
+    if (!options) queue_small_file_bundles(ts->direction, list, dest_dir, ts->hostname, walk);
+    for (int i = 0; i < list->count; i++) {
+        if (!list->files[i].selected) continue;
+        char src_path[PATH_MAX], dest_path[PATH_MAX];
+        join_path(src_path, sizeof(src_path), list->cwd, file_name(list, i));
+        join_path(dest_path, sizeof(dest_path), dest_dir, file_name(list, i));
+        TransferJob *job = transfer_job_new(ts->direction, src_path, dest_path, ts->hostname,
+                                            list->files[i].size, walk);
+        if (!job) break;
+        job->status.options = options;
+        transfer_queue_push(job);
+    }
+}
+
+static void *walk_level_thread(void *arg) {
+    WalkLevel *level = (WalkLevel *)arg;
+    TransferStatus *ts = level->ts;
+    ListingHooks hooks = {walk_cancelled, NULL, ts, 1};
+    FileList list = {0};
+    while (!ts->cancel_requested) {
+        pthread_mutex_lock(&level->lock);
+        int i = level->next < level->count ? level->next++ : -1;
+        pthread_mutex_unlock(&level->lock);
+        if (i < 0) break;
+        const char *relative = level->dirs[i];
+        char src_dir[PATH_MAX], dest_dir[PATH_MAX];
+        int ok = walk_path(src_dir, sizeof(src_dir), ts->source, relative) &&
+                 walk_path(dest_dir, sizeof(dest_dir), ts->dest, relative);
+        if (ok) {
+            ok = ts->direction == 1 ? walk_list_local(&list, src_dir)
+                                    : fetch_remote_dir(&list, ts->hostname, src_dir, &hooks);
+        }
+        if (!ok) {
+            if (level->depth == 0) level->root_failed = 1;
+            __atomic_add_fetch(&ts->walk->skipped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        walk_queue_files(ts, &list, dest_dir);
+        for (int j = 0; j < list.count; j++) {
+            const FileEntry *e = &list.files[j];
+            const char *name = file_name(&list, j);
+            if (!e->is_dir || strcmp(name, "..") == 0) continue;
+            // Links to directories are not followed, so a walk cannot loop.
+            if (S_ISLNK(e->mode) || level->depth >= WALK_MAX_DEPTH) {
+                __atomic_add_fetch(&ts->walk->skipped, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            char child[PATH_MAX];
+            int n = relative[0] ? join_path(child, sizeof(child), relative, name)
+                                : snprintf(child, sizeof(child), "%s", name) < (int)sizeof(child);
+            char *copy = n ? strdup(child) : NULL;
+            pthread_mutex_lock(&level->lock);
+            char **found = copy ? grow_buffer(level->found, &level->found_cap, level->found_count + 1,
+                                              sizeof(char *), 64)
+                                : NULL;
+            if (found) {
+                level->found = found;
+                level->found[level->found_count++] = copy;
+            }
+            pthread_mutex_unlock(&level->lock);
+            if (!found) {
+                free(copy);
+                __atomic_add_fetch(&ts->walk->skipped, 1, __ATOMIC_RELAXED);
+            }
+        }
+        ui_notify();
+    }
+    file_list_free(&list);
+    return NULL;
+}
+
+// Walks the source tree breadth first. Each level's directories are made
+// at the destination in one batch, then the level is listed in parallel
+// and its files are queued as each directory comes back, so transfers
+// start long before the walk is over.
+static int run_tree_walk(TransferStatus *ts) {
+    TreeWalk *walk = ts->walk;
+    ts->error[0] = '\0';
+    char **dirs = malloc(sizeof(char *));
+    int count = 0;
+    if (dirs && (dirs[0] = strdup(""))) count = 1;
+    int ok = count > 0;
+    for (int depth = 0; ok && count > 0 && !ts->cancel_requested; depth++) {
+        ts->phase = "creating directories";
+        ui_notify();
+        if (!walk_make_dirs(ts, dirs, count)) {
+            snprintf(ts->error, sizeof(ts->error), "cannot create directories under %.80s", ts->dest);
+            ok = 0;
+            break;
+        }
+        ts->phase = NULL;
+
+        WalkLevel level = {.ts = ts, .dirs = dirs, .count = count, .depth = depth};
+        pthread_mutex_init(&level.lock, NULL);
+        pthread_t threads[WALK_THREADS];
+        int started = 0;
+        while (started < WALK_THREADS && started < count &&
+               pthread_create(&threads[started], NULL, walk_level_thread, &level) == 0) {
+            started++;
+        }
+        if (started == 0) walk_level_thread(&level);
+        for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+        pthread_mutex_destroy(&level.lock);
+        __atomic_add_fetch(&walk->dirs, count, __ATOMIC_RELAXED);
+        if (level.root_failed) {
+            snprintf(ts->error, sizeof(ts->error), "cannot read %.100s", ts->source);
+            ok = 0;
+        }
+
+        for (int i = 0; i < count; i++) free(dirs[i]);
+        free(dirs);
+        dirs = level.found;
+        count = level.found_count;
+    }
+    for (int i = 0; i < count; i++) free(dirs[i]);
+    free(dirs);
+    ts->phase = NULL;
+    return ok && !ts->cancel_requested;
+}
+
+// Sync: one side of a directory pair is made to match the other. Both
+// trees are listed whole, the remote one by a single find over ssh while
+// the local one is walked here, then merged in one pass over the sorted
+// paths. Only new files and files whose source is newer (or whose size
+// differs) are queued; with SCP_TUI_SYNC_CHECKSUM, files of equal size are
+// compared by BLAKE2b instead of by date. Symbolic links (and anything
+// else that is neither a file nor a directory) are left alone on both
+// sides: they are listed only so that the name on the other side is
+// neither copied over nor deleted.
+#define SYNC_HASH_SIZE 64
+
+static int sync_checksum = 0;
+
+typedef struct {
+    uint32_t path_offset;
+    uint8_t is_dir;
+    // Neither a file nor a directory.
+    uint8_t other;
+    int64_t size;
+    int64_t mtime;
+} SyncEntry;
+
+typedef struct {
+    SyncEntry *entries;
+    size_t count;
+    size_t cap;
+    char *paths;
+    size_t paths_len;
+    size_t paths_cap;
+    // Set when an entry could not be recorded; the tree is then no basis
+    // for deciding what is extra.
+    int incomplete;
+    // Set when part of the tree could not be listed. Copies can still be
+    // worked out, but nothing may be called extra.
+    int partial;
+} SyncTree;
+
+static inline const char *sync_path(const SyncTree *tree, size_t index) {
+    return tree->paths + tree->entries[index].path_offset;
+}
+
+// type is 'f', 'd' or, for anything else, 'o'.
+static void sync_tree_add(SyncTree *tree, const char *path, size_t len, char type, int64_t size, int64_t mtime) {
+    SyncEntry *entries = grow_buffer(tree->entries, &tree->cap, tree->count + 1, sizeof(SyncEntry), 1024);
+    if (entries) tree->entries = entries;
+    char *paths = entries ? grow_buffer(tree->paths, &tree->paths_cap, tree->paths_len + len + 1, 1, 65536) : NULL;
+    if (!paths) {
+        tree->incomplete = 1;
+        return;
+    }
+    tree->paths = paths;
+    SyncEntry *e = &tree->entries[tree->count++];
+    e->path_offset = tree->paths_len;
+    e->is_dir = type == 'd';
+    e->other = type == 'o';
+    e->size = size;
+    e->mtime = mtime;
+    memcpy(tree->paths + tree->paths_len, path, len);
+    tree->paths[tree->paths_len + len] = '\0';
+    tree->paths_len += len + 1;
+}
+
+static void sync_tree_free(SyncTree *tree) {
+    free(tree->entries);
+    free(tree->paths);
+    memset(tree, 0, sizeof(*tree));
+}
+
+static int compare_sync_entries(const void *a, const void *b, void *arena) {
+    return strcmp((const char *)arena + ((const SyncEntry *)a)->path_offset,
+                  (const char *)arena + ((const SyncEntry *)b)->path_offset);
+}
+
+static void sync_tree_sort(SyncTree *tree) {
+    if (tree->count > 1) qsort_r(tree->entries, tree->count, sizeof(SyncEntry), compare_sync_entries, tree->paths);
+}
+
+static long sync_tree_find(const SyncTree *tree, const char *path) {
+    size_t lo = 0, hi = tree->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(sync_path(tree, mid), path);
+        if (c == 0) return mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+// relative holds the directory being listed (len bytes, "" for the root)
+// and is extended in place for its subdirectories. A missing root lists as
+// empty; a root that cannot be read returns 0. Anything missed below it
+// (unreadable directories, entries that cannot be stat'ed, paths too long,
+// subtrees past WALK_MAX_DEPTH) marks the tree partial.
+static int sync_list_local(SyncTree *tree, const char *root, char *relative, size_t len, int depth) {
+    char dir_path[PATH_MAX];
+    DIR *dir = walk_path(dir_path, sizeof(dir_path), root, relative) ? opendir(dir_path) : NULL;
+    if (!dir) {
+        if (depth == 0) return errno == ENOENT;
+        tree->partial = 1;
+        return 1;
+    }
+    int dfd = dirfd(dir);
+    struct dirent *entry;
+    while (1) {
+        errno = 0;
+        if (!(entry = readdir(dir))) break;
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        struct stat st;
+        size_t name_len = strlen(entry->d_name);
+        if (fstatat(dfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT) < 0 ||
+            len + name_len + 2 > PATH_MAX) {
+            tree->partial = 1;
+            continue;
+        }
+        size_t child_len = len;
+        if (len) relative[child_len++] = '/';
+        memcpy(relative + child_len, entry->d_name, name_len + 1);
+        child_len += name_len;
+        char type = S_ISDIR(st.st_mode) ? 'd' : S_ISREG(st.st_mode) ? 'f' : 'o';
+        sync_tree_add(tree, relative, child_len, type, st.st_size, st.st_mtime);
+        if (S_ISDIR(st.st_mode)) {
+            if (depth < WALK_MAX_DEPTH) sync_list_local(tree, root, relative, child_len, depth + 1);
+            else tree->partial = 1;
+        }
+        relative[len] = '\0';
+    }
+    if (errno != 0) tree->partial = 1;
+    closedir(dir);
+    return 1;
+}
+
+// Exit codes of the remote listing, past ssh's own.
+#define SYNC_LIST_PARTIAL 4
+
+// Lists the whole remote tree in one round trip: "type size mtime path"
+// records, NUL-terminated. A root that does not exist lists as empty. A
+// root that cannot be entered, or a find without -printf, fails the
+// command; a find that could not read everything exits SYNC_LIST_PARTIAL
+// after listing the rest.
+static SupervisedChild *sync_spawn_remote_list(const char *host, const char *root) {
+    char quoted[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX * 3 + 256], cmd[QUOTED_PATH_MAX * 12 + 2048];
+    if (!shell_quote(quoted, sizeof(quoted), root)) return NULL;
+    int n = snprintf(remote, sizeof(remote),
+                     "[ -e %s ] || [ -L %s ] || exit 0; cd %s || exit 3; "
+                     "find . -maxdepth 0 -printf '' || exit 3; "
+                     "find . -mindepth 1 -printf '%%y %%s %%T@ %%P\\0' || exit %d",
+                     quoted, quoted, quoted, SYNC_LIST_PARTIAL);
+    if (n < 0 || (size_t)n >= sizeof(remote) || !ssh_remote_command(cmd, sizeof(cmd), host, remote)) return NULL;
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    return supervisor_spawn(argv, (size_t)1 << 30, 0);
+}
+
+static void sync_parse_remote_list(SyncTree *tree, const char *data, size_t len) {
+    const char *end = data + len;
+    while (data < end) {
+        const char *record_end = memchr(data, '\0', end - data);
+        if (!record_end) break;
+        char type;
+        long long size, mtime;
+        int consumed;
+        if (sscanf(data, "%c %lld %lld%n", &type, &size, &mtime, &consumed) == 3) {
+            const char *path = strchr(data + consumed, ' ');
+            if (path && path[1]) {
+                path++;
+                sync_tree_add(tree, path, record_end - path, type == 'f' || type == 'd' ? type : 'o', size, mtime);
+            }
+        }
+        data = record_end + 1;
+    }
+}
+
+// Lists both trees at once: the remote find runs while the local tree is
+// walked here. A listing cut short by the output limit is a failure.
+static int sync_list_trees(SyncTree *local_tree, const char *local_root, SyncTree *remote_tree, const char *host,
+                           const char *remote_root) {
+    SupervisedChild *c = sync_spawn_remote_list(host, remote_root);
+    if (!c) return 0;
+    char relative[PATH_MAX] = "";
+    int ok = sync_list_local(local_tree, local_root, relative, 0, 0);
+    supervisor_wait(c, -1);
+    int code = supervisor_exit_code(c);
+    if (code == SYNC_LIST_PARTIAL) remote_tree->partial = 1;
+    ok = ok && (code == 0 || code == SYNC_LIST_PARTIAL) && !c->output_dropped;
+    if (ok && c->output) sync_parse_remote_list(remote_tree, c->output, c->output_len);
+    supervisor_release(c);
+    sync_tree_sort(local_tree);
+    sync_tree_sort(remote_tree);
+    return ok && !local_tree->incomplete && !remote_tree->incomplete;
+}
+
+static int sync_hash_local(const char *path, unsigned char digest[SYNC_HASH_SIZE]) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    Blake2b b;
+    blake2b_init(&b, SYNC_HASH_SIZE);
+    char buf[1 << 16];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) blake2b_update(&b, buf, n);
+    close(fd);
+    if (n < 0) return 0;
+    blake2b_final(&b, digest);
+    return 1;
+}
+
+// Writes paths NUL-separated to a temporary file for xargs -0 on the other
+// side of an ssh command.
+static int sync_write_list(char *list_path, size_t size, char **paths, size_t count) {
+    const char *tmp = getenv("TMPDIR");
+    snprintf(list_path, size, "%s/scp-tui-sync-XXXXXX", tmp && *tmp ? tmp : "/tmp");
+    int fd = mkstemp(list_path);
+    if (fd < 0) return 0;
+    FILE *out = fdopen(fd, "w");
+    if (!out) {
+        close(fd);
+        unlink(list_path);
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++) fwrite(paths[i], 1, strlen(paths[i]) + 1, out);
+    if (fclose(out) != 0) {
+        unlink(list_path);
+        return 0;
+    }
+    return 1;
+}
+
+// "ssh host 'cd root && xargs -0 -r tool --' < list" for /bin/sh -c.
+// Returns 0 when the command does not fit.
+static int sync_xargs_command(char *cmd, size_t size, const char *host, const char *root, const char *tool,
+                              const char *list_path) {
+    char quoted[QUOTED_PATH_MAX], remote[QUOTED_PATH_MAX + 64];
+    if (!shell_quote(quoted, sizeof(quoted), root)) return 0;
+    int n = snprintf(remote, sizeof(remote), "cd %s && xargs -0 -r %s --", quoted, tool);
+    if (n < 0 || (size_t)n >= sizeof(remote) || !ssh_remote_command(cmd, size, host, remote)) return 0;
+    size_t used = strlen(cmd);
+    if (used + 3 >= size) return 0;
+    memcpy(cmd + used, " < ", 3);
+    return shell_quote(cmd + used + 3, size - used - 3, list_path);
+}
+
+// Room for any sync_xargs_command.
+#define SYNC_XARGS_CMD_MAX (QUOTED_PATH_MAX * 6 + 1024)
+
+// Compares files of equal size by content. The remote side runs b2sum
+// over the whole list while this side hashes its copies. same[i] is set
+// for the candidates whose digests match.
+static void sync_compare_hashes(const char *host, const char *remote_root, const char *local_root, char **paths,
+                                size_t count, unsigned char *same) {
+    char list_path[PATH_MAX];
+    if (count == 0 || !sync_write_list(list_path, sizeof(list_path), paths, count)) return;
+    char cmd[SYNC_XARGS_CMD_MAX];
+    char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+    SupervisedChild *c = sync_xargs_command(cmd, sizeof(cmd), host, remote_root, "b2sum", list_path)
+                             ? supervisor_spawn(argv, (size_t)256 << 20, 0)
+                             : NULL;
+    unsigned char (*local)[SYNC_HASH_SIZE] = malloc(count * SYNC_HASH_SIZE);
+    unsigned char *hashed = calloc(count, 1);
+    if (c && local && hashed) {
+        for (size_t i = 0; i < count; i++) {
+            char path[PATH_MAX];
+            hashed[i] = join_path(path, sizeof(path), local_root, paths[i]) && sync_hash_local(path, local[i]);
+        }
+    }
+    if (c) supervisor_wait(c, -1);
+    unlink(list_path);
+    if (!c || !local || !hashed || !c->output) {
+        if (c) supervisor_release(c);
+        free(local);
+        free(hashed);
+        return;
+    }
+
+    // b2sum prints "digest  name" in list order, skipping files it could
+    // not read; a name with a backslash or newline is escaped and its line
+    // starts with a backslash.
+    size_t next = 0;
+    char *line = c->output, *end = c->output + c->output_len;
+    while (line < end && next < count) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol) break;
+        *eol = '\0';
+        int escaped = line[0] == '\\';
+        char *hex = line + escaped;
+        char *name = strstr(hex, "  ");
+        if (name && name - hex == SYNC_HASH_SIZE * 2) {
+            name += 2;
+            if (escaped) {
+                char *out = name;
+                for (char *p = name; *p; p++) {
+                    if (*p == '\\' && p[1]) {
+                        p++;
+                        *out++ = *p == 'n' ? '\n' : *p;
+                    } else {
+                        *out++ = *p;
+                    }
+                }
+                *out = '\0';
+            }
+            while (next < count && strcmp(paths[next], name) != 0) next++;
+            if (next < count && hashed[next]) {
+                unsigned char remote[SYNC_HASH_SIZE];
+                for (int i = 0; i < SYNC_HASH_SIZE; i++) sscanf(hex + 2 * i, "%2hhx", &remote[i]);
+                same[next] = memcmp(remote, local[next], SYNC_HASH_SIZE) == 0;
             }
+            if (next < count) next++;
         }
-        
-        if (file_index == list->selected && focus) {
-            wattroff(win, A_REVERSE);
-        }
+        line = eol + 1;
     }
-    wrefresh(win);
+    supervisor_release(c);
+    free(local);
+    free(hashed);
 }
 
-void resolve_remote_path(char *path, size_t size, const char *host) {
-    if (strncmp(path, "~/", 2) == 0 || strcmp(path, "~") == 0) {
-        char cmd[512], home[PATH_MAX] = "";
-        
-        snprintf(cmd, sizeof(cmd), "ssh %s 'echo $HOME' 2>/dev/null", host);
-        FILE *fp = popen(cmd, "r");
-        if (fp) {
-            if (fgets(home, sizeof(home), fp)) {
-                size_t len = strlen(home);
-                if (len > 0 && home[len-1] == '\n')
-                    home[len-1] = '\0';
+typedef struct {
+    SyncTree source;
+    SyncTree dest;
+    // Indexes into source.entries of directories to create and files to
+    // copy, and into dest.entries of extras (only the topmost of each
+    // extra subtree).
+    size_t *dirs;
+    size_t dir_count, dir_cap;
+    size_t *copies;
+    size_t copy_count, copy_cap;
+    size_t *extras;
+    size_t extra_count, extra_cap;
+    int new_files;
+    int changed;
+    int unchanged;
+    int conflicts;
+    int64_t copy_bytes;
+    int incomplete;
+    // Either tree is partial, so no extras are collected.
+    int partial;
+} SyncPlan;
+
+static void sync_plan_push(SyncPlan *plan, size_t **list, size_t *count, size_t *cap, size_t index) {
+    size_t *grown = grow_buffer(*list, cap, *count + 1, sizeof(size_t), 256);
+    if (!grown) {
+        plan->incomplete = 1;
+        return;
+    }
+    *list = grown;
+    (*list)[(*count)++] = index;
+}
+
+static void sync_plan_free(SyncPlan *plan) {
+    sync_tree_free(&plan->source);
+    sync_tree_free(&plan->dest);
+    free(plan->dirs);
+    free(plan->copies);
+    free(plan->extras);
+    memset(plan, 0, sizeof(*plan));
+}
+
+// Whether dest path is not an extra of its own: it lies under a directory
+// that is itself extra, so deleting that directory already takes it, or
+// under one whose source counterpart is not a directory, a type conflict
+// that is left alone.
+static int sync_under_extra(const SyncPlan *plan, const char *path) {
+    char parent[PATH_MAX];
+    int n = snprintf(parent, sizeof(parent), "%s", path);
+    if (n < 0 || (size_t)n >= sizeof(parent)) return 1;
+    char *slash = strrchr(parent, '/');
+    if (!slash) return 0;
+    *slash = '\0';
+    long k = sync_tree_find(&plan->source, parent);
+    return k < 0 || !plan->source.entries[k].is_dir;
+}
+
+static int sync_diff(SyncPlan *plan, int upload, const char *source_root, const char *dest_root, const char *host) {
+    memset(plan, 0, sizeof(*plan));
+    const char *local_root = upload ? source_root : dest_root;
+    const char *remote_root = upload ? dest_root : source_root;
+    SyncTree *local_tree = upload ? &plan->source : &plan->dest;
+    SyncTree *remote_tree = upload ? &plan->dest : &plan->source;
+    if (!sync_list_trees(local_tree, local_root, remote_tree, host, remote_root)) return 0;
+    plan->partial = plan->source.partial || plan->dest.partial;
+
+    SyncTree *src = &plan->source, *dst = &plan->dest;
+    char **candidates = NULL;
+    size_t *candidate_index = NULL;
+    size_t candidate_count = 0, candidate_cap = 0, index_cap = 0;
+    size_t i = 0, j = 0;
+    while (i < src->count || j < dst->count) {
+        int c = i == src->count ? 1 : j == dst->count ? -1 : strcmp(sync_path(src, i), sync_path(dst, j));
+        if (c < 0) {
+            const SyncEntry *e = &src->entries[i];
+            if (e->other) {
+                // Left alone.
+            } else if (e->is_dir) {
+                sync_plan_push(plan, &plan->dirs, &plan->dir_count, &plan->dir_cap, i);
+            } else {
+                sync_plan_push(plan, &plan->copies, &plan->copy_count, &plan->copy_cap, i);
+                plan->new_files++;
+                plan->copy_bytes += e->size;
             }
-            pclose(fp);
-        }
-        
-        if (!home[0]) {
-            char username[64] = "";
-            snprintf(cmd, sizeof(cmd), "ssh %s 'whoami' 2>/dev/null", host);
-            fp = popen(cmd, "r");
-            if (fp) {
-                if (fgets(username, sizeof(username), fp)) {
-                    size_t len = strlen(username);
-                    if (len > 0 && username[len-1] == '\n')
-                        username[len-1] = '\0';
-                }
-                pclose(fp);
-                
-                if (strcmp(username, "root") == 0) {
-                    strcpy(home, "/root");
+            i++;
+        } else if (c > 0) {
+            if (!plan->partial && !dst->entries[j].other && !sync_under_extra(plan, sync_path(dst, j))) {
+                sync_plan_push(plan, &plan->extras, &plan->extra_count, &plan->extra_cap, j);
+            }
+            j++;
+        } else {
+            const SyncEntry *s = &src->entries[i], *d = &dst->entries[j];
+            if (s->other || d->other) {
+                // Left alone.
+            } else if (s->is_dir != d->is_dir) {
+                plan->conflicts++;
+            } else if (!s->is_dir) {
+                if (s->size != d->size || (!sync_checksum && s->mtime > d->mtime)) {
+                    sync_plan_push(plan, &plan->copies, &plan->copy_count, &plan->copy_cap, i);
+                    plan->changed++;
+                    plan->copy_bytes += s->size;
+                } else if (sync_checksum) {
+                    char **grown = grow_buffer(candidates, &candidate_cap, candidate_count + 1, sizeof(char *), 256);
+                    if (grown) candidates = grown;
+                    size_t *grown_index = grown ? grow_buffer(candidate_index, &index_cap, candidate_count + 1,
+                                                              sizeof(size_t), 256)
+                                                : NULL;
+                    if (grown_index) {
+                        candidate_index = grown_index;
+                        candidates[candidate_count] = (char *)sync_path(src, i);
+                        candidate_index[candidate_count++] = i;
+                    } else {
+                        plan->incomplete = 1;
+                    }
                 } else {
-                    snprintf(home, sizeof(home), "/home/%s", username);
+                    plan->unchanged++;
                 }
             }
+            i++;
+            j++;
         }
-        
-        if (strcmp(path, "~") == 0) {
-            strncpy(path, home, size-1);
-            path[size-1] = '\0';
-        } else {
-            char temp[PATH_MAX];
-            snprintf(temp, sizeof(temp), "%s%s", home, path+1);
-            strncpy(path, temp, size-1);
-            path[size-1] = '\0';
+    }
+
+    if (candidate_count > 0) {
+        unsigned char *same = calloc(candidate_count, 1);
+        if (same) sync_compare_hashes(host, remote_root, local_root, candidates, candidate_count, same);
+        for (size_t k = 0; k < candidate_count; k++) {
+            if (same && same[k]) {
+                plan->unchanged++;
+                continue;
+            }
+            sync_plan_push(plan, &plan->copies, &plan->copy_count, &plan->copy_cap, candidate_index[k]);
+            plan->changed++;
+            plan->copy_bytes += src->entries[candidate_index[k]].size;
         }
+        free(same);
     }
+    free(candidates);
+    free(candidate_index);
+    return !plan->incomplete;
 }
 
-void *monitor_transfer_progress(void *arg) {
-    TransferStatus *ts = (TransferStatus *)arg;
-    char buffer[1024];
-    int percentage = 0;
-    
-    while (ts->pipe && fgets(buffer, sizeof(buffer), ts->pipe)) {
-        if (ts->cancel_requested) break;
-        
-        char *percent_pos = strstr(buffer, "%");
-        if (percent_pos && percent_pos > buffer) {
-            char *digit_pos = percent_pos - 1;
-            while (digit_pos > buffer && isdigit(*(digit_pos - 1))) {
-                digit_pos--;
-            }
-            
-            if (digit_pos < percent_pos) {
-                char percent_str[32] = {0};
-                strncpy(percent_str, digit_pos, percent_pos - digit_pos);
-                percent_str[percent_pos - digit_pos] = '\0';
-                percentage = atoi(percent_str);
-                
-                if (percentage >= 0 && percentage <= 100) {
-                    ts->progress = percentage;
-                }
+static int sync_delete_extras(SyncPlan *plan, int upload, const char *dest_root, const char *host) {
+    if (plan->partial) return 0;
+    char **paths = malloc((plan->extra_count ? plan->extra_count : 1) * sizeof(char *));
+    if (!paths) return 0;
+    for (size_t k = 0; k < plan->extra_count; k++) paths[k] = (char *)sync_path(&plan->dest, plan->extras[k]);
+    int ok = 1;
+    if (upload) {
+        char list_path[PATH_MAX];
+        ok = sync_write_list(list_path, sizeof(list_path), paths, plan->extra_count);
+        if (ok) {
+            char cmd[SYNC_XARGS_CMD_MAX];
+            char *argv[] = {"/bin/sh", "-c", cmd, NULL};
+            ok = sync_xargs_command(cmd, sizeof(cmd), host, dest_root, "rm -rf", list_path) && run_quiet(argv) == 0;
+            unlink(list_path);
+        }
+    } else {
+        for (size_t k = 0; k < plan->extra_count; k++) {
+            char path[PATH_MAX];
+            // Cut short, the path would name something else.
+            if (!join_path(path, sizeof(path), dest_root, paths[k])) {
+                ok = 0;
+                continue;
             }
+            char *argv[] = {"rm", "-rf", "--", path, NULL};
+            if (plan->dest.entries[plan->extras[k]].is_dir ? run_quiet(argv) != 0 : unlink(path) < 0) ok = 0;
         }
     }
+    free(paths);
+    return ok;
+}
 
-    if (!ts->cancel_requested) {
-        ts->progress = 100;
+// Orders copies by directory, then name, so each directory's files can be
+// handed to the bundler together.
+static int compare_sync_copies(const void *a, const void *b, void *tree) {
+    const char *pa = sync_path(tree, *(const size_t *)a);
+    const char *pb = sync_path(tree, *(const size_t *)b);
+    const char *sa = strrchr(pa, '/'), *sb = strrchr(pb, '/');
+    size_t da = sa ? (size_t)(sa - pa) : 0, db = sb ? (size_t)(sb - pb) : 0;
+    int c = memcmp(pa, pb, da < db ? da : db);
+    if (c != 0) return c;
+    if (da != db) return da < db ? -1 : 1;
+    return strcmp(pa + da, pb + db);
+}
+
+static int sync_queue(SyncPlan *plan, int upload, const char *source_root, const char *dest_root, const char *host) {
+    TransferStatus dirs_ts = {0};
+    dirs_ts.direction = upload;
+    dirs_ts.dest = (char *)dest_root;
+    snprintf(dirs_ts.hostname, sizeof(dirs_ts.hostname), "%s", host);
+    char **dirs = malloc((plan->dir_count + 1) * sizeof(char *));
+    if (!dirs) return 0;
+    dirs[0] = "";
+    for (size_t k = 0; k < plan->dir_count; k++) dirs[k + 1] = (char *)sync_path(&plan->source, plan->dirs[k]);
+    int ok = walk_make_dirs(&dirs_ts, dirs, plan->dir_count + 1);
+    free(dirs);
+    if (!ok) return 0;
+
+    if (plan->copy_count > 1) {
+        qsort_r(plan->copies, plan->copy_count, sizeof(size_t), compare_sync_copies, &plan->source);
     }
-    
-    ts->is_active = 0;
-    if (ts->pipe) {
-        pclose(ts->pipe);
-        ts->pipe = NULL;
+    FileList list = {0};
+    int queued_all = 1;
+    for (size_t k = 0; k < plan->copy_count;) {
+        const char *first = sync_path(&plan->source, plan->copies[k]);
+        const char *slash = strrchr(first, '/');
+        size_t dir_len = slash ? (size_t)(slash - first) : 0;
+        char relative[PATH_MAX], dest_dir[PATH_MAX];
+        int fits = dir_len < sizeof(relative);
+        if (fits) snprintf(relative, sizeof(relative), "%.*s", (int)dir_len, first);
+        fits = fits && walk_path(list.cwd, sizeof(list.cwd), source_root, relative) &&
+               walk_path(dest_dir, sizeof(dest_dir), dest_root, relative);
+        file_list_reset(&list);
+        for (; k < plan->copy_count; k++) {
+            const char *path = sync_path(&plan->source, plan->copies[k]);
+            const char *name = strrchr(path, '/');
+            if ((name ? (size_t)(name - path) : 0) != dir_len || memcmp(path, first, dir_len) != 0) break;
+            if (!fits) {
+                queued_all = 0;
+                continue;
+            }
+            const SyncEntry *se = &plan->source.entries[plan->copies[k]];
+            FileEntry *e = add_file_entry(&list, name ? name + 1 : path, 0);
+            if (!e) {
+                file_list_free(&list);
+                return 0;
+            }
+            e->size = se->size;
+            e->mtime = se->mtime;
+            e->selected = 1;
+        }
+        if (!fits) continue;
+        queue_small_file_bundles(upload, &list, dest_dir, host, NULL);
+        for (int n = 0; n < list.count; n++) {
+            if (!list.files[n].selected) continue;
+            char src_path[PATH_MAX], dest_path[PATH_MAX];
+            if (!join_path(src_path, sizeof(src_path), list.cwd, file_name(&list, n)) ||
+                !join_path(dest_path, sizeof(dest_path), dest_dir, file_name(&list, n))) {
+                queued_all = 0;
+                continue;
+            }
+            if (!transfer_queue_add(upload, src_path, dest_path, host, list.files[n].size, 0)) {
+                queued_all = 0;
+                break;
+            }
+        }
     }
-    return NULL;
+    file_list_free(&list);
+    return queued_all;
 }
 
-int start_file_transfer(TransferStatus *ts) {
-    char cmd[2048];
-    
-    if (ts->direction == 1) {
-        snprintf(cmd, sizeof(cmd), 
-                 "scp -v -p \"%s\" %s:\"%s\" 2>&1", 
-                 ts->source, ts->hostname, ts->dest);
-    } else {
-        snprintf(cmd, sizeof(cmd), 
-                 "scp -v -p %s:\"%s\" \"%s\" 2>&1", 
-                 ts->hostname, ts->source, ts->dest);
-    }
-    
-    ts->pipe = popen(cmd, "r");
-    if (!ts->pipe) {
+// The S key: diffs the two trees, shows what would change and, once
+// confirmed, queues the copies (and deletes extras when asked to).
+// Returns whether anything at the destination was touched.
+int run_sync(WINDOW *status, int upload, const char *source_root, const char *dest_root, const char *host) {
+    mvwprintw(status, 0, 1, "Comparing %s with %s...", source_root, dest_root);
+    wclrtoeol(status);
+    wrefresh(status);
+    long long started = monotonic_ms();
+    SyncPlan plan;
+    int ok = sync_diff(&plan, upload, source_root, dest_root, host);
+    double seconds = (monotonic_ms() - started) / 1000.0;
+    if (!ok) {
+        sync_plan_free(&plan);
+        mvwprintw(status, 0, 1, "Cannot list %s on %s", upload ? dest_root : source_root, host);
+        wclrtoeol(status);
+        wrefresh(status);
+        napms(1500);
         return 0;
     }
-    
-    ts->is_active = 1;
-    ts->progress = 0;
-    ts->cancel_requested = 0;
-    
-    if (pthread_create(&ts->thread, NULL, monitor_transfer_progress, ts) != 0) {
-        pclose(ts->pipe);
-        ts->pipe = NULL;
-        ts->is_active = 0;
+    char bytes[32];
+    format_size(bytes, sizeof(bytes), plan.copy_bytes);
+    if (plan.copy_count == 0 && plan.dir_count == 0 && plan.extra_count == 0) {
+        mvwprintw(status, 0, 1, "Already in sync: %d files unchanged (compared in %.1fs)%s", plan.unchanged, seconds,
+                  plan.partial ? "; some directories could not be listed" : "");
+        wclrtoeol(status);
+        wrefresh(status);
+        sync_plan_free(&plan);
+        napms(1500);
         return 0;
     }
-    
-    return 1;
-}
-
-void cancel_transfer(TransferStatus *ts) {
-    if (ts->is_active) {
-        ts->cancel_requested = 1;
-        if (ts->pipe) {
-            int pid = -1;
-            char cmd[64];
-            snprintf(cmd, sizeof(cmd), "ps -o pid= -C scp");
-            FILE *fp = popen(cmd, "r");
-            if (fp) {
-                if (fscanf(fp, "%d", &pid) == 1 && pid > 0) {
-                    kill(pid, SIGTERM);
-                }
-                pclose(fp);
-            }
+    mvwprintw(status, 0, 1,
+              "%d new, %d changed (%s), %zu extra, %d unchanged%s%s, compared in %.1fs. "
+              "Sync? (y: copy, d: copy and delete extras, n: cancel)",
+              plan.new_files, plan.changed, bytes, plan.extra_count, plan.unchanged,
+              plan.conflicts ? ", type conflicts skipped" : "",
+              plan.partial ? ", listing incomplete so nothing is deleted" : "", seconds);
+    wclrtoeol(status);
+    wrefresh(status);
+    int confirm = wgetch(status);
+    int touched = 0;
+    if (confirm == 'd' || confirm == 'D') {
+        touched = 1;
+        if (plan.extra_count > 0 && !sync_delete_extras(&plan, upload, dest_root, host)) {
+            mvwprintw(status, 0, 1, "Some extras could not be deleted");
+            wclrtoeol(status);
+            wrefresh(status);
+            napms(1500);
         }
-        pthread_join(ts->thread, NULL);
-        ts->is_active = 0;
-        if (ts->pipe) {
-            pclose(ts->pipe);
-            ts->pipe = NULL;
+    }
+    if (confirm == 'y' || confirm == 'Y' || confirm == 'd' || confirm == 'D') {
+        touched = 1;
+        if (!sync_queue(&plan, upload, source_root, dest_root, host)) {
+            mvwprintw(status, 0, 1, "Cannot queue every copy to %s", dest_root);
+            wclrtoeol(status);
+            wrefresh(status);
+            napms(1500);
         }
     }
+    sync_plan_free(&plan);
+    return touched;
 }
 
-int file_exists(const char *path) {
-    return access(path, F_OK) != -1;
-}
-
-int remote_file_exists(const char *host, const char *path) {
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "ssh %s '[ -e \"%s\" ] && echo \"exists\" || echo \"not exists\"'", host, path);
-    FILE *fp = popen(cmd, "r");
-    if (!fp) return 0;
-    
-    char result[20];
-    int exists = 0;
-    if (fgets(result, sizeof(result), fp)) {
-        exists = (strncmp(result, "exists", 6) == 0);
+// Rate, average and ETA text for a transfer or the whole queue.
+void format_transfer_stats(char *buf, size_t size, const TransferStats *st) {
+    char done[16], total[16], rate[16], average[16], eta[16] = "--:--";
+    format_size(done, sizeof(done), st->done);
+    format_size(rate, sizeof(rate), (long long)st->rate);
+    format_size(average, sizeof(average), (long long)st->average);
+    if (st->total >= 0) {
+        format_size(total, sizeof(total), st->total);
+        double speed = st->rate > 0 ? st->rate : st->average;
+        if (speed > 0) format_duration(eta, sizeof(eta), (long long)((st->total - st->done) / speed));
+    } else {
+        strcpy(total, "?");
     }
-    pclose(fp);
-    return exists;
+    snprintf(buf, size, "%s/%s  %s/s (avg %s/s)  ETA %s", done, total, rate, average, eta);
 }
 
-void draw_progress_bar(WINDOW *win, int progress, const char *message) {
+void draw_progress_bar(WINDOW *win, int progress, const char *message, const TransferStats *stats,
+                       PaneDamage *damage) {
     int width = getmaxx(win) - 4;
     int filled = (progress * width) / 100;
     
+    char percent_str[128];
+    int len = snprintf(percent_str, sizeof(percent_str), "%3d%%", progress);
+    if (stats) {
+        snprintf(percent_str + len, sizeof(percent_str) - len, "  ");
+        format_transfer_stats(percent_str + len + 2, sizeof(percent_str) - len - 2, stats);
+    }
+    if ((int)strlen(percent_str) > width) percent_str[width > 0 ? width : 0] = '\0';
+    
+    int full = pane_damage_prepare(damage, getmaxy(win), getmaxx(win));
+    int changed = pane_damage_row(damage, 0, row_signature(message ? message : "", 2));
+    changed |= pane_damage_row(damage, 1, row_signature(percent_str, (uint64_t)filled << 2));
+    if (!full && !changed) return;
+    
     werase(win);
     box(win, 0, 0);
     
@@ -419,18 +7234,278 @@ void draw_progress_bar(WINDOW *win, int progress, const char *message) {
     }
     wattroff(win, COLOR_PAIR(COLOR_PAIR_PROGRESS) | A_REVERSE);
     
-    char percent_str[10];
-    snprintf(percent_str, sizeof(percent_str), "%3d%%", progress);
     wattron(win, A_BOLD);
     mvwprintw(win, 1, 2 + (width - strlen(percent_str)) / 2, "%s", percent_str);
     wattroff(win, A_BOLD);
     
-    wrefresh(win);
+    wnoutrefresh(win);
+}
+
+static const char *transfer_state_label(TransferJobState state) {
+    switch (state) {
+    case JOB_QUEUED: return "queued";
+    case JOB_RUNNING: return "running";
+    case JOB_DONE: return "done";
+    case JOB_FAILED: return "failed";
+    default: return "cancelled";
+    }
+}
+
+// Running jobs first, then queued ones, then finished ones, as many as fit.
+// A directory transfer stays at the top of the panel, as running, while
+// its walk goes on or any file it found has yet to land.
+static int transfer_walk_active(const TransferJob *job) {
+    const TransferStatus *ts = &job->status;
+    if (!(ts->options & TRANSFER_WALK)) return 0;
+    if (job->state == JOB_RUNNING || job->state == JOB_QUEUED) return 1;
+    const TreeWalk *walk = ts->walk;
+    return job->state == JOB_DONE && walk->files_done + walk->files_failed < walk->files_found;
+}
+
+// Found versus landed, in files and bytes, for a directory transfer.
+static int format_walk_progress(char *buf, size_t size, const TransferJob *job) {
+    const TreeWalk *walk = job->status.walk;
+    char done[16], found[16];
+    format_size(done, sizeof(done), walk->bytes_done);
+    format_size(found, sizeof(found), walk->bytes_found);
+    int len = snprintf(buf, size, "%d/%d files  %s/%s", walk->files_done, walk->files_found, done, found);
+    if (len > 0 && (size_t)len < size && walk->files_failed > 0) {
+        len += snprintf(buf + len, size - len, "  %d failed", walk->files_failed);
+    }
+    if (len > 0 && (size_t)len < size && job->state != JOB_DONE) {
+        snprintf(buf + len, size - len, "  %s %d dirs", job->status.phase ? "creating" : "walking", walk->dirs);
+    }
+    if (walk->bytes_found > 0) return (int)(walk->bytes_done * 100 / walk->bytes_found);
+    return walk->files_found > 0 ? walk->files_done * 100 / walk->files_found : 0;
+}
+
+void draw_transfer_queue(WINDOW *win, PaneDamage *damage) {
+    int rows = getmaxy(win) - 2;
+    int width = getmaxx(win) - 4;
+    static const TransferJobState order[] = {JOB_RUNNING, JOB_QUEUED, JOB_FAILED, JOB_CANCELLED, JOB_DONE};
+
+    int full = pane_damage_prepare(damage, getmaxy(win), getmaxx(win));
+    if (full) {
+        werase(win);
+        box(win, 0, 0);
+    }
+    pthread_mutex_lock(&shaper.lock);
+    double total_cap = shaper.total.rate, each_cap = shaper.per_transfer;
+    pthread_mutex_unlock(&shaper.lock);
+    pthread_mutex_lock(&transfer_queue.lock);
+    char limits[96] = "";
+    if (total_cap > 0 || each_cap > 0) {
+        // The caps next to what the running transfers put on the wire
+        // together, which for compressed ones is less than their file rate.
+        double achieved = 0;
+        for (TransferJob *job = transfer_queue.head; job; job = job->next) {
+            if (job->state != JOB_RUNNING) continue;
+            double ratio = job->status.codec ? transfer_compress_ratio(&job->status) : 0;
+            achieved += ratio > 0 ? job->status.stats.rate / ratio : job->status.stats.rate;
+        }
+        char total[16] = "", each[16] = "", rate[16];
+        format_size(rate, sizeof(rate), (long long)achieved);
+        if (total_cap > 0) format_size(total, sizeof(total), (long long)total_cap);
+        if (each_cap > 0) format_size(each, sizeof(each), (long long)each_cap);
+        snprintf(limits, sizeof(limits), "| cap %s%s%s%s%s, at %s/s ", total, total_cap > 0 ? "/s" : "",
+                 total_cap > 0 && each_cap > 0 ? ", " : "", each, each_cap > 0 ? "/s each" : "", rate);
+    }
+    char title[256];
+    snprintf(title, sizeof(title), " Transfers: %d running, %d queued, %d done, %d failed, %d cancelled | %d workers %s",
+             transfer_queue.counts[JOB_RUNNING], transfer_queue.counts[JOB_QUEUED],
+             transfer_queue.counts[JOB_DONE], transfer_queue.counts[JOB_FAILED],
+             transfer_queue.counts[JOB_CANCELLED], transfer_queue.worker_count, limits);
+    pane_damage_title(damage, win, full, 2, title);
+    int y = 1;
+    for (int k = -1; k < (int)(sizeof(order) / sizeof(order[0])) && y <= rows; k++) {
+        if (k >= 0 && transfer_queue.counts[order[k]] == 0) continue;
+        for (TransferJob *job = transfer_queue.head; job && y <= rows; job = job->next) {
+            int walk_active = transfer_walk_active(job);
+            if (k < 0 ? !walk_active : walk_active || job->state != order[k]) continue;
+            const TransferStatus *ts = &job->status;
+            const char *name = strrchr(ts->source, '/');
+            name = name ? name + 1 : ts->source;
+            const char *label = transfer_state_label(walk_active ? JOB_RUNNING : job->state);
+            int progress = ts->progress;
+            char bundle_name[PATH_MAX];
+            const char *current = ts->current;
+            if (ts->options & TRANSFER_WALK) {
+                snprintf(bundle_name, sizeof(bundle_name), "%s/", name);
+                name = bundle_name;
+            } else if (ts->files > 0 && job->state == JOB_RUNNING && current) {
+                // A bundle reports the file it is on rather than its folder.
+                snprintf(bundle_name, sizeof(bundle_name), "[%d/%d] %s", ts->files_done + 1, ts->files, current);
+                name = bundle_name;
+            } else if (ts->files > 0) {
+                snprintf(bundle_name, sizeof(bundle_name), "%d files from %s/", ts->files, name);
+                name = bundle_name;
+            }
+            char detail[96] = "";
+            if (ts->options & TRANSFER_WALK && job->state != JOB_FAILED) {
+                progress = format_walk_progress(detail, sizeof(detail), job);
+            } else if (job->state == JOB_RUNNING && ts->retry_at_ms > 0) {
+                long long wait = (ts->retry_at_ms - monotonic_ms() + 999) / 1000;
+                snprintf(detail, sizeof(detail), "retry %d/%d in %llds: %.50s", ts->attempts + 1,
+                         transfer_retries, wait > 0 ? wait : 0, ts->error);
+            } else if (job->state == JOB_RUNNING && ts->phase) {
+                snprintf(detail, sizeof(detail), "%s", ts->phase);
+            } else if (job->state == JOB_RUNNING) {
+                format_transfer_stats(detail, sizeof(detail), &ts->stats);
+                if (ts->streams > 1 && ts->stream_rate > 0) {
+                    // What one stream manages alone, next to the total above.
+                    char single[16];
+                    size_t len = strlen(detail);
+                    format_size(single, sizeof(single), (long long)ts->stream_rate);
+                    snprintf(detail + len, sizeof(detail) - len, "  x%d, 1 stream %s/s", ts->streams, single);
+                } else if (ts->codec && transfer_compress_ratio(ts) > 0) {
+                    size_t len = strlen(detail);
+                    snprintf(detail + len, sizeof(detail) - len, "  %s %.1fx", ts->codec, transfer_compress_ratio(ts));
+                }
+            } else if (job->state == JOB_FAILED) {
+                snprintf(detail, sizeof(detail), "%.60s", ts->error);
+            } else if (job->state == JOB_DONE && ts->cache_hit) {
+                snprintf(detail, sizeof(detail), "from cache (%s)", ts->cache_hit);
+            } else if (job->state == JOB_DONE && ts->saved > 0) {
+                char saved[16], total[16];
+                format_size(saved, sizeof(saved), (long long)ts->saved);
+                format_size(total, sizeof(total), (long long)ts->stats.total);
+                snprintf(detail, sizeof(detail), "delta: %s of %s not sent", saved, total);
+            } else if (job->state == JOB_DONE && ts->stats.average > 0 && ts->streams > 1) {
+                char average[16], single[16];
+                format_size(average, sizeof(average), (long long)ts->stats.average);
+                format_size(single, sizeof(single), (long long)ts->stream_rate);
+                snprintf(detail, sizeof(detail), "avg %s/s over %d streams (1 stream %s/s)", average, ts->streams,
+                         single);
+            } else if (job->state == JOB_DONE && ts->stats.average > 0 && ts->codec &&
+                       transfer_compress_ratio(ts) > 0) {
+                // The average counts file bytes; the link carried ratio times fewer.
+                char average[16], wire[16];
+                double ratio = transfer_compress_ratio(ts);
+                format_size(average, sizeof(average), (long long)ts->stats.average);
+                format_size(wire, sizeof(wire), (long long)(ts->stats.average / ratio));
+                snprintf(detail, sizeof(detail), "avg %s/s, %s %.1fx (%s/s on the wire)", average, ts->codec, ratio,
+                         wire);
+            } else if (job->state == JOB_DONE && ts->stats.average > 0) {
+                char average[16];
+                format_size(average, sizeof(average), (long long)ts->stats.average);
+                snprintf(detail, sizeof(detail), "avg %s/s", average);
+            }
+            if (job->state == JOB_DONE && ts->verified) {
+                size_t len = strlen(detail);
+                snprintf(detail + len, sizeof(detail) - len, "%s", ts->verified > 0 ? "  verified" : "  unverified");
+            }
+            int name_width = width - 23 - (int)strlen(detail);
+            if (name_width < 8) name_width = 8;
+            char line[PATH_MAX + 160];
+            snprintf(line, sizeof(line), "%-9s %s %3d%%  %-*.*s %s", label,
+                     ts->direction == 1 ? "up  " : "down", progress,
+                     name_width, name_width, name, detail);
+            if (!pane_damage_row(damage, y, row_signature(line, 0))) {
+                y++;
+                continue;
+            }
+            mvwprintw(win, y, 1, "%*s", width + 2, "");
+            if (job->state == JOB_FAILED) wattron(win, A_BOLD);
+            mvwprintw(win, y++, 2, "%.*s", width, line);
+            if (job->state == JOB_FAILED) wattroff(win, A_BOLD);
+        }
+    }
+    pthread_mutex_unlock(&transfer_queue.lock);
+    for (; y <= rows; y++) {
+        if (pane_damage_row(damage, y, 1)) {
+            mvwprintw(win, y, 1, "%*s", width + 2, "");
+        }
+    }
+    wnoutrefresh(win);
+}
+
+// Byte totals over every job still on the panel, for the summary bar. The
+// rate is the sum of the running jobs' rates, which is what the link sees.
+int transfer_queue_progress(char *message, size_t size, TransferStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    long long now = monotonic_ms(), started = now;
+    int unknown = 0;
+    pthread_mutex_lock(&transfer_queue.lock);
+    for (TransferJob *job = transfer_queue.head; job; job = job->next) {
+        const TransferStats *st = &job->status.stats;
+        if (job->state == JOB_CANCELLED) continue;
+        if (st->total < 0) unknown = 1;
+        else stats->total += st->total;
+        if (job->state == JOB_RUNNING || job->state == JOB_DONE || job->state == JOB_FAILED) {
+            stats->done += st->done;
+            stats->resumed += st->resumed;
+            if (st->started_ms > 0 && st->started_ms < started) started = st->started_ms;
+        }
+        if (job->state == JOB_RUNNING) stats->rate += st->rate;
+    }
+    snprintf(message, size, "Transfers: %d running, %d queued (T: queue, C: cancel, X: clear)",
+             transfer_queue.counts[JOB_RUNNING], transfer_queue.counts[JOB_QUEUED]);
+    pthread_mutex_unlock(&transfer_queue.lock);
+    if (now > started) stats->average = (stats->done - stats->resumed) * 1000.0 / (now - started);
+    int progress = stats->total > 0 ? (int)(stats->done * 100 / stats->total) : 0;
+    if (unknown) stats->total = -1;
+    return progress > 100 ? 100 : progress;
+}
+
+// Terminal output per frame, measured as the UI thread's write(2) byte count
+// around doupdate() while the debug line is shown.
+typedef struct {
+    long long last;
+    long long total;
+    long frames;
+} FrameStats;
+
+static long long thread_bytes_written(void) {
+    FILE *fp = fopen("/proc/thread-self/io", "r");
+    if (!fp) return -1;
+    char line[64];
+    long long written = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "wchar: %lld", &written) == 1) break;
+    }
+    fclose(fp);
+    return written;
+}
+
+static void flush_frame(FrameStats *frames) {
+    long long before = frames ? thread_bytes_written() : -1;
+    doupdate();
+    if (before < 0) return;
+    long long after = thread_bytes_written();
+    if (after < before) return;
+    frames->last = after - before;
+    frames->total += frames->last;
+    frames->frames++;
+}
+
+void draw_debug_line(WINDOW *win, const FileList *local, const FileList *remote, const FrameStats *frames) {
+    werase(win);
+    pthread_mutex_lock(&listing_cache.lock);
+    long hits = listing_cache.hits, misses = listing_cache.misses, prefetch_hits = listing_cache.prefetch_hits;
+    pthread_mutex_unlock(&listing_cache.lock);
+    pthread_mutex_lock(&prefetcher.lock);
+    long issued = prefetcher.issued, completed = prefetcher.completed, cancelled = prefetcher.cancelled;
+    pthread_mutex_unlock(&prefetcher.lock);
+    pthread_mutex_lock(&download_cache.lock);
+    long blob_hits = download_cache.hits, blob_misses = download_cache.misses;
+    char saved[16];
+    format_size(saved, sizeof(saved), download_cache.saved);
+    pthread_mutex_unlock(&download_cache.lock);
+    size_t local_bytes = file_list_memory(local), remote_bytes = file_list_memory(remote);
+    mvwprintw(win, 0, 1, "tty: %lld B last frame, %lld B avg"
+              " | cache: %ld hits, %ld misses | prefetch: %ld hits, %ld issued, %ld done, %ld cancelled"
+              " | downloads: %ld cached, %ld fetched, %s saved"
+              " | mem: local %d x %zu B, remote %d x %zu B",
+              frames->last, frames->frames ? frames->total / frames->frames : 0,
+              hits, misses, prefetch_hits, issued, completed, cancelled, blob_hits, blob_misses, saved,
+              local->count, local->count ? local_bytes / local->count : 0,
+              remote->count, remote->count ? remote_bytes / remote->count : 0);
+    wnoutrefresh(win);
 }
 
 void file_manager_ui(const char *remote_host) {
     int left_focus = 1;
-    FileList local, remote;
+    FileList local = {0}, remote = {0};
     char local_path[PATH_MAX];
     char remote_path[PATH_MAX];
     
@@ -454,7 +7529,17 @@ void file_manager_ui(const char *remote_host) {
     resolve_remote_path(remote_path, sizeof(remote_path), remote_host);
     
     read_local_dir(&local, local_path);
-    read_remote_dir(&remote, remote_host, remote_path);
+    ui_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    long long last_frame_ms = 0;
+    start_remote_lister();
+    read_remote_dir_async(&remote, remote_host, remote_path);
+    start_prefetcher();
+    journal_open(remote_host);
+    start_transfer_workers();
+    unsigned long seen_finished[2] = {0, 0};
+    int remote_stale = 0;
+    int prefetch_selected = -1;
+    char prefetch_cwd[PATH_MAX] = "";
 
     int win_height = LINES - 5;
     int win_width = COLS / 2 - 2;
@@ -463,54 +7548,138 @@ void file_manager_ui(const char *remote_host) {
     keypad(left, TRUE);
     keypad(right, TRUE);
     
-    WINDOW *progress_win = newwin(1, COLS-2, LINES-3, 1);
+    WINDOW *progress_win = newwin(2, COLS-2, LINES-4, 1);
     
     WINDOW *status = newwin(1, COLS, LINES-2, 0);
     mvwprintw(status, 0, 1,
-        "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
+        STATUS_HELP_TEXT);
     wrefresh(status);
+    journal_offer_resume(status, remote_host);
+    
+    WINDOW *debug_win = newwin(1, COLS, LINES-1, 0);
+    int show_debug = 0;
+    
+    WINDOW *queue_win = newwin(QUEUE_PANEL_ROWS, COLS-2, 1 + win_height - QUEUE_PANEL_ROWS, 1);
+    int show_queue = 0;
+    int pane_height = win_height;
 
+    PaneDamage left_damage = {0}, right_damage = {0}, progress_damage = {0}, queue_damage = {0};
+    FrameStats frames = {0};
+    char header[2][PATH_MAX + 64] = {"", ""};
+    
     int ch;
     while (1) {
-        move(0, 0);
-        clrtoeol();
-        mvprintw(0, 1, "Local: %s", local.cwd);
-        mvprintw(0, COLS/2 + 1, "Remote: %s", remote.cwd);
-        refresh();
+        char line[2][PATH_MAX + 64];
+        snprintf(line[0], sizeof(line[0]), "Local: %s", local.cwd);
+        if (ssh_master.op_count > 0) {
+            snprintf(line[1], sizeof(line[1]), "Remote: %s [%ld ms, avg %ld ms%s%s]", remote.cwd,
+                     ssh_master.last_op_ms, ssh_master.total_op_ms / ssh_master.op_count,
+                     ssh_master.active ? "" : ", no master",
+                     sftp_session.alive ? "" : ", shell");
+        } else {
+            snprintf(line[1], sizeof(line[1]), "Remote: %s", remote.cwd);
+        }
+        if (strcmp(line[0], header[0]) != 0 || strcmp(line[1], header[1]) != 0) {
+            memcpy(header, line, sizeof(header));
+            move(0, 0);
+            clrtoeol();
+            mvprintw(0, 1, "%s", header[0]);
+            mvprintw(0, COLS/2 + 1, "%s", header[1]);
+            wnoutrefresh(stdscr);
+        }
         
-        if (current_transfer.is_active) {
+        int transfers_busy = transfer_queue_busy();
+        if (transfers_busy) {
             char message[256];
-            if (current_transfer.direction == 1) {
-                snprintf(message, sizeof(message), "Uploading: %s", basename(current_transfer.source));
-            } else {
-                snprintf(message, sizeof(message), "Downloading: %s", basename(current_transfer.source));
-            }
-            draw_progress_bar(progress_win, current_transfer.progress, message);
+            TransferStats stats;
+            int progress = transfer_queue_progress(message, sizeof(message), &stats);
+            draw_progress_bar(progress_win, progress, message, &stats, &progress_damage);
         } else {
-            werase(progress_win);
-            box(progress_win, 0, 0);
-            wrefresh(progress_win);
+            int full = pane_damage_prepare(&progress_damage, getmaxy(progress_win), getmaxx(progress_win));
+            if (pane_damage_row(&progress_damage, 0, 1) || full) {
+                werase(progress_win);
+                box(progress_win, 0, 0);
+                wnoutrefresh(progress_win);
+            }
+        }
+        
+        pthread_mutex_lock(&transfer_queue.lock);
+        unsigned long finished_downloads = transfer_queue.finished[0], finished_uploads = transfer_queue.finished[1];
+        int pending_uploads = transfer_queue.pending[1];
+        pthread_mutex_unlock(&transfer_queue.lock);
+        if (finished_downloads != seen_finished[0]) {
+            seen_finished[0] = finished_downloads;
+            char highlighted[PATH_MAX];
+            strcpy(highlighted, file_name(&local, local.selected));
+            FileList old = {0};
+            file_list_copy(&old, &local);
+            read_local_dir(&local, local.cwd);
+            merge_entry_state(&local, highlighted, &old);
+            file_list_free(&old);
+        }
+        // Re-listing the remote pane drops its highlight, so wait until the
+        // uploads have drained instead of re-listing after every file.
+        if (finished_uploads != seen_finished[1]) {
+            seen_finished[1] = finished_uploads;
+            remote_stale = 1;
+        }
+        if (remote_stale && pending_uploads == 0) {
+            remote_stale = 0;
+            listing_cache_invalidate(remote_host, remote.cwd);
+            read_remote_dir_async(&remote, remote_host, remote.cwd);
+        }
+        
+        int wanted_height = show_queue ? win_height - QUEUE_PANEL_ROWS : win_height;
+        if (wanted_height != pane_height) {
+            pane_height = wanted_height;
+            wresize(left, pane_height, win_width);
+            wresize(right, pane_height, win_width);
+            pane_damage_invalidate(&queue_damage);
+            FileList *lists[2] = {&local, &remote};
+            for (int i = 0; i < 2; i++) {
+                if (lists[i]->selected >= lists[i]->scroll_offset + pane_height - 2) {
+                    lists[i]->scroll_offset = lists[i]->selected - (pane_height - 2) + 1;
+                }
+            }
+        }
+        
+        remote_lister_poll(&remote, pane_height - 2);
+        int remote_loading = remote_lister_loading();
+        
+        if (!left_focus && (remote.selected != prefetch_selected || strcmp(remote.cwd, prefetch_cwd) != 0)) {
+            prefetch_around(remote_host, &remote);
+            prefetch_selected = remote.selected;
+            strcpy(prefetch_cwd, remote.cwd);
+        }
+        if (show_debug) {
+            draw_debug_line(debug_win, &local, &remote, &frames);
         }
         
-        draw_file_list(left, &local, left_focus, win_width, win_height, "Local");
-        draw_file_list(right, &remote, !left_focus, win_width, win_height, "Remote");
+        draw_file_list(left, &local, left_focus, win_width, pane_height, "Local", &left_damage);
+        draw_file_list(right, &remote, !left_focus, win_width, pane_height,
+                       remote_loading ? "Remote (loading...)" : "Remote", &right_damage);
+        if (show_queue) {
+            draw_transfer_queue(queue_win, &queue_damage);
+        }
         
-        if (left_focus)
-            ch = wgetch(left);
-        else
-            ch = wgetch(right);
+        WINDOW *focus_win = left_focus ? left : right;
+        // Leave the cursor on the focused pane, as wrefresh used to.
+        wnoutrefresh(focus_win);
+        flush_frame(show_debug ? &frames : NULL);
+        int journal_held = journal_flush(0);
+        ch = ui_wait_key(focus_win, &last_frame_ms, transfers_busy || journal_held ? UI_TICK_MS : -1);
+        if (ch == ERR) continue;
             
         if (ch == 'q' || ch == 'Q') {
-            if (current_transfer.is_active) {
-                mvwprintw(status, 0, 1, "Transfer in progress, confirm exit? (y/n)");
+            if (transfer_queue_busy()) {
+                mvwprintw(status, 0, 1, "Transfers in progress, cancel them and exit? (y/n)");
                 wrefresh(status);
                 int confirm = wgetch(status);
                 if (confirm == 'y' || confirm == 'Y') {
-                    cancel_transfer(&current_transfer);
                     break;
                 } else {
                     mvwprintw(status, 0, 1,
-                        "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
+                        STATUS_HELP_TEXT);
                     wclrtoeol(status);
                     wrefresh(status);
                     continue;
@@ -534,7 +7703,7 @@ void file_manager_ui(const char *remote_host) {
             FileList *fl = left_focus ? &local : &remote;
             if (fl->selected < fl->count-1) {
                 fl->selected++;
-                int display_count = win_height - 2;
+                int display_count = pane_height - 2;
                 if (fl->selected >= fl->scroll_offset + display_count) {
                     fl->scroll_offset = fl->selected - display_count + 1;
                 }
@@ -542,7 +7711,7 @@ void file_manager_ui(const char *remote_host) {
         } else if (ch == 10 || ch == KEY_ENTER || ch == '\n') {
             FileList *fl = left_focus ? &local : &remote;
             int idx = fl->selected;
-            char *sel = fl->files[idx].name;
+            const char *sel = file_name(fl, idx);
             
             if (strcmp(sel, "..") == 0) {
                 char *slash = strrchr(fl->cwd, '/');
@@ -568,266 +7737,176 @@ void file_manager_ui(const char *remote_host) {
             if (left_focus) {
                 read_local_dir(&local, fl->cwd);
             } else {
-                read_remote_dir(&remote, remote_host, fl->cwd);
+                read_remote_dir_async(&remote, remote_host, fl->cwd);
             }
         } else if (ch == ' ') {
             FileList *fl = left_focus ? &local : &remote;
             int idx = fl->selected;
             
-            if (strcmp(fl->files[idx].name, "..") != 0) {
+            if (strcmp(file_name(fl, idx), "..") != 0) {
                 fl->files[idx].selected = !fl->files[idx].selected;
             }
-        } else if (ch == KEY_F(5)) {
-            if (current_transfer.is_active) {
-                mvwprintw(status, 0, 1, "A transfer is already in progress, please wait for it to complete");
-                wclrtoeol(status);
-                wrefresh(status);
-                napms(1500);
-                mvwprintw(status, 0, 1,
-                    "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
-                wclrtoeol(status);
-                wrefresh(status);
-                continue;
-            }
+        } else if (ch == KEY_F(5) || ch == KEY_F(6) || ch == 'u' || ch == 'U') {
+            int upload = ch != KEY_F(5);
+            int options = ch == 'u' || ch == 'U' ? TRANSFER_DELTA : 0;
+            FileList *src = upload ? &local : &remote;
+            const char *dest_dir = upload ? remote.cwd : local.cwd;
             
             int has_selected = 0;
-            for (int i = 0; i < remote.count; i++) {
-                if (remote.files[i].selected) {
+            for (int i = 0; i < src->count; i++) {
+                if (src->files[i].selected) {
                     has_selected = 1;
                     break;
                 }
             }
             
-            if (!has_selected && remote.selected > 0 && !remote.files[remote.selected].is_dir) {
-                remote.files[remote.selected].selected = 1;
+            if (!has_selected && src->selected > 0) {
+                src->files[src->selected].selected = 1;
                 has_selected = 1;
             }
             
             if (has_selected) {
-                for (int i = 0; i < remote.count; i++) {
-                    if (!remote.files[i].selected) continue;
-                    
-                    char src_path[PATH_MAX], dest_path[PATH_MAX];
-                    
-                    if (strcmp(remote.cwd, "/") == 0) {
-                        snprintf(src_path, sizeof(src_path), "/%s", remote.files[i].name);
+                unsigned char *exists = calloc(src->count, 1);
+                if (exists) {
+                    if (upload) {
+                        remote_files_exist(remote_host, &remote, remote.cwd, &local, exists);
                     } else {
-                        snprintf(src_path, sizeof(src_path), "%s/%s", remote.cwd, remote.files[i].name);
-                    }
-                    
-                    snprintf(dest_path, sizeof(dest_path), "%s/%s", local.cwd, remote.files[i].name);
-                    
-                    if (file_exists(dest_path)) {
-                        mvwprintw(status, 0, 1, "File %s already exists, overwrite? (y/n)", remote.files[i].name);
-                        wclrtoeol(status);
-                        wrefresh(status);
-                        int confirm = wgetch(status);
-                        if (confirm != 'y' && confirm != 'Y') {
-                            remote.files[i].selected = 0;
-                            continue;
+                        for (int i = 0; i < remote.count; i++) {
+                            if (!remote.files[i].selected) continue;
+                            char dest_path[PATH_MAX];
+                            join_path(dest_path, sizeof(dest_path), local.cwd, file_name(&remote, i));
+                            exists[i] = file_exists(dest_path);
                         }
                     }
-                    
-                    strncpy(current_transfer.source, src_path, sizeof(current_transfer.source)-1);
-                    strncpy(current_transfer.dest, dest_path, sizeof(current_transfer.dest)-1);
-                    strncpy(current_transfer.hostname, remote_host, sizeof(current_transfer.hostname)-1);
-                    current_transfer.direction = 0;
-                    
-                    if (start_file_transfer(&current_transfer)) {
-                        while (current_transfer.is_active) {
-                            char message[256];
-                            snprintf(message, sizeof(message), "Downloading %s", remote.files[i].name);
-                            draw_progress_bar(progress_win, current_transfer.progress, message);
-                            wrefresh(progress_win);
-                            napms(100);
-                            
-                            nodelay(status, TRUE);
-                            int key = wgetch(status);
-                            nodelay(status, FALSE);
-                            
-                            if (key == 'q' || key == 'Q') {
-                                mvwprintw(status, 0, 1, "Cancel transfer? (y/n)");
-                                wclrtoeol(status);
-                                wrefresh(status);
-                                int confirm = wgetch(status);
-                                if (confirm == 'y' || confirm == 'Y') {
-                                    cancel_transfer(&current_transfer);
-                                    break;
-                                } else {
-                                    mvwprintw(status, 0, 1,
-                                        "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
-                                    wclrtoeol(status);
-                                    wrefresh(status);
-                                }
-                            }
-                        }
-                    } else {
-                        mvwprintw(status, 0, 1, "Unable to start transfer %s", remote.files[i].name);
-                        wclrtoeol(status);
-                        wrefresh(status);
-                        napms(1500);
-                    }
-                    
-                    remote.files[i].selected = 0;
+                    confirm_overwrites(status, src, exists);
+                    free(exists);
                 }
+                if (!options) queue_small_file_bundles(upload, src, dest_dir, remote_host, NULL);
                 
-                read_local_dir(&local, local.cwd);
-                
-                werase(progress_win);
-                box(progress_win, 0, 0);
-                mvwprintw(progress_win, 1, 2, "Transfer complete");
-                wrefresh(progress_win);
+                for (int i = 0; i < src->count; i++) {
+                    if (!src->files[i].selected) continue;
+                    
+                    char src_path[PATH_MAX], dest_path[PATH_MAX];
+                    join_path(src_path, sizeof(src_path), src->cwd, file_name(src, i));
+                    join_path(dest_path, sizeof(dest_path), dest_dir, file_name(src, i));
+                    int queued = src->files[i].is_dir
+                        ? transfer_queue_add_walk(upload, src_path, dest_path, remote_host, options)
+                        : transfer_queue_add(upload, src_path, dest_path, remote_host, src->files[i].size, options);
+                    if (!queued) break;
+                    src->files[i].selected = 0;
+                }
+                show_queue = 1;
                 
                 mvwprintw(status, 0, 1,
-                    "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
+                    STATUS_HELP_TEXT);
                 wclrtoeol(status);
                 wrefresh(status);
             } else {
-                mvwprintw(status, 0, 1, "Please select a file to download");
+                mvwprintw(status, 0, 1, upload ? "Please select a file to upload" : "Please select a file to download");
                 wclrtoeol(status);
                 wrefresh(status);
                 napms(1500);
                 
                 mvwprintw(status, 0, 1,
-                    "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
+                    STATUS_HELP_TEXT);
                 wclrtoeol(status);
                 wrefresh(status);
             }
-        } else if (ch == KEY_F(6)) {
-            if (current_transfer.is_active) {
-                mvwprintw(status, 0, 1, "A transfer is already in progress, please wait for it to complete");
-                wclrtoeol(status);
-                wrefresh(status);
-                napms(1500);
-                mvwprintw(status, 0, 1,
-                    "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
-                wclrtoeol(status);
-                wrefresh(status);
-                continue;
+        } else if (ch == 's' || ch == 'S') {
+            // The focused pane is the source; a selected directory is synced
+            // into the same name on the other side, otherwise the two
+            // current directories are.
+            int upload = left_focus;
+            FileList *src = upload ? &local : &remote;
+            const char *dest_cwd = upload ? remote.cwd : local.cwd;
+            char source_root[PATH_MAX], dest_root[PATH_MAX];
+            int idx = src->selected;
+            if (idx >= 0 && idx < src->count && src->files[idx].is_dir && strcmp(file_name(src, idx), "..") != 0) {
+                join_path(source_root, sizeof(source_root), src->cwd, file_name(src, idx));
+                join_path(dest_root, sizeof(dest_root), dest_cwd, file_name(src, idx));
+            } else {
+                snprintf(source_root, sizeof(source_root), "%s", src->cwd);
+                snprintf(dest_root, sizeof(dest_root), "%s", dest_cwd);
             }
-            
-            int has_selected = 0;
-            for (int i = 0; i < local.count; i++) {
-                if (local.files[i].selected) {
-                    has_selected = 1;
-                    break;
+            if (run_sync(status, upload, source_root, dest_root, remote_host)) {
+                show_queue = 1;
+                if (upload) {
+                    listing_cache_invalidate(remote_host, remote.cwd);
+                    read_remote_dir_async(&remote, remote_host, remote.cwd);
+                } else {
+                    read_local_dir(&local, local.cwd);
                 }
             }
-            
-            if (!has_selected && local.selected > 0 && !local.files[local.selected].is_dir) {
-                local.files[local.selected].selected = 1;
-                has_selected = 1;
-            }
-            
-            if (has_selected) {
-                for (int i = 0; i < local.count; i++) {
-                    if (!local.files[i].selected) continue;
-                    
-                    char src_path[PATH_MAX], dest_path[PATH_MAX];
-                    
-                    if (strcmp(local.cwd, "/") == 0) {
-                        snprintf(src_path, sizeof(src_path), "/%s", local.files[i].name);
-                    } else {
-                        snprintf(src_path, sizeof(src_path), "%s/%s", local.cwd, local.files[i].name);
-                    }
-                    
-                    if (strcmp(remote.cwd, "/") == 0) {
-                        snprintf(dest_path, sizeof(dest_path), "/%s", local.files[i].name);
-                    } else {
-                        snprintf(dest_path, sizeof(dest_path), "%s/%s", remote.cwd, local.files[i].name);
-                    }
-                    
-                    if (remote_file_exists(remote_host, dest_path)) {
-                        mvwprintw(status, 0, 1, "File %s already exists, overwrite? (y/n)", local.files[i].name);
-                        wclrtoeol(status);
-                        wrefresh(status);
-                        int confirm = wgetch(status);
-                        if (confirm != 'y' && confirm != 'Y') {
-                            local.files[i].selected = 0;
-                            continue;
-                        }
-                    }
-                    
-                    strncpy(current_transfer.source, src_path, sizeof(current_transfer.source)-1);
-                    strncpy(current_transfer.dest, dest_path, sizeof(current_transfer.dest)-1);
-                    strncpy(current_transfer.hostname, remote_host, sizeof(current_transfer.hostname)-1);
-                    current_transfer.direction = 1;
-                    
-                    if (start_file_transfer(&current_transfer)) {
-                        while (current_transfer.is_active) {
-                            char message[256];
-                            snprintf(message, sizeof(message), "Uploading %s", local.files[i].name);
-                            draw_progress_bar(progress_win, current_transfer.progress, message);
-                            wrefresh(progress_win);
-                            napms(100);
-                            
-                            nodelay(status, TRUE);
-                            int key = wgetch(status);
-                            nodelay(status, FALSE);
-                            
-                            if (key == 'q' || key == 'Q') {
-                                mvwprintw(status, 0, 1, "Cancel transfer? (y/n)");
-                                wclrtoeol(status);
-                                wrefresh(status);
-                                int confirm = wgetch(status);
-                                if (confirm == 'y' || confirm == 'Y') {
-                                    cancel_transfer(&current_transfer);
-                                    break;
-                                } else {
-                                    mvwprintw(status, 0, 1,
-                                        "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
-                                    wclrtoeol(status);
-                                    wrefresh(status);
-                                }
-                            }
-                        }
-                    } else {
-                        mvwprintw(status, 0, 1, "Unable to start transfer %s", local.files[i].name);
-                        wclrtoeol(status);
-                        wrefresh(status);
-                        napms(1500);
-                    }
-                    
-                    local.files[i].selected = 0;
-                }
-                
-                read_remote_dir(&remote, remote_host, remote.cwd);
-                
-                werase(progress_win);
-                box(progress_win, 0, 0);
-                mvwprintw(progress_win, 1, 2, "Transfer complete");
-                wrefresh(progress_win);
-                
-                mvwprintw(status, 0, 1,
-                    "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
-                wclrtoeol(status);
-                wrefresh(status);
-            } else {
-                mvwprintw(status, 0, 1, "Please select a file to upload");
+            mvwprintw(status, 0, 1,
+                STATUS_HELP_TEXT);
+            wclrtoeol(status);
+            wrefresh(status);
+        } else if (ch == 't' || ch == 'T') {
+            show_queue = !show_queue;
+        } else if (ch == 'x' || ch == 'X') {
+            transfer_queue_clear_finished();
+        } else if (ch == 'l' || ch == 'L') {
+            prompt_bandwidth_limits(status);
+            mvwprintw(status, 0, 1,
+                STATUS_HELP_TEXT);
+            wclrtoeol(status);
+            wrefresh(status);
+        } else if (ch == 'c' || ch == 'C') {
+            if (transfer_queue_busy()) {
+                mvwprintw(status, 0, 1, "Cancel all queued and running transfers? (y/n)");
                 wclrtoeol(status);
                 wrefresh(status);
-                napms(1500);
-                
+                int confirm = wgetch(status);
+                if (confirm == 'y' || confirm == 'Y') {
+                    transfer_queue_cancel_all();
+                }
                 mvwprintw(status, 0, 1,
-                    "Tab: Switch panel | Enter: Open directory | Space: Select file | F5: Download | F6: Upload | P: Show hidden files | Q: Quit");
+                    STATUS_HELP_TEXT);
                 wclrtoeol(status);
                 wrefresh(status);
             }
+        } else if (ch == 'r' || ch == 'R') {
+            if (left_focus) {
+                read_local_dir(&local, local.cwd);
+            } else {
+                listing_cache_invalidate(remote_host, remote.cwd);
+                read_remote_dir_async(&remote, remote_host, remote.cwd);
+            }
+        } else if (ch == 'd' || ch == 'D') {
+            show_debug = !show_debug;
+            if (!show_debug) {
+                werase(debug_win);
+                wrefresh(debug_win);
+            }
         } else if (ch == 'p' || ch == 'P') {
             show_hidden_files = !show_hidden_files;
             read_local_dir(&local, local.cwd);
-            read_remote_dir(&remote, remote_host, remote.cwd);
+            read_remote_dir_async(&remote, remote_host, remote.cwd);
         }
     }
     
-    if (current_transfer.is_active) {
-        cancel_transfer(&current_transfer);
+    journal_close();
+    stop_transfer_workers();
+    stop_prefetcher();
+    stop_remote_lister();
+    if (ui_wake_fd >= 0) {
+        int fd = ui_wake_fd;
+        ui_wake_fd = -1;
+        close(fd);
     }
     
     delwin(left);
     delwin(right);
     delwin(status);
     delwin(progress_win);
+    delwin(debug_win);
+    delwin(queue_win);
+    pane_damage_free(&left_damage);
+    pane_damage_free(&right_damage);
+    pane_damage_free(&progress_damage);
+    pane_damage_free(&queue_damage);
+    file_list_free(&local);
+    file_list_free(&remote);
 }
 
 void print_menu(WINDOW *menu_win, int highlight, char hosts[][MAX_HOSTNAME_LEN], int host_count, int win_width) {
@@ -957,6 +8036,22 @@ int main(int argc, char **argv) {
         printf("%s takes no arguments.\n", argv[0]);
         return 1;
     }
+    signal(SIGPIPE, SIG_IGN);
+    listing_cache.ttl_ms = env_long("SCP_TUI_CACHE_TTL", 30) * 1000;
+    prefetcher.budget = env_long("SCP_TUI_PREFETCH_BUDGET", 4);
+    local_scan_metadata = env_long("SCP_TUI_LOCAL_METADATA", 1) != 0;
+    transfer_queue.configured_workers = env_long("SCP_TUI_TRANSFER_WORKERS", 4);
+    transfer_retries = env_long("SCP_TUI_TRANSFER_RETRIES", 3);
+    transfer_resume = env_long("SCP_TUI_RESUME", 1) != 0;
+    transfer_streams = env_long("SCP_TUI_TRANSFER_STREAMS", 4);
+    if (transfer_streams > TRANSFER_MAX_STREAMS) transfer_streams = TRANSFER_MAX_STREAMS;
+    transfer_compress_level = env_long("SCP_TUI_COMPRESS", 1);
+    transfer_verify = env_long("SCP_TUI_VERIFY", 0) != 0;
+    sync_checksum = env_long("SCP_TUI_SYNC_CHECKSUM", 0) != 0;
+    const char *cache_limit = getenv("SCP_TUI_DOWNLOAD_CACHE");
+    download_cache_init(cache_limit ? (int64_t)parse_rate(cache_limit) : 0);
+    const char *total_cap = getenv("SCP_TUI_BANDWIDTH_LIMIT"), *each_cap = getenv("SCP_TUI_TRANSFER_LIMIT");
+    shaper_set(total_cap ? parse_rate(total_cap) : 0, each_cap ? parse_rate(each_cap) : 0);
     char hosts[MAX_HOSTS][MAX_HOSTNAME_LEN];
     int host_count = parse_ssh_config(hosts, MAX_HOSTS);
     if (host_count == 0) {
@@ -969,6 +8064,21 @@ int main(int argc, char **argv) {
         
         endwin();
         
+        printf("Connecting to %s...\n", hosts[selected]);
+        fflush(stdout);
+        if (!start_ssh_master(hosts[selected])) {
+            printf("Unable to open a shared connection, falling back to one ssh per command\n");
+            stop_ssh_master();
+            napms(1000);
+        }
+        atexit(stop_ssh_master);
+        
+        if (!sftp_open_session(&sftp_session, hosts[selected])) {
+            printf("SFTP subsystem unavailable, using shell commands instead\n");
+            napms(1000);
+        }
+        atexit(close_sftp_session);
+        
         initscr();
         clear();
         refresh();